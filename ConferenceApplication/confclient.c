@@ -9,49 +9,49 @@
 //
 
 #include "utils.h"
+#include "addr.h"
 
 int
 main(int argc, char **argv)
 {
-    int                sockfd, maxfd, n;
-    socklen_t          addrlen;
-    struct sockaddr_in servaddr, localaddr;
-    fd_set             rset, allset;
-    char               sendbuff[MAXLINE], recvbuff[MAXLINE], welcome[MAXLINE];
+    int                     sockfd, maxfd, n;
+    socklen_t               addrlen;
+    struct endpoint         server, local;
+    struct sockaddr_storage servaddr;
+    fd_set                  rset, allset;
+    char                    sendbuff[MAXLINE], recvbuff[MAXLINE], welcome[MAXLINE];
 
     if (argc != 3) {
         perror("usage: confclient <servhost> <servport>");
         exit(0);
     }
 
-    if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("socket error");
+    // argv[1] == IP address, IPv4 or IPv6
+    if (addr_pton(&server, argv[1], 0) == 0) {
+        printf("inet_pton error for %s", argv[1]);
         exit(0);
     }
+    server.port = (uint16_t)atoi(argv[2]);
+    addrlen = addr_to(&server, 0, &servaddr);
 
-    bzero(&servaddr, sizeof(servaddr));
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_port = (uint16_t)atoi(argv[2]);
-
-    if (inet_pton(AF_INET, argv[1], &servaddr.sin_addr) <= 0) {
-        printf("inet_pton error for %s", argv[1]); // argv[1] == IP address
+    if ((sockfd = socket(servaddr.ss_family, SOCK_STREAM, 0)) < 0) {
+        perror("socket error");
         exit(0);
     }
 
-    if (connect(sockfd, (struct sockaddr *) &servaddr, sizeof(servaddr)) < 0) {
+    if (connect(sockfd, (struct sockaddr *) &servaddr, addrlen) < 0) {
         perror("connect error");
         exit(0);
     }
 
     // get the local protocol address
-    bzero(&localaddr, sizeof(localaddr));
-    addrlen = sizeof(localaddr);
-    if (getsockname(sockfd, (struct sockaddr *) &localaddr, &addrlen) < 0)
+    bzero(&local, sizeof(local));
+    if (addr_local(sockfd, &local) < 0)
         perror("socket name error");
 
     bzero(welcome, sizeof(welcome));
     sprintf(welcome, "Connected to server on \'%s\' at port \'%s\' through port \'%u\'\n",
-            argv[1], argv[2], localaddr.sin_port);
+            argv[1], argv[2], local.port);
     fputs(welcome, stdout);
     fflush(stdout);
 
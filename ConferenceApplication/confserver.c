@@ -3,154 +3,240 @@
 // between multiple clients. When the server receives a message from any of its
 // conference clients, it relays the message to all other conference clients.
 //
+// The server runs on the reactor of the shared library: every client is a
+// buffered connection, so that a client that reads slowly has its messages
+// queued instead of holding up the others. The messages and the clients
+// coming and going are logged through the log of the library, so a slow
+// standard output does not slow down the relaying. With METRICS_ENDPOINT set,
+// the server also answers requests for its metrics there.
+//
+// On SIGTERM or SIGINT the server drains: it stops accepting, tells every
+// client it shuts down and closes the connection once the messages queued for
+// the client are written, then exits. With HANDOFF_PATH set, a new server
+// started with the same path takes over the listen socket of the running one,
+// which then drains, so that the server is restarted without refusing anyone.
+//
 // Author: Tien Ho
 // Date:   10/06/16
 //
 
 #include "utils.h"
+#include "conn.h"
+#include "handoff.h"
+#include "listener.h"
+#include "logger.h"
+#include "metrics.h"
+
+#include <signal.h>
+
+#define MAXCLIENTS      FD_SETSIZE
+#define DRAIN_SPREAD    2000        /* ms over which the clients are let go */
+#define DRAIN_TICK      100         /* ms between letting some of them go */
+#define DRAIN_DEADLINE  10000       /* ms after which the clients left are closed */
+#define GOODBYE         "Server: shutting down\n"
+
+static struct conn *clients[MAXCLIENTS];    /* NULL if the entry is free */
+static char        names[MAXCLIENTS][ADDR_STRLEN + 16];   /* "'ip'(port)" of each client */
+static int         max = -1;                /* the last entry in use */
+static int         nclients;
+static int         relayed, fanout;         /* the ids of the metrics */
+static int         listenfd, handofffd = -1;
+static int         draining, ticks;
+static long long   drain_end;               /* all the clients are told by then */
+
+// a message from a client: broadcast it to all other clients, one line at a time
+static void
+relay(struct conn *c)
+{
+    char sendbuff[MAXLINE + 64], line[MAXLINE];
+    int  i, n, len, sent;
+
+    while ((n = conn_getline(c, line, sizeof(line))) > 0) {
+        len = snprintf(sendbuff, sizeof(sendbuff), "%s: %s", names[(long) c->arg], line);
+        logger_event(LOGGER_INFO, "%s", sendbuff);
+        for (i = sent = 0; i <= max; i++) {
+            if (clients[i] != NULL && clients[i] != c && conn_write(clients[i], sendbuff, len) == 0)
+                sent++;
+        }
+        metric_add(relayed, 1);
+        metric_observe(fanout, sent);
+    }
+}
+
+// the client terminates the connection
+static void
+leave(struct conn *c)
+{
+    int i = (int) (long) c->arg;
+
+    clients[i] = NULL;
+    nclients--;
+    logger_msg(LOGGER_INFO, "Server: disconnect from %s\n", names[i]);
+}
+
+// tell a client the server shuts down, and close it once its output is written
+static void
+goodbye(struct conn *c)
+{
+    if (conn_write(c, GOODBYE, strlen(GOODBYE)) == 0)
+        conn_finish(c);
+}
+
+// there is a new connection request
+static void
+join(struct reactor *r, int connfd, const struct endpoint *cliaddr, void *arg)
+{
+    char ip[ADDR_STRLEN];
+    int  i;
+
+    addr_ntop(cliaddr, ip, sizeof(ip));
+    logger_msg(LOGGER_INFO, "Server: connect from \'%s\' at port \'%u\'\n", ip, cliaddr->port);
+
+    // save the client connection
+    for (i = 0; i < MAXCLIENTS && clients[i] != NULL; i++)
+        ;
+    if (i == MAXCLIENTS || (clients[i] = conn_new(r, connfd, relay, leave, (void *) (long) i)) == NULL) {
+        perror("too many clients");
+        close(connfd);
+        return;
+    }
+    max = max(max, i);
+    nclients++;
+
+    // the name the messages of the client go out with, made once
+    snprintf(names[i], sizeof(names[i]), "\'%s\'(%u)", ip, cliaddr->port);
+
+    // accepted as the listen socket was let go
+    if (draining)
+        goodbye(clients[i]);
+}
+
+// Let go of the share of the clients still connected that is due by now, so
+// that they are spread over DRAIN_SPREAD instead of all reconnecting at once.
+// The server stops once they are all gone, but not before a tick has passed,
+// by which time the accept of the listen socket is surely cancelled.
+static void
+let_go(struct reactor *r, void *arg)
+{
+    long long left = drain_end - reactor_now();
+    int       i, n, waiting = 0;
+
+    for (i = 0; i <= max; i++) {
+        if (clients[i] != NULL && !clients[i]->finishing)
+            waiting++;
+    }
+    n = left <= DRAIN_TICK ? waiting : (int) ((waiting * DRAIN_TICK + left - 1) / left);
+    for (i = 0; i <= max && n > 0; i++) {
+        if (clients[i] != NULL && !clients[i]->finishing) {
+            goodbye(clients[i]);
+            n--;
+        }
+    }
+
+    if (nclients == 0 && ticks++ > 0)
+        reactor_stop(r);
+    else
+        reactor_timer(r, DRAIN_TICK, let_go, NULL);
+}
+
+// the clients that did not take their messages by the deadline
+static void
+cut(struct reactor *r, void *arg)
+{
+    int i;
+
+    logger_msg(LOGGER_WARN, "Server: closing %d clients at the deadline\n", nclients);
+    for (i = 0; i <= max; i++) {
+        if (clients[i] != NULL)
+            conn_close(clients[i]);
+    }
+}
+
+static void
+drain(struct reactor *r)
+{
+    if (draining)
+        return;
+    draining = 1;
+    logger_msg(LOGGER_INFO, "Server: shutting down, %d clients\n", nclients);
+
+    listener_remove(r, listenfd);
+    close(listenfd);
+    if (handofffd >= 0) {
+        reactor_remove(r, handofffd);
+        close(handofffd);
+    }
+
+    drain_end = reactor_now() + DRAIN_SPREAD;
+    reactor_timer(r, DRAIN_DEADLINE, cut, NULL);
+    let_go(r, NULL);
+}
+
+static void
+stop(struct reactor *r, int signo, void *arg)
+{
+    drain(r);
+}
+
+// the new server accepts on the listen socket
+static void
+handed_over(struct reactor *r, void *arg)
+{
+    logger_msg(LOGGER_INFO, "Server: handed the listen socket over\n");
+    drain(r);
+}
+
+// a new server connected to the handoff socket to take over; the clients are
+// served until it answers
+static void
+successor(struct reactor *r, int fd, int events, void *arg)
+{
+    handoff_give(r, fd, &listenfd, 1, handed_over, NULL);
+}
 
 int
 main(int argc, char **argv)
 {
-    int                listenfd, connfd, i, j, maxfd, nready, max, n, currentcli;
-    char               recvbuff[MAXLINE], sendbuff[MAXLINE], cliname[MAXLINE], message[MAXLINE];
-    struct sockaddr_in servaddr, cliaddr, localaddr;
-    socklen_t          clilen, addrlen;
-    int                client[FD_SETSIZE];
-    fd_set             rset, allset;
-
-    // create a listen socket
-    if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("socket error");
+    struct reactor r;
+    const char     *path = getenv("HANDOFF_PATH");
+    int            n = 0, conn = -1;
+
+    // take the listen socket of the server this one replaces, if any, or
+    // create one on any free port
+    if (path != NULL && (n = handoff_take(path, &listenfd, 1, &conn)) < 0) {
+        perror("handoff error");
         exit(0);
     }
-
-    bzero(&servaddr, sizeof(servaddr));
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    servaddr.sin_port = 0;
-
-    if (bind(listenfd, (struct sockaddr *) &servaddr, sizeof(servaddr)) < 0) {
+    if (n == 0 && (listenfd = tcp_listen(0, NULL)) < 0) {
         perror("error in binding");
         exit(0);
     }
 
-    // get the local protocol address
-    bzero(&localaddr, sizeof(localaddr));
-    addrlen = sizeof(localaddr);
-    if (getsockname(listenfd, (struct sockaddr *) &localaddr, &addrlen) < 0)
-        perror("socket name error");
-
-    printf("Started server at port %u\n", localaddr.sin_port);
+    // the clients take the port number as it is stored in the socket address
+    printf("Started server at port %u\n", htons(local_port(listenfd)));
     fflush(stdout);
 
-    if (listen(listenfd, LISTENQ) < 0)
+    if (reactor_init(&r, REACTOR_DEFAULT) < 0 || listener_add(&r, listenfd, 1, join, NULL) < 0 ||
+        reactor_signal(&r, SIGTERM, stop, NULL) < 0 || reactor_signal(&r, SIGINT, stop, NULL) < 0) {
+        perror("reactor error");
         exit(0);
+    }
 
-    // set all the entries in the client array to -1 => no connecting clients
-    for (i = 0; i < FD_SETSIZE; i++)
-        client[i] = -1;
-
-    maxfd = listenfd;
-    max = -1;
-    FD_ZERO(&allset);
-    FD_SET(listenfd, &allset);
-    for ( ; ; ) {
-        rset = allset; // reset the readset for select
-        nready = select(maxfd + 1, &rset, NULL, NULL, NULL);
-
-        clilen = sizeof(cliaddr);
-        // when there is a new connection request
-        if (FD_ISSET(listenfd, &rset)) {
-            if ((connfd = accept(listenfd, NULL, NULL)) < 0) {
-                perror("connection error");
-                continue;
-            }
-
-            // get the protocol address of the connected peer socket
-            bzero(&cliaddr, sizeof(cliaddr));
-            clilen = sizeof(cliaddr);
-            if (getpeername(connfd, (struct sockaddr *) &cliaddr, &clilen) < 0)
-                perror("socket name error");
-
-            bzero(message, sizeof(message));
-            sprintf(message, "Server: connect from \'%s\' at port \'%u\'\n", inet_ntoa(cliaddr.sin_addr), cliaddr.sin_port);
-            fputs(message, stdout);
-            fflush(stdout);
-
-            // save the client descriptor
-            for (i = 0; i < FD_SETSIZE; i++) {
-                if (client[i] < 0) {
-                    client[i] = connfd;
-                    break;
-                }
-            }
-            if (i == FD_SETSIZE) {
-                perror("too many clients");
-                exit(0);
-            }
-
-            // add this new descriptor for future select
-            FD_SET(connfd, &allset);
-            if (connfd > maxfd) {
-                maxfd = connfd;
-            }
-            if (i > max) {
-                max = i;
-            }
-            if (--nready <= 0) {
-                continue; // no more readable descriptors
-            }
-        }
+    relayed = metric_counter("conf_messages_relayed_total", "Messages relayed to the other clients.");
+    fanout = metric_histogram("conf_fanout_clients", "Clients a message was relayed to.", 1);
+    if (metrics_start() < 0) {
+        perror("metrics error");
+        exit(0);
+    }
 
-        for (i = 0; i <= max; i++) {
-            currentcli = client[i];
-            if (currentcli > -1) {
-                // socket is readable
-                if (FD_ISSET(currentcli, &rset)) {
-                    clilen = sizeof(cliaddr);
-                    if (getpeername(currentcli, (struct sockaddr *) &cliaddr, &clilen) < 0)
-                        perror("socket name error");
-
-                    bzero(recvbuff, sizeof(recvbuff));
-                    if ((n = read(currentcli, recvbuff, MAXLINE)) == 0) { // the client terminates the connection
-                        FD_CLR(currentcli, &allset);
-                        close(currentcli);
-                        client[i] = -1;
-
-                        bzero(message, sizeof(message));
-                        sprintf(message, "Server: disconnect from \'%s\'(%u)\n", inet_ntoa(cliaddr.sin_addr), cliaddr.sin_port);
-                        fputs(message, stdout);
-                        fflush(stdout);
-                    }
-                    else if (n > 0) {
-                        // broadcast the message to all other clients
-                        bzero(sendbuff, sizeof(sendbuff));
-                        bzero(cliname, sizeof(cliname));
-                        sprintf(cliname, "\'%s\'(%u): ", inet_ntoa(cliaddr.sin_addr), cliaddr.sin_port);
-                        strcpy(sendbuff, cliname);
-                        strcat(sendbuff, recvbuff);
-                        fputs(sendbuff, stdout);
-                        fflush(stdout);
-                        for (j = 0; j <= max; j++) {
-                            if (client[j] > -1 && client[j] != currentcli) {
-                                if(write(client[j], sendbuff, strlen(sendbuff)) < 0) {
-                                    perror("write error");
-                                    exit(0);
-                                }
-                            }
-                        }
-                    }
-                    else {
-                        perror("read error");
-                        exit(0);
-                    }
-
-                    if (--nready <= 0) {
-                        break; // no more readable descriptors
-                    }
-                }
-            }
-        }
+    // the old server lets go once this one accepts
+    handoff_ready(conn);
+    if (path != NULL &&
+        ((handofffd = handoff_listen(path)) < 0 || reactor_add(&r, handofffd, EV_READ, successor, NULL) < 0)) {
+        perror("handoff error");
+        exit(0);
     }
+
+    reactor_run(&r);
+    exit(0);
 }
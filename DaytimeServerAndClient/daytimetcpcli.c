@@ -1,34 +1,98 @@
-#include	"myfile.h"
+#include	"myFile.h"
+#include	<netdb.h>
+#include	<sys/time.h>
+
+#define	UDP_TRIES	3		/* datagrams sent before giving up */
+#define	UDP_TIMEOUT	1		/* seconds to wait for each answer */
+
+/* Ask for the time in a datagram, sending it again when no answer comes in
+ * time, since either datagram may be lost. */
+static void
+daytime_udp(struct addrinfo *ai)
+{
+    int				sockfd, n, i;
+    char			recvline[MAXLINE + 1];
+    struct timeval	tv = { UDP_TIMEOUT, 0 };
+
+    if ( (sockfd = socket(ai->ai_family, SOCK_DGRAM, 0)) < 0) {
+        perror("socket error");
+        exit(1);
+    }
+
+    /* a connected socket only receives the datagrams of the server */
+    if (connect(sockfd, ai->ai_addr, ai->ai_addrlen) < 0 ||
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+        perror("connect error");
+        exit(1);
+    }
+    freeaddrinfo(ai);
+
+    for (i = 0; i < UDP_TRIES; i++) {
+        if (write(sockfd, "", 0) < 0) {
+            perror("write error");
+            exit(1);
+        }
+        if ( (n = read(sockfd, recvline, MAXLINE)) >= 0) {
+            recvline[n] = 0;	/* null terminate */
+            fputs(recvline, stdout);
+            exit(0);
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            perror("read error");
+            exit(1);
+        }
+    }
+
+    fprintf(stderr, "no answer after %d tries\n", UDP_TRIES);
+    exit(1);
+}
 
 int
 main(int argc, char **argv)
 {
-    int					sockfd, n;
-    char				recvline[MAXLINE + 1];
-    struct sockaddr_in	servaddr;
+    int					sockfd, n, c, err;
+    int					udp = 0, port = SERV_PORT;
+    char				recvline[MAXLINE + 1], serv[16];
+    struct addrinfo		hints, *ai;
 
-    if (argc != 2) {
-        perror("usage: a.out <IPaddress>");
+    while ( (c = getopt(argc, argv, "up:")) != -1) {
+        if (c == 'u')
+            udp = 1;
+        else if (c == 'p')
+            port = atoi(optarg);
+        else
+            exit(1);
+    }
+
+    if (argc - optind != 1) {
+        perror("usage: a.out [-u] [-p port] <IPaddress>");
         exit (1);
     }
 
-    if ( (sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("socket error");
+    /* the address is IPv4 or IPv6, whichever is given */
+    bzero(&hints, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = udp ? SOCK_DGRAM : SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+    snprintf(serv, sizeof(serv), "%d", port);	/* daytime server */
+    if ( (err = getaddrinfo(argv[optind], serv, &hints, &ai)) != 0) {
+        fprintf(stderr, "getaddrinfo error for %s: %s\n", argv[optind], gai_strerror(err));
         exit(1);
     }
 
-    bzero(&servaddr, sizeof(servaddr));
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_port   = htons(SERV_PORT);	/* daytime server */
-    if (inet_pton(AF_INET, argv[1], &servaddr.sin_addr) <= 0) {
-        printf("inet_pton error for %s", argv[1]);
-        exit(0);
+    if (udp)
+        daytime_udp(ai);
+
+    if ( (sockfd = socket(ai->ai_family, SOCK_STREAM, 0)) < 0) {
+        perror("socket error");
+        exit(1);
     }
 
-    if (connect(sockfd, (struct sockaddr *) &servaddr, sizeof(servaddr)) < 0) {
+    if (connect(sockfd, ai->ai_addr, ai->ai_addrlen) < 0) {
         perror("connect error");
         exit(1);
     }
+    freeaddrinfo(ai);
 
     while ( (n = read(sockfd, recvline, MAXLINE)) > 0) {
         recvline[n] = 0;	/* null terminate */
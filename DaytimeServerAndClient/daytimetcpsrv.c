@@ -1,49 +1,480 @@
-#include	"myfile.h"
+#define	_GNU_SOURCE		/* recvmmsg */
+#include	"myFile.h"
+#include	"handoff.h"
+#include	"listener.h"
+#include	"metrics.h"
 #include	<time.h>
+#include	<pthread.h>
+#include	<signal.h>
 
-int
-main(int argc, char **argv)
+/* The coarse clock is read without a system call; it is precise enough for
+ * a response that changes once per second. */
+#ifdef CLOCK_REALTIME_COARSE
+#define	DAYTIME_CLOCK	CLOCK_REALTIME_COARSE
+#else
+#define	DAYTIME_CLOCK	CLOCK_REALTIME
+#endif
+
+#define	MAXTHREADS	256
+#define	MAXSOCKS	(MAXTHREADS + 1)	/* the listen sockets and the UDP one */
+#define	UDP_BATCH	64		/* datagrams received and answered per system call */
+#define	DRAIN_GRACE	100		/* ms for the accepts in flight to be cancelled */
+
+/* The response is formatted once per second and written as it is to every
+ * client connected within that second. Each listener thread keeps its own,
+ * so that the threads share nothing. */
+struct daytime {
+	char	response[64];
+	size_t	len;
+	time_t	sec;
+};
+
+/* the settings of the listen sockets, from the command line */
+static int	port = SERV_PORT;
+static int	backlog = LISTENQ;
+static int	nthreads;		/* 0 for the iterative server */
+static int	lingerzero;		/* reset the connections instead of closing them */
+static int	fastopen;		/* TCP_FASTOPEN queue length, 0 if off */
+static int	deferaccept;	/* TCP_DEFER_ACCEPT seconds, 0 if off */
+static int	udp;			/* answer datagrams on the same port too */
+
+/* A listener, in a thread of its own with -t and in the main thread of the
+ * iterative server. It has one listen socket, or several when it took over
+ * from a server that had more threads than it has. */
+struct worker {
+	struct reactor	r;
+	struct daytime	d;
+	int				fds[MAXSOCKS];
+	int				nfds;
+	pthread_t		tid;
+};
+
+static struct worker	*workers;
+static int	nworkers;
+static int	udpfd = -1;
+static int	handofffd = -1;
+static int	stopfds[2];		/* readable once the server stops */
+static int	draining;
+static int	handedoff;		/* another server took the sockets over */
+
+/* the ids of the metrics */
+static int	tcpreqs, udpreqs;
+
+static const char *
+daytime_response(struct daytime *d, size_t *len)
 {
-	int					listenfd, connfd;
-	struct sockaddr_in	servaddr;
-	char				buff[MAXLINE];
-	time_t				ticks;
-	//char * ip = "127.0.0.1";
+	struct timespec	now;
+	char			text[26];
 
-	listenfd = socket(AF_INET, SOCK_STREAM, 0);
-	if (listenfd < 0)
-		exit(0);
+	clock_gettime(DAYTIME_CLOCK, &now);
+	if (now.tv_sec != d->sec) {
+		d->sec = now.tv_sec;
+		ctime_r(&now.tv_sec, text);
+		d->len = snprintf(d->response, sizeof(d->response), "%.24s\r\n", text);
+	}
 
-	bzero(&servaddr, sizeof(servaddr));
-	servaddr.sin_family      = AF_INET;
-	servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-	servaddr.sin_port        = htons(SERV_PORT);	/* daytime server */
+	*len = d->len;
+	return d->response;
+}
 
+/* Create a listen socket bound to the daytime port. With reuseport, every
+ * listener thread binds its own socket to the port and the kernel spreads
+ * the connections over them. */
+static int
+open_listener(int reuseport)
+{
+	struct listenopts	opts;
+	int					listenfd;
 
-	//if (inet_pton(AF_INET, ip, &servaddr.sin_addr) <= 0) {
+	bzero(&opts, sizeof(opts));
+	opts.backlog = backlog;
+	opts.reuseport = reuseport;
+	opts.fastopen = fastopen;
+	/* the connection is only handed over once the client sent data or the
+	 * time is up; a client that sends nothing waits out the time */
+	opts.deferaccept = deferaccept;
 
-	if (bind(listenfd, (struct sockaddr *) &servaddr, sizeof(servaddr)) < 0) {
+	if ((listenfd = tcp_listen(port, &opts)) < 0) {
 		perror("error in bind");
 		exit(0);
 	}
 
-	if( listen(listenfd, LISTENQ) <0)
-		exit(0);
+	return listenfd;
+}
 
+/* Write the response to a client and close the connection. With lingerzero
+ * the connection is reset, so that the server keeps no TIME_WAIT state; a
+ * client may then lose the response if the reset overtakes it. */
+static void
+answer(int connfd, struct daytime *d)
+{
+	struct linger	lg = { 1, 0 };
+	const char		*buff;
+	size_t			len;
+
+	buff = daytime_response(d, &len);
+	metric_add(tcpreqs, 1);
+	if( write(connfd, buff, len) < 0) {
+		perror("error in writing");
+	}
+	else
+		metric_add(NET_BYTES_OUT, len);
+
+	if (lingerzero)
+		setsockopt(connfd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+	close(connfd);
+}
+
+/* The UDP listener, as in RFC 867: any datagram is answered with the time.
+ * The datagrams waiting on the socket are taken with one recvmmsg and their
+ * answers sent with one sendmmsg; every answer is the same buffer. */
+static void *
+udp_listener(void *arg)
+{
+	struct daytime		d;
+	struct sockaddr_storage	cliaddr[UDP_BATCH];
+	struct iovec		iov[UDP_BATCH];
+	char				discard[UDP_BATCH][16];
+	const char			*buff;
+	size_t				len;
+	int					fd, i, n;
+#ifdef MSG_WAITFORONE
+	struct mmsghdr		msgs[UDP_BATCH];
+#endif
+
+	bzero(&d, sizeof(d));
+	d.sec = -1;
+	fd = udpfd;
 
 	for ( ; ; ) {
-		connfd = accept(listenfd, (struct sockaddr *) NULL, NULL);
-		if (connfd<0) {
-			perror("connection failure");
+#ifdef MSG_WAITFORONE
+		/* the requests are read into scratch buffers and thrown away */
+		bzero(msgs, sizeof(msgs));
+		for (i = 0; i < UDP_BATCH; i++) {
+			iov[i].iov_base = discard[i];
+			iov[i].iov_len = sizeof(discard[i]);
+			msgs[i].msg_hdr.msg_name = &cliaddr[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(cliaddr[i]);
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		/* wait for one datagram, then take whatever else is queued */
+		if ((n = recvmmsg(fd, msgs, UDP_BATCH, MSG_WAITFORONE, NULL)) < 0) {
+			if (errno != EINTR)
+				perror("recvmmsg error");
 			continue;
 		}
 
-        ticks = time(NULL);
-        snprintf(buff, sizeof(buff), "%.24s\r\n", ctime(&ticks));
-        if( write(connfd, buff, strlen(buff)) < 0) {
-		    perror("error in writing");
-	    }
+		buff = daytime_response(&d, &len);
+		for (i = 0; i < n; i++) {
+			iov[i].iov_base = (void *) buff;
+			iov[i].iov_len = len;
+		}
+		metric_add(udpreqs, n);
+		if (sendmmsg(fd, msgs, n, 0) < 0)
+			perror("sendmmsg error");
+#else
+		socklen_t	clilen = sizeof(cliaddr[0]);
 
-	close(connfd);
+		if (recvfrom(fd, discard[0], sizeof(discard[0]), 0, (struct sockaddr *) &cliaddr[0], &clilen) < 0) {
+			if (errno != EINTR)
+				perror("recvfrom error");
+			continue;
+		}
+		buff = daytime_response(&d, &len);
+		metric_add(udpreqs, 1);
+		if (sendto(fd, buff, len, 0, (struct sockaddr *) &cliaddr[0], clilen) < 0)
+			perror("sendto error");
+#endif
+	}
+
+	return NULL;
+}
+
+static void
+accepted(struct reactor *r, int connfd, const struct endpoint *cliaddr, void *arg)
+{
+	answer(connfd, arg);
+}
+
+static void
+stop_loop(struct reactor *r, void *arg)
+{
+	reactor_stop(r);
+}
+
+/* The server stops: stop accepting, and leave the loop once the accepts
+ * io_uring has in flight are cancelled. The stop pipe is never read, so
+ * that every listener sees it. */
+static void
+stop_worker(struct reactor *r, int fd, int events, void *arg)
+{
+	struct worker	*w = arg;
+	int				i;
+
+	reactor_remove(r, fd);
+	for (i = 0; i < w->nfds; i++)
+		listener_remove(r, w->fds[i]);
+	reactor_timer(r, DRAIN_GRACE, stop_loop, NULL);
+}
+
+static void
+worker_init(struct worker *w)
+{
+	int	i;
+
+	bzero(&w->d, sizeof(w->d));
+	w->d.sec = -1;
+	if (reactor_init(&w->r, REACTOR_DEFAULT) < 0 ||
+		reactor_add(&w->r, stopfds[0], EV_READ, stop_worker, w) < 0) {
+		perror("reactor error");
+		exit(0);
+	}
+	for (i = 0; i < w->nfds; i++) {
+		if (listener_add(&w->r, w->fds[i], 1, accepted, &w->d) < 0) {
+			perror("reactor error");
+			exit(0);
+		}
+	}
+}
+
+/* Answer the clients left in the backlog of a listen socket, nonblocking by
+ * now, when no other server takes them over. */
+static void
+answer_backlog(int listenfd, struct daytime *d)
+{
+	int	connfd;
+
+	while ((connfd = accept(listenfd, NULL, NULL)) >= 0 || errno == EINTR || errno == ECONNABORTED) {
+		if (connfd >= 0)
+			answer(connfd, d);
+	}
+}
+
+/* A listener: the reactor waits for its listen sockets to be readable, then
+ * every connection queued on one is accepted and answered until accept says
+ * EAGAIN. The reactor is set up by the thread that runs it, as io_uring
+ * wants. */
+static void
+worker_run(struct worker *w)
+{
+	int	i;
+
+	reactor_run(&w->r);
+	if (!handedoff) {
+		for (i = 0; i < w->nfds; i++)
+			answer_backlog(w->fds[i], &w->d);
+	}
+}
+
+static void *
+listener(void *arg)
+{
+	worker_init(arg);
+	worker_run(arg);
+	return NULL;
+}
+
+static void
+drain(struct reactor *r)
+{
+	if (draining)
+		return;
+	draining = 1;
+
+	if (handofffd >= 0) {
+		reactor_remove(r, handofffd);
+		close(handofffd);
+	}
+	if (write(stopfds[1], "", 1) < 0)
+		perror("write error");
+	/* with -t, the main thread only waits for the listeners */
+	if (nthreads > 0)
+		reactor_stop(r);
+}
+
+static void
+stop(struct reactor *r, int signo, void *arg)
+{
+	drain(r);
+}
+
+/* the new server serves on the sockets */
+static void
+handed_over(struct reactor *r, void *arg)
+{
+	handedoff = 1;
+	drain(r);
+}
+
+/* a new server connected to the handoff socket to take over; the listeners
+ * go on accepting until it answers */
+static void
+successor(struct reactor *r, int fd, int events, void *arg)
+{
+	int	socks[MAXSOCKS + 1], n = 0, i, j;
+
+	for (i = 0; i < nworkers; i++) {
+		for (j = 0; j < workers[i].nfds; j++)
+			socks[n++] = workers[i].fds[j];
+	}
+	if (udpfd >= 0)
+		socks[n++] = udpfd;
+
+	handoff_give(r, fd, socks, n, handed_over, NULL);
+}
+
+/* Share out the sockets taken over from the server this one replaces: the
+ * UDP one, if datagrams are answered, and the listen sockets in turn to the
+ * listeners. */
+static void
+take_sockets(int *fds, int n)
+{
+	socklen_t	len;
+	int			i, k = 0, type;
+
+	for (i = 0; i < n; i++) {
+		len = sizeof(type);
+		if (getsockopt(fds[i], SOL_SOCKET, SO_TYPE, &type, &len) < 0 || (type == SOCK_DGRAM && (!udp || udpfd >= 0))) {
+			close(fds[i]);
+			continue;
+		}
+		if (type == SOCK_DGRAM)
+			udpfd = fds[i];
+		else {
+			workers[k % nworkers].fds[workers[k % nworkers].nfds++] = fds[i];
+			k++;
+		}
+	}
+}
+
+/* daytimetcpsrv [-p port] [-t threads] [-b backlog] [-l] [-f qlen] [-d secs] [-u]
+ *
+ * Without -t the server is iterative: the main thread accepts and answers
+ * the clients itself. With -t n, n threads each accept on a SO_REUSEPORT
+ * listen socket of their own, draining it with nonblocking accepts before
+ * they wait again. -b sets the listen backlog, which the kernel caps at
+ * net.core.somaxconn. -l resets every connection after the response instead
+ * of closing it, -f turns on TCP Fast Open and -d sets TCP_DEFER_ACCEPT,
+ * which only helps with clients that send a request: a daytime client that
+ * sends nothing is held for the whole delay. -u answers datagrams on the same
+ * port as well, in a thread of their own. With METRICS_ENDPOINT set, the
+ * metrics are served there.
+ *
+ * On SIGTERM or SIGINT the server stops accepting, answers the clients left
+ * in the backlogs and exits. With HANDOFF_PATH set, a new server started with
+ * the same path takes over the sockets of the running one, which then stops
+ * without answering the backlogs, since the new server does; the new server
+ * is started with the same options, or at least -t if the old one had it. */
+int
+main(int argc, char **argv)
+{
+	struct reactor	control, *r;
+	const char		*path = getenv("HANDOFF_PATH");
+	int				fds[MAXSOCKS], c, i, n = 0, conn = -1;
+	pthread_t		tid;
+
+	while ((c = getopt(argc, argv, "p:t:b:lf:d:u")) != -1) {
+		if (c == 'p')
+			port = atoi(optarg);
+		else if (c == 't' && ((nthreads = atoi(optarg)) < 1 || nthreads > MAXTHREADS)) {
+			fprintf(stderr, "the number of threads must be between 1 and %d\n", MAXTHREADS);
+			exit(0);
+		}
+		else if (c == 'b' && (backlog = atoi(optarg)) < 1) {
+			fprintf(stderr, "the backlog must be positive\n");
+			exit(0);
+		}
+		else if (c == 'l')
+			lingerzero = 1;
+		else if (c == 'f')
+			fastopen = atoi(optarg);
+		else if (c == 'd')
+			deferaccept = atoi(optarg);
+		else if (c == 'u')
+			udp = 1;
+		else if (c == '?') {
+			fprintf(stderr, "usage: daytimetcpsrv [-p port] [-t threads] [-b backlog] [-l] [-f fastopen queue]\n"
+					"                     [-d defer seconds] [-u]\n");
+			exit(0);
+		}
+	}
+
+	/* the metrics are registered before the threads count into them */
+	tcpreqs = metric_counter("daytime_requests_total{proto=\"tcp\"}", "Requests answered.");
+	udpreqs = metric_counter("daytime_requests_total{proto=\"udp\"}", NULL);
+
+	/* take the sockets of the server this one replaces, if any, and open
+	 * the ones still missing; the endpoint of the metrics is among them */
+	if (path != NULL && (n = handoff_take(path, fds, MAXSOCKS, &conn)) < 0) {
+		perror("handoff error");
+		exit(0);
+	}
+	if (metrics_start() < 0) {
+		perror("metrics error");
+		exit(0);
+	}
+	nworkers = nthreads > 0 ? nthreads : 1;
+	workers = calloc(nworkers, sizeof(struct worker));
+	take_sockets(fds, n);
+	for (i = 0; i < nworkers; i++) {
+		/* with -t, every thread accepts on a listen socket of its own */
+		if (workers[i].nfds == 0)
+			workers[i].fds[workers[i].nfds++] = open_listener(nthreads > 0);
+	}
+	if (udp && udpfd < 0 && (udpfd = udp_bind(port, 0)) < 0) {
+		perror("error in bind");
+		exit(0);
+	}
+	if (pipe(stopfds) < 0) {
+		perror("pipe error");
+		exit(0);
+	}
+
+	if (udp && pthread_create(&tid, NULL, udp_listener, NULL) != 0) {
+		perror("pthread_create error");
+		exit(0);
+	}
+
+	/* with -t, the main thread waits for the signals and for a server to take
+	 * over while the listener threads serve; the iterative server does both
+	 * in the main thread */
+	if (nthreads > 0) {
+		for (i = 0; i < nthreads; i++) {
+			if (pthread_create(&workers[i].tid, NULL, listener, &workers[i]) != 0) {
+				perror("pthread_create error");
+				exit(0);
+			}
+		}
+		if (reactor_init(&control, REACTOR_DEFAULT) < 0) {
+			perror("reactor error");
+			exit(0);
+		}
+		r = &control;
+	}
+	else {
+		worker_init(&workers[0]);
+		r = &workers[0].r;
+	}
+
+	if (reactor_signal(r, SIGTERM, stop, NULL) < 0 || reactor_signal(r, SIGINT, stop, NULL) < 0) {
+		perror("reactor error");
+		exit(0);
+	}
+	handoff_ready(conn);
+	if (path != NULL &&
+		((handofffd = handoff_listen(path)) < 0 || reactor_add(r, handofffd, EV_READ, successor, NULL) < 0)) {
+		perror("handoff error");
+		exit(0);
+	}
+
+	if (nthreads > 0) {
+		reactor_run(r);
+		for (i = 0; i < nthreads; i++)
+			pthread_join(workers[i].tid, NULL);
 	}
+	else
+		worker_run(&workers[0]);
+	exit(0);
 }
@@ -1,24 +1,11 @@
 #ifndef	__my_h
 #define	__my_h
 
-#include	<sys/socket.h>	/* basic socket definitions */
-#include	<arpa/inet.h>	/* inet(3) functions */
-#include	<errno.h>
-#include	<stdio.h>
-#include	<stdlib.h>
-#include	<string.h>
+#include	"net.h"
 
-#define	MAXLINE		4096	/* max text line length */
 #define	MAXSOCKADDR  128	/* max socket address structure size */
-#define	BUFFSIZE	8192	/* buffer size for reads and writes */
-#define LISTENQ 10
 
 /* Define some port number that can be used for client-servers */
 #define	SERV_PORT		 8877			/* TCP and UDP client-servers */
 
-#define	min(a,b)	((a) < (b) ? (a) : (b))
-#define	max(a,b)	((a) > (b) ? (a) : (b))
-
-
-
 #endif	/* __unp_h */
@@ -0,0 +1,335 @@
+//
+// The connection manager of the peer program. It decides which candidate from
+// the peersfile the peer should connect to next so that the peer keeps a
+// target number of neighbors. A candidate that cannot be reached, or whose
+// connection is lost, is put to sleep for a jittered exponential backoff
+// delay and the next candidates are tried instead. The backoff timers are
+// kept in a min-heap so that the peer can compute the select() timeout from
+// the earliest one. Peers learned from the neighbors are appended after the
+// peersfile entries; once PASSIVE_MAX of them are known, a new one replaces a
+// random learned candidate that is not in use.
+//
+// Author: Tien Ho
+// Date:   12/05/16
+//
+
+#include "connmgr.h"
+
+// current time in milliseconds from a clock that does not jump
+long long
+now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+heap_swap(struct connmgr *cm, int a, int b)
+{
+    struct timer tmp = cm->heap[a];
+
+    cm->heap[a] = cm->heap[b];
+    cm->heap[b] = tmp;
+    cm->cands[cm->heap[a].cand].timer = a;
+    cm->cands[cm->heap[b].cand].timer = b;
+}
+
+static void
+heap_up(struct connmgr *cm, int i)
+{
+    while (i > 0 && cm->heap[(i - 1) / 2].when > cm->heap[i].when) {
+        heap_swap(cm, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void
+heap_down(struct connmgr *cm, int i)
+{
+    int child;
+
+    for ( ; ; ) {
+        child = 2 * i + 1;
+        if (child >= cm->nheap)
+            break;
+        if (child + 1 < cm->nheap && cm->heap[child + 1].when < cm->heap[child].when)
+            child++;
+        if (cm->heap[i].when <= cm->heap[child].when)
+            break;
+        heap_swap(cm, i, child);
+        i = child;
+    }
+}
+
+// remove the timer at position i of the heap
+static void
+heap_remove(struct connmgr *cm, int i)
+{
+    cm->cands[cm->heap[i].cand].timer = NO_TIMER;
+    cm->nheap--;
+    if (i == cm->nheap)
+        return;
+
+    cm->heap[i] = cm->heap[cm->nheap];
+    cm->cands[cm->heap[i].cand].timer = i;
+    heap_up(cm, i);
+    heap_down(cm, cm->cands[cm->heap[i].cand].timer);
+}
+
+// put the candidate to sleep for a random delay in [d/2, d], where d doubles
+// with every consecutive failure, so that peers restarted together do not
+// retry each other in lockstep
+static void
+backoff(struct connmgr *cm, int cand)
+{
+    struct candidate *c = &cm->cands[cand];
+    long long        delay = BACKOFF_BASE;
+    int              i;
+
+    for (i = 1; i < c->failures && delay < BACKOFF_MAX; i++)
+        delay *= 2;
+    delay = min(delay, BACKOFF_MAX);
+    delay = delay / 2 + rand() % (delay / 2 + 1);
+
+    if (c->timer != NO_TIMER)
+        heap_remove(cm, c->timer);
+    c->state = CAND_BACKOFF;
+    c->timer = cm->nheap;
+    cm->heap[cm->nheap].when = now_ms() + delay;
+    cm->heap[cm->nheap].cand = cand;
+    cm->nheap++;
+    heap_up(cm, c->timer);
+}
+
+void
+cm_init(struct connmgr *cm, struct peer *peers, int npeers, int target)
+{
+    int i;
+
+    bzero(cm, sizeof(*cm));
+    cm->ncands = npeers;
+    cm->nseeds = npeers;
+    cm->capacity = npeers + PASSIVE_MAX;
+    cm->target = target;
+    cm->cands = calloc(cm->capacity, sizeof(struct candidate));
+    cm->heap = calloc(cm->capacity, sizeof(struct timer));
+    if (cm->cands == NULL || cm->heap == NULL) {
+        perror("connection manager allocation error");
+        exit(0);
+    }
+
+    for (i = 0; i < npeers; i++) {
+        cm->cands[i].addr = peers[i];
+        cm->cands[i].state = CAND_IDLE;
+        cm->cands[i].timer = NO_TIMER;
+    }
+
+    srand(getpid() ^ now_ms());
+}
+
+// Pick the next candidate to connect to, given the number of neighbors the
+// peer currently has (established or connecting). Returns -1 when the target
+// is met or every candidate is either in use or backing off. Candidates are
+// picked round-robin so that a dropped neighbor is replaced by a different
+// candidate rather than retried immediately.
+int
+cm_next(struct connmgr *cm, int nneighbors)
+{
+    int i, cand;
+
+    if (nneighbors >= cm->target)
+        return -1;
+
+    for (i = 0; i < cm->ncands; i++) {
+        cand = (cm->cursor + i) % cm->ncands;
+        if (cm->cands[cand].state == CAND_IDLE) {
+            cm->cands[cand].state = CAND_PENDING;
+            cm->cursor = (cand + 1) % cm->ncands;
+            return cand;
+        }
+    }
+
+    return -1;
+}
+
+void
+cm_connected(struct connmgr *cm, int cand)
+{
+    cm->cands[cand].failures = 0;
+}
+
+void
+cm_failed(struct connmgr *cm, int cand)
+{
+    cm->cands[cand].failures++;
+    backoff(cm, cand);
+}
+
+// a neighbor that was established went away: give it a short rest before it
+// becomes eligible again so that a flapping peer is not hammered
+void
+cm_disconnected(struct connmgr *cm, int cand)
+{
+    cm->cands[cand].failures = 1;
+    backoff(cm, cand);
+}
+
+void
+cm_resolving(struct connmgr *cm, int cand)
+{
+    cm->cands[cand].state = CAND_RESOLVING;
+}
+
+// the address lookup of a candidate finished; an unset address means that the
+// lookup failed, which is retried like a failed connection
+void
+cm_resolved(struct connmgr *cm, int cand, const struct endpoint *addr, long long expires)
+{
+    struct candidate *c = &cm->cands[cand];
+
+    if (c->state != CAND_RESOLVING)
+        return;
+
+    if (addr_unset(addr)) {
+        cm_failed(cm, cand);
+        return;
+    }
+
+    memcpy(c->addr.ep.ip, addr->ip, sizeof(addr->ip));
+    c->expires = expires;
+    c->state = CAND_IDLE;
+}
+
+// never hand out this candidate again
+void
+cm_exclude(struct connmgr *cm, int cand)
+{
+    if (cm->cands[cand].timer != NO_TIMER)
+        heap_remove(cm, cm->cands[cand].timer);
+    cm->cands[cand].state = CAND_SELF;
+}
+
+// Remember a peer learned from a neighbor. Returns the index of its candidate,
+// which may be an existing one, or -1 if the passive view has no room. A
+// peer of the peersfile not resolved yet is known by its host name, which
+// matches if it is the address written out.
+int
+cm_add(struct connmgr *cm, const struct endpoint *ep)
+{
+    struct candidate *c;
+    struct endpoint  named;
+    int              i, victim, nvictims = 0;
+
+    for (i = 0; i < cm->ncands; i++) {
+        c = &cm->cands[i];
+        if (c->addr.ep.port != ep->port)
+            continue;
+        if (addr_equal(&c->addr.ep, ep) ||
+            (addr_unset(&c->addr.ep) && addr_pton(&named, c->addr.hostname, ntohs(ep->port)) && addr_equal(&named, ep)))
+            return i;
+    }
+
+    if (cm->ncands < cm->capacity) {
+        i = cm->ncands++;
+    } else {
+        // pick a random learned candidate that is idle or backing off
+        victim = -1;
+        for (i = cm->nseeds; i < cm->ncands; i++) {
+            if (cm->cands[i].state == CAND_IDLE || cm->cands[i].state == CAND_BACKOFF) {
+                if (rand() % ++nvictims == 0)
+                    victim = i;
+            }
+        }
+        if (victim < 0)
+            return -1;
+        i = victim;
+        if (cm->cands[i].timer != NO_TIMER)
+            heap_remove(cm, cm->cands[i].timer);
+    }
+
+    // the address is numeric and never needs to be looked up
+    c = &cm->cands[i];
+    bzero(c, sizeof(*c));
+    addr_ntop(ep, c->addr.hostname, MAXHOST);
+    c->addr.ep = *ep;
+    c->state = CAND_IDLE;
+    c->timer = NO_TIMER;
+    c->expires = LLONG_MAX;
+
+    return i;
+}
+
+// Attach a candidate to a neighbor that connected to us so that it is not
+// dialed while that connection lasts. Returns -1 if the candidate is in use.
+int
+cm_claim(struct connmgr *cm, int cand)
+{
+    struct candidate *c = &cm->cands[cand];
+
+    if (c->state != CAND_IDLE && c->state != CAND_BACKOFF)
+        return -1;
+
+    if (c->timer != NO_TIMER)
+        heap_remove(cm, c->timer);
+    c->state = CAND_PENDING;
+    c->failures = 0;
+
+    return 0;
+}
+
+// Fill out with up to n random candidates whose address is known and that
+// were not failing when last tried. Returns the number of candidates copied.
+int
+cm_sample(struct connmgr *cm, struct peer *out, int n)
+{
+    int i, j, seen = 0;
+
+    for (i = 0; i < cm->ncands; i++) {
+        if (addr_unset(&cm->cands[i].addr.ep) || cm->cands[i].failures > 0 || cm->cands[i].state == CAND_SELF)
+            continue;
+
+        // reservoir sampling keeps every eligible candidate equally likely
+        if (seen < n)
+            out[seen] = cm->cands[i].addr;
+        else if ((j = rand() % (seen + 1)) < n)
+            out[j] = cm->cands[i].addr;
+        seen++;
+    }
+
+    return min(seen, n);
+}
+
+// Wake up every candidate whose backoff has elapsed. Returns the number of
+// candidates that became eligible again.
+int
+cm_expire(struct connmgr *cm, long long now)
+{
+    int n = 0;
+
+    while (cm->nheap > 0 && cm->heap[0].when <= now) {
+        cm->cands[cm->heap[0].cand].state = CAND_IDLE;
+        heap_remove(cm, 0);
+        n++;
+    }
+
+    return n;
+}
+
+// Fill in the select() timeout until the earliest timer. Returns 0 when no
+// timer is pending, in which case select() may block indefinitely.
+int
+cm_timeout(struct connmgr *cm, long long now, struct timeval *tv)
+{
+    long long wait;
+
+    if (cm->nheap == 0)
+        return 0;
+
+    wait = max(cm->heap[0].when - now, 0);
+    tv->tv_sec = wait / 1000;
+    tv->tv_usec = (wait % 1000) * 1000;
+
+    return 1;
+}
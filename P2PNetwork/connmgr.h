@@ -0,0 +1,72 @@
+//
+// The header file for the connection manager of the peer program. The
+// connection manager keeps the peer connected to a target number of
+// neighbors. Candidates come from the peersfile; a candidate whose connection
+// fails or drops is retried later with jittered exponential backoff, and
+// other candidates are rotated in to replace it in the meantime. A candidate
+// is only dialed while its resolved address is fresh. Besides the peers of the
+// peersfile, the candidates include a bounded passive view of peers learned
+// from the neighbors through peer exchange.
+//
+// Author: Tien Ho
+// Date: 12/05/16.
+//
+
+#ifndef CONNMGR_H
+#define CONNMGR_H
+
+#include "utils.h"
+
+#define BACKOFF_BASE   500      /* first retry delay in milliseconds */
+#define BACKOFF_MAX    60000    /* cap on the retry delay in milliseconds */
+#define PASSIVE_MAX    64       /* max number of learned candidates */
+
+// candidate states
+#define CAND_IDLE       0    /* may be connected to right away */
+#define CAND_PENDING    1    /* connect() in progress or established */
+#define CAND_BACKOFF    2    /* waiting for its retry timer */
+#define CAND_RESOLVING  3    /* waiting for its address */
+#define CAND_SELF       4    /* the peer itself, never dialed */
+
+#define NO_TIMER      (-1)
+
+struct candidate {
+    struct peer addr;
+    int         state;
+    int         failures;   /* consecutive failed attempts */
+    int         timer;      /* position in the timer heap or NO_TIMER */
+    long long   expires;    /* when addr.ep must be resolved again, in ms */
+};
+
+struct timer {
+    long long when;         /* expiration in milliseconds */
+    int       cand;         /* index of the candidate to wake up */
+};
+
+struct connmgr {
+    struct candidate *cands;     /* the peersfile first, then learned peers */
+    int              ncands;
+    int              nseeds;     /* number of candidates from the peersfile */
+    int              capacity;
+    int              target;     /* number of neighbors to maintain */
+    int              cursor;     /* next candidate to try, for rotation */
+    struct timer     *heap;      /* min-heap of pending timers */
+    int              nheap;
+};
+
+long long now_ms(void);
+void      cm_init(struct connmgr *cm, struct peer *peers, int npeers, int target);
+int       cm_next(struct connmgr *cm, int nneighbors);
+void      cm_connected(struct connmgr *cm, int cand);
+void      cm_failed(struct connmgr *cm, int cand);
+void      cm_disconnected(struct connmgr *cm, int cand);
+void      cm_resolving(struct connmgr *cm, int cand);
+void      cm_resolved(struct connmgr *cm, int cand, const struct endpoint *addr, long long expires);
+void      cm_exclude(struct connmgr *cm, int cand);
+int       cm_add(struct connmgr *cm, const struct endpoint *ep);
+int       cm_claim(struct connmgr *cm, int cand);
+int       cm_sample(struct connmgr *cm, struct peer *out, int n);
+int       cm_expire(struct connmgr *cm, long long now);
+int       cm_timeout(struct connmgr *cm, long long now, struct timeval *tv);
+
+#endif //CONNMGR_H
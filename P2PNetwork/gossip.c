@@ -0,0 +1,98 @@
+//
+// The gossip core of the peer program. It parses and formats the user
+// messages and keeps the ids of the messages seen recently, so that a message
+// reaching a peer over several paths is delivered and relayed only once.
+//
+// Author: Tien Ho
+// Date:   12/08/16
+//
+
+#include "gossip.h"
+
+// Parse a user message. The text of the message is not copied: m->text points
+// into the line. Returns -1 if the line is not a user message.
+int
+msg_parse(const char *line, struct message *m)
+{
+    const char *p;
+    int        skip = 0;
+
+    bzero(m, sizeof(*m));
+    if ((p = addr_scan(line, &m->origin)) == NULL ||
+        sscanf(p, ":%d:%d:%n", &m->seq, &m->ttl, &skip) != 2 || skip == 0)
+        return -1;
+
+    m->ttl = min(m->ttl, MAX_TTL);
+    m->text = p + skip;
+
+    return 0;
+}
+
+// Write a user message as one line. Returns the length of the line.
+int
+msg_format(char *buff, size_t len, const struct message *m)
+{
+    char origin[ADDR_NAMELEN];
+    int  n;
+
+    addr_format(&m->origin, origin, sizeof(origin));
+    n = snprintf(buff, len, "%s:%d:%d:%s", origin, m->seq, m->ttl, m->text);
+
+    return min(n, (int) len - 1);
+}
+
+void
+gossip_init(struct gossip *g, unsigned int nbuckets)
+{
+    bzero(g, sizeof(*g));
+    g->nbuckets = nbuckets;
+    g->keys = calloc(nbuckets * SEEN_WAYS, sizeof(unsigned long long));
+    g->stamps = calloc(nbuckets * SEEN_WAYS, sizeof(unsigned int));
+    if (g->keys == NULL || g->stamps == NULL) {
+        perror("gossip allocation error");
+        exit(0);
+    }
+}
+
+// 64-bit FNV-1a hash of the message id, the binary origin and the sequence
+// number; 0 marks an empty entry
+static unsigned long long
+message_key(const struct message *m)
+{
+    unsigned long long  h = 14695981039346656037ULL;
+    const unsigned char *p = (const unsigned char *) &m->origin;
+    int                 i;
+
+    for (i = 0; i < (int) sizeof(m->origin); i++)
+        h = (h ^ p[i]) * 1099511628211ULL;
+    for (i = 0; i < 4; i++)
+        h = (h ^ ((m->seq >> (8 * i)) & 0xff)) * 1099511628211ULL;
+
+    return h ? h : 1;
+}
+
+// Record a message as seen. Returns 1 if it was not seen before, i.e. it has
+// to be delivered, and 0 if it is a duplicate.
+int
+gossip_accept(struct gossip *g, const struct message *m)
+{
+    unsigned long long key = message_key(m);
+    unsigned int       base = (key % g->nbuckets) * SEEN_WAYS;
+    int                i, victim = 0;
+
+    for (i = 0; i < SEEN_WAYS; i++) {
+        if (g->keys[base + i] == key)
+            return 0;
+    }
+
+    // take an empty entry of the bucket, or else the oldest one
+    for (i = 1; i < SEEN_WAYS && g->keys[base + victim] != 0; i++) {
+        if (g->keys[base + i] == 0 || g->stamps[base + i] < g->stamps[base + victim])
+            victim = i;
+    }
+
+    g->keys[base + victim] = key;
+    g->stamps[base + victim] = ++g->clock;
+
+    return 1;
+}
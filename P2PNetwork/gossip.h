@@ -0,0 +1,44 @@
+//
+// The header file for the gossip core of the peer program: the format of the
+// user messages and the decision whether a received message is new and has to
+// be relayed. The core does not know about sockets, so that the same code runs
+// in the peer and in the simulator.
+//
+// Author: Tien Ho
+// Date: 12/08/16.
+//
+
+#ifndef GOSSIP_H
+#define GOSSIP_H
+
+#include "utils.h"
+
+#define SEEN_WAYS       4      /* entries per bucket of the seen cache */
+#define SEEN_BUCKETS 1024      /* default number of buckets of the seen cache */
+
+// A user message "ip:port:seqnum:ttl:text", with an IPv6 address in
+// brackets; ip:port:seqnum identifies it.
+struct message {
+    struct endpoint origin;       /* address and listening port of the peer that wrote it */
+    int             seq;
+    int             ttl;          /* hops it may still travel */
+    const char      *text;        /* points into the parsed line */
+};
+
+// The ids of the recently seen messages, in a set-associative cache: an id
+// hashes to one bucket and replaces the oldest entry of the bucket when the
+// bucket is full. A message is recognized as a duplicate as long as its id
+// has not been pushed out by SEEN_WAYS newer ids of the same bucket.
+struct gossip {
+    unsigned long long *keys;     /* nbuckets * SEEN_WAYS ids, 0 if empty */
+    unsigned int       *stamps;   /* insertion order of each entry */
+    unsigned int       nbuckets;
+    unsigned int       clock;
+};
+
+int  msg_parse(const char *line, struct message *m);
+int  msg_format(char *buff, size_t len, const struct message *m);
+void gossip_init(struct gossip *g, unsigned int nbuckets);
+int  gossip_accept(struct gossip *g, const struct message *m);
+
+#endif //GOSSIP_H
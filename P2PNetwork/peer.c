@@ -1,7 +1,8 @@
 //
 // This program stimulates a peer in a P2P network. This peer accepts three
 // arguments: the port number, the maximum number of peers to connect, and the
-// peersfile that contains the hostname and ip for all potential peers.
+// peersfile that contains the hostname and ip for all potential peers. An
+// optional fourth argument sets the number of hops user messages travel.
 // The peer acts as both a server and a client. It creates a listening socket
 // to accept incoming requests as well as tries to connect to as many peers as
 // it is allowed. The peer uses nonblocking connect to try to connect to
@@ -9,23 +10,50 @@
 // the peer does not need to wait for the connection to be completely
 // successful before moving on. Any user's input is sent to the peer's direct
 // and nondirect connections. In order to avoid duplication, each message is
-// encoded with the sender's ip, port, and sequence number.
+// encoded with the sender's ip, port, and sequence number, and every peer
+// remembers the ids of the messages it has seen recently. Each message also
+// carries a time to live, the number of hops it may still travel, which every
+// peer decrements before relaying it. A connection manager keeps the peer at
+// <maxpeers> neighbors: peers that cannot be reached or that disconnect are
+// retried with a growing delay while other peers from the peersfile are tried
+// in their place. Every PEX_INTERVAL seconds the peer also exchanges a sample
+// of the peers it knows with a random neighbor, so that the peers learn about
+// each other beyond the peersfile. With METRICS_ENDPOINT set, the peer answers
+// requests for its metrics there.
+//
+// Messages are lines. A line is either a user message, "ip:port:seqnum:ttl:text",
+// or one of the control messages below, which are never relayed:
+//   HELLO <port>                  the port the sending peer listens on
+//   PEX <ip:port> ...             a sample of the peers the sender knows
+//   PEXREPLY <ip:port> ...        the answer to PEX with a sample of the receiver
+// An IPv6 address is written in brackets, as in "[::1]:8877". The peer listens
+// on IPv6 and IPv4 alike, and keeps the addresses in binary, so that a
+// message is matched to its origin without comparing any text.
 //
 // Author: Tien Ho
 // Date:   11/23/16
 //
 
 #include "utils.h"
+#include "connmgr.h"
+#include "resolver.h"
+#include "gossip.h"
+#include "listener.h"
+#include "logger.h"
+#include "metrics.h"
+#include "pool.h"
 
 // global variables
-int                maxfd, npeers, max, n, i;
-fd_set             rset, wset, rs, ws;
+int                npeers, max, n, i, nconn, seqnum;
+struct reactor     loop;
 char               buff[MAXLINE];
-struct sockaddr_in peeraddr, localaddr, servaddr;
-socklen_t          addrlen;
+int                serverport;     /* the port the peer listens on */
 FILE               *peersfile;
 struct peerconn    currentpeers[FD_SETSIZE];
-struct peerconn    empty;
+struct connmgr     cm;
+int                defaultttl = DEFAULT_TTL;
+struct gossip      seen;
+int                received, duplicates, relayed, neighbors;   /* the ids of the metrics */
 
 int
 count_lines(char *filename)
@@ -40,395 +68,650 @@ count_lines(char *filename)
     return line;
 }
 
+// assume this program is run on the local machine: any loopback address,
+// IPv4 or IPv6, with the port of the peer is the peer itself
 int
-compare_peer(const struct peerconn *a, char *ipaddr, int port)
+is_self(const struct endpoint *ep)
+{
+    return addr_loopback(ep) && ntohs(ep->port) == serverport;
+}
+
+// Read the host names and ports of the peersfile. The host names are resolved
+// later by the resolver threads so that the peer does not wait for all the
+// lookups before it starts.
+struct peer *
+read_peers(char *filename)
 {
-    int sameip = 0;
-    int sameport = 0;
+    int  i, port;
+    char *token;
+
+    // open the peersfile and store the info
+    bzero(buff, sizeof(buff));
+    if ((peersfile = fopen(filename, "r")) == NULL) {
+        perror("cannot open peersfile");
+        exit(0);
+    }
+    npeers = count_lines(filename);
+    static struct peer *allpeers;
+    allpeers = malloc(max(npeers, 1) * sizeof(struct peer));
 
-    if (strcmp(a->ipaddr, ipaddr) == 0)
-        sameip = 1;
+    for (i = 0; i < npeers; i++) {
+        bzero(&allpeers[i], sizeof(struct peer));
+    }
 
-    if (a->port == port)
-        sameport = 1;
+    int index = 0;
+    while (fgets(buff, MAXLINE, peersfile) != NULL && index < npeers) {
+        // each line is "<hostname> <port>"
+        token = strtok(buff, " \t\n");
+        if (token == NULL)
+            continue;
+        strncpy(allpeers[index].hostname, token, MAXHOST - 1);
+        token = strtok(NULL, " \t\n");
+        if (token == NULL || (port = atoi(token)) <= 0)
+            continue;
+        allpeers[index].ep.port = htons(port);
+        index++;
+    }
+    fclose(peersfile);
+    npeers = index;
 
-    return sameip & sameport;
+    return allpeers;
 }
 
+// find the first unused entry in currentpeers
 int
-compare_host(const struct peerconn *a, char *ipaddr, int port)
+free_slot()
 {
-    int sameip = 0;
-    int sameport = 0;
+    int i;
 
-    if (strcmp(a->hostipaddr, ipaddr) == 0)
-        sameip = 1;
+    for (i = 0; i < FD_SETSIZE; i++) {
+        if (currentpeers[i].flag == 0)
+            break;
+    }
 
-    if (a->hostport == port)
-        sameport = 1;
+    return i;
+}
 
-    return sameip & sameport;
+// close the connection of an entry in currentpeers and make the entry reusable
+void
+release_peer(int i)
+{
+    reactor_remove(&loop, currentpeers[i].fd);
+    close(currentpeers[i].fd);
+    pool_free(currentpeers[i].inbuf, PEER_INSIZE);
+    bzero(&currentpeers[i], sizeof(struct peerconn));
 }
 
+// count the neighbors that are connected or being connected to
 int
-is_self(char *ip, int port)
+count_neighbors()
 {
-    int sameip = 0;
-    int sameport = 0;
-    char *localhost = "127.0.0.1"; // assume this program is run on the local machine
+    int i, count = 0;
 
-    if (strcmp(localhost, ip) == 0)
-        sameip = 1;
-
-    if (ntohs(servaddr.sin_port) == port)
-        sameport = 1;
+    for (i = 0; i <= max; i++) {
+        if (currentpeers[i].flag == CONNECTING || currentpeers[i].flag == ESTABLISHED)
+            count++;
+    }
 
-    return sameip & sameport;
+    return count;
 }
 
-struct peer *
-read_peers(char *filename)
+static void peer_io(struct reactor *r, int fd, int events, void *arg);
+
+// start a nonblocking connect to the given candidate of the connection manager.
+// Returns -1 if the connection cannot even be initiated.
+int
+peer_connect(struct peer *newpeer, int cand)
 {
-    int            i;
-    struct in_addr **addr_list;
-    struct hostent *hp;
+    struct sockaddr_storage peeraddr;
+    socklen_t               addrlen;
+    int                     sockfd, flags, slot;
 
-    // open the peersfile and store the info
-    bzero(buff, sizeof(buff));
-    peersfile = fopen(filename, "r");
-    npeers = count_lines(filename);
-    static struct peer *allpeers;
-    allpeers = malloc(npeers * sizeof(struct peer));
+    // the socket is of the family of the address of the peer
+    addrlen = addr_to(&newpeer->ep, 0, &peeraddr);
+    if ((sockfd = socket(peeraddr.ss_family, SOCK_STREAM, 0)) < 0) {
+        perror("socket error");
+        return -1;
+    }
 
-    for (i = 0; i < npeers; i++) {
-        bzero(&allpeers[i], sizeof(struct peer));
+    // set the socket nonblocking
+    flags = fcntl(sockfd, F_GETFL, 0);
+    fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+
+    // initiate nonblocking connect to the peer. A connect that completes
+    // right away (e.g. on the loopback) is picked up by the reactor as writable.
+    if (connect(sockfd, (struct sockaddr *) &peeraddr, addrlen) < 0 && errno != EINPROGRESS) {
+        perror("nonblocking connect error");
+        close(sockfd);
+        return -1;
     }
 
-    int index = 0;
-    while (fgets(buff, MAXLINE, peersfile) != NULL) {
-        char *token = strtok(buff, " ");
-        if (token != NULL) {
-            // get the ip address from the hostname
-            char ip[MAXLINE];
-            bzero(allpeers[index].ipaddr, sizeof(allpeers[index].ipaddr));
-            hp = gethostbyname(token);
-            addr_list = (struct in_addr **)hp->h_addr_list;
-            strcpy(ip, "");
-            for(i = 0; addr_list[i] != NULL; i++) {
-                strcat(ip, inet_ntoa(*addr_list[i]));
-            }
-            token = strtok(NULL, " ");
-            int port = atoi(token);
-            if (is_self(ip, port) == 1) { // only add peers that is not itself
-                continue;
-            }
-            strcpy(allpeers[index].ipaddr, ip);
-            allpeers[index].port = atoi(token);
+    if ((slot = free_slot()) == FD_SETSIZE || (currentpeers[slot].inbuf = pool_alloc(PEER_INSIZE)) == NULL ||
+        reactor_add(&loop, sockfd, EV_READ | EV_WRITE, peer_io, (void *) (long) slot) < 0) {
+        logger_msg(LOGGER_WARN, "too many peers\n");
+        if (slot < FD_SETSIZE) {
+            pool_free(currentpeers[slot].inbuf, PEER_INSIZE);
+            currentpeers[slot].inbuf = NULL;
         }
-        index++;
+        close(sockfd);
+        return -1;
     }
-    fclose(peersfile);
 
-    return allpeers;
+    // remember this new peer connection and its local address
+    if (addr_local(sockfd, &currentpeers[slot].host) < 0)
+        perror("socket name error");
+    currentpeers[slot].flag = CONNECTING;
+    currentpeers[slot].fd = sockfd;
+    currentpeers[slot].cand = cand;
+    if (max < slot)
+        max = slot;
+
+    return 0;
+}
+
+// ask the connection manager for candidates until the peer has as many
+// neighbors as it is allowed or there is no candidate left to try
+void
+maintain_neighbors()
+{
+    int cand;
+
+    while ((cand = cm_next(&cm, count_neighbors())) >= 0) {
+        // an unknown or stale address is looked up first; the candidate
+        // becomes eligible again once the resolver reports back
+        if (cm.cands[cand].expires <= now_ms()) {
+            cm_resolving(&cm, cand);
+            resolver_submit(cm.cands[cand].addr.hostname, cand);
+        }
+        else if (peer_connect(&cm.cands[cand].addr, cand) < 0) {
+            cm_failed(&cm, cand);
+        }
+    }
+}
+
+// hand the addresses found by the resolver to the connection manager
+void
+collect_resolutions()
+{
+    struct resolution res[64];
+    int               nres, j;
+
+    while ((nres = resolver_poll(res, 64)) > 0) {
+        for (j = 0; j < nres; j++) {
+            res[j].addr.port = cm.cands[res[j].tag].addr.ep.port;
+            if (!addr_unset(&res[j].addr) && is_self(&res[j].addr))
+                cm_exclude(&cm, res[j].tag); // only add peers that is not itself
+            else
+                cm_resolved(&cm, res[j].tag, &res[j].addr, res[j].expires);
+        }
+    }
+}
+
+// send one line to a neighbor
+void
+send_line(int i, const char *line)
+{
+    ssize_t n;
+
+    if ((n = write(currentpeers[i].fd, line, strlen(line))) < 0)
+        perror("write error");
+    else
+        metric_add(NET_BYTES_OUT, n);
+}
+
+// tell a new neighbor which port the peer accepts connections on
+void
+send_hello(int i)
+{
+    char line[MAXCHAR];
+
+    sprintf(line, "HELLO %d\n", serverport);
+    send_line(i, line);
 }
 
+// add a peer reported by a neighbor to the candidates unless it is the peer
+// itself. Returns the index of the candidate or -1.
 int
-peer_connect(struct peer *newpeer)
+learn_peer(const struct endpoint *ep)
 {
-    int sockfd, flags;
+    if (ep->port == 0 || addr_unset(ep) || is_self(ep))
+        return -1;
 
-    if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("socket error");
-        exit(0);
+    return cm_add(&cm, ep);
+}
+
+// the address neighbor i accepts peers on. Returns -1 if its port is not known.
+int
+listen_addr(int i, struct endpoint *ep)
+{
+    if (currentpeers[i].listenport <= 0 || currentpeers[i].listenport > 65535)
+        return -1;
+    *ep = currentpeers[i].addr;
+    ep->port = htons(currentpeers[i].listenport);
+
+    return 0;
+}
+
+// append " ip:port" to a PEX message
+static void
+pex_entry(char *line, const struct endpoint *ep)
+{
+    char entry[ADDR_NAMELEN + 1];
+
+    entry[0] = ' ';
+    addr_format(ep, entry + 1, sizeof(entry) - 1);
+    strcat(line, entry);
+}
+
+// Build the body of a PEX message for neighbor "to": the neighbors whose
+// listening port is known come first since they are certainly alive, then
+// random candidates that were reachable the last time they were tried.
+void
+pex_sample(int to, char *line)
+{
+    struct peer     sample[PEX_SAMPLE];
+    struct endpoint ep, self;
+    int             j, k, start, nsample, count = 0;
+
+    line[0] = '\0';
+    start = max >= 0 ? rand() % (max + 1) : 0;
+    for (k = 0; k <= max && count < PEX_SAMPLE; k++) {
+        j = (start + k) % (max + 1);
+        if (j == to || currentpeers[j].flag != ESTABLISHED || listen_addr(j, &ep) < 0)
+            continue;
+        pex_entry(line, &ep);
+        count++;
     }
 
-    // set the socket nonblocking
-    flags = fcntl(sockfd, F_GETFL, 0);
-    fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+    if (listen_addr(to, &self) < 0)
+        bzero(&self, sizeof(self));
+    nsample = cm_sample(&cm, sample, PEX_SAMPLE - count);
+    for (k = 0; k < nsample; k++) {
+        // never send a neighbor its own address
+        if (addr_equal(&sample[k].ep, &self))
+            continue;
+        pex_entry(line, &sample[k].ep);
+    }
+}
 
-    bzero(&peeraddr, sizeof(peeraddr));
-    peeraddr.sin_family = AF_INET;
-    peeraddr.sin_port = htons(newpeer->port);
+// start a peer exchange with a random neighbor
+void
+pex_shuffle()
+{
+    char line[MAXLINE], sample[MAXLINE];
+    int  j, to = -1, nchoices = 0;
 
-    if (inet_pton(AF_INET, newpeer->ipaddr, &peeraddr.sin_addr) <= 0) {
-        printf("inet_pton error for %s", newpeer->ipaddr);
-        exit(0);
+    for (j = 0; j <= max; j++) {
+        if (currentpeers[j].flag == ESTABLISHED && rand() % ++nchoices == 0)
+            to = j;
+    }
+    if (to < 0)
+        return;
+
+    pex_sample(to, sample);
+    snprintf(line, sizeof(line), "PEX%s\n", sample);
+    send_line(to, line);
+}
+
+// HELLO <port>: remember where the neighbor accepts connections. A neighbor
+// that connected to us takes over its candidate so that we do not dial it too.
+void
+handle_hello(int i, char *args)
+{
+    struct endpoint ep;
+    int             cand;
+
+    currentpeers[i].listenport = atoi(args);
+    if (currentpeers[i].cand >= 0 || listen_addr(i, &ep) < 0)
+        return;
+
+    cand = learn_peer(&ep);
+    if (cand >= 0 && cm_claim(&cm, cand) == 0)
+        currentpeers[i].cand = cand;
+}
+
+// PEX or PEXREPLY: merge the sample of the neighbor into the candidates and
+// answer a PEX with a sample of our own
+void
+handle_pex(int i, char *args, int reply)
+{
+    struct endpoint ep;
+    char            line[MAXLINE], sample[MAXLINE];
+    char            *entry, *saveptr;
+    const char      *end;
+
+    for (entry = strtok_r(args, " \r\n", &saveptr); entry != NULL; entry = strtok_r(NULL, " \r\n", &saveptr)) {
+        if ((end = addr_scan(entry, &ep)) != NULL && *end == '\0')
+            learn_peer(&ep);
+    }
+
+    if (reply == NO) {
+        pex_sample(i, sample);
+        snprintf(line, sizeof(line), "PEXREPLY%s\n", sample);
+        send_line(i, line);
     }
+}
+
+// Send a user message to the neighbors other than "from" (-1 for none). The
+// message reaches the peers at most m->ttl hops away.
+void
+broadcast(int from, const struct message *m)
+{
+    char line[MAXLINE];
+    int  j;
 
-    // initiate nonblocking connect to the peer
-    if (connect(sockfd, (struct sockaddr *) &peeraddr, sizeof(peeraddr)) < 0) {
-        if (errno != EINPROGRESS) {
-            perror("nonblocking connect error");
+    if (m->ttl <= 0)
+        return;
+
+    msg_format(line, sizeof(line), m);
+    for (j = 0; j <= max; j++) {
+        if (currentpeers[j].flag == ESTABLISHED && j != from) {
+            send_line(j, line);
+            metric_add(relayed, 1);
         }
+    }
+}
+
+// a user message from neighbor i: print it and relay it unless it was seen
+// before or it has used up its hops
+void
+relay_message(int from, char *line)
+{
+    struct message m;
+    char           ip[ADDR_STRLEN];
+
+    if (msg_parse(line, &m) < 0)
+        return;
+    metric_add(received, 1);
+
+    // a message can reach the peer over several paths, including back to
+    // the peer that wrote it; only the first copy is delivered and relayed
+    if (gossip_accept(&seen, &m) == 0) {
+        metric_add(duplicates, 1);
+        return;
+    }
+
+    logger_msg(LOGGER_INFO, "Peer %s %d: %s", addr_ntop(&m.origin, ip, sizeof(ip)), ntohs(m.origin.port), m.text);
 
-        // get local address
-        bzero(&localaddr, sizeof(localaddr));
-        addrlen = sizeof(localaddr);
-        if (getsockname(sockfd, (struct sockaddr *) &localaddr, &addrlen) < 0)
-            perror("socket name error");
-
-        // remember this new peer connection
-        for (i = 0; i < FD_SETSIZE; i++) {
-            if (n = memcmp(&currentpeers[i], &empty, sizeof(empty)) == 0) {
-                break;
-            }
+    // relay the message to all the connected peers except its sender,
+    // with one hop less
+    m.ttl--;
+    broadcast(from, &m);
+}
+
+// dispatch one complete line received from neighbor i
+void
+handle_line(int i, char *line)
+{
+    if (strncmp(line, "HELLO ", 6) == 0)
+        handle_hello(i, line + 6);
+    else if (strncmp(line, "PEX ", 4) == 0 || strcmp(line, "PEX\n") == 0)
+        handle_pex(i, line + 3, NO);
+    else if (strncmp(line, "PEXREPLY", 8) == 0)
+        handle_pex(i, line + 8, YES);
+    else
+        relay_message(i, line);
+}
+
+// split the bytes buffered for neighbor i into lines and handle each of them
+void
+handle_input(int i)
+{
+    struct peerconn *p = &currentpeers[i];
+    char            line[MAXLINE + 1];
+    char            *newline;
+    int             len;
+
+    for ( ; ; ) {
+        newline = memchr(p->inbuf, '\n', p->inlen);
+        if (newline != NULL) {
+            len = newline - p->inbuf + 1;
+        } else if (p->inlen == PEER_INSIZE) {
+            len = p->inlen; // a line too long for the buffer is cut
+        } else {
+            break;
         }
-        currentpeers[i].hostport = localaddr.sin_port;
-        strcpy(currentpeers[i].hostipaddr, inet_ntoa(localaddr.sin_addr));
-        currentpeers[i].flag = CONNECTING;
-        currentpeers[i].fd = sockfd;
-        if (max < i)
-            max = i;
-
-        FD_SET(sockfd, &rset);
-        FD_SET(sockfd, &wset);
-        if (sockfd > maxfd)
-            maxfd = sockfd;
+
+        memcpy(line, p->inbuf, len);
+        line[len] = '\0';
+        p->inlen -= len;
+        memmove(p->inbuf, p->inbuf + len, p->inlen);
+        handle_line(i, line);
     }
 }
 
+// a connection to or from a neighbor is ready
+static void
+peer_io(struct reactor *r, int fd, int events, void *arg)
+{
+    struct peerconn    *p;
+    struct candidate   *c;
+    socklen_t          len;
+    char               ip[ADDR_STRLEN];
+    int                i = (int) (long) arg;
+    int                n, error;
+
+    p = &currentpeers[i];
+    // check for nonblocking connection
+    if (p->flag == CONNECTING) {
+        len = sizeof(error);
+        // address both Berkeley-deprived implementations and Solaris
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0) {
+            // try this peer again later and another one in the meantime
+            c = &cm.cands[p->cand];
+            logger_msg(LOGGER_WARN, "connection failed for \"%s %d\": %s\n", addr_ntop(&c->addr.ep, ip, sizeof(ip)),
+                       ntohs(c->addr.ep.port), strerror(error));
+            cm_failed(&cm, p->cand);
+            release_peer(i);
+            return;
+        }
+
+        reactor_modify(r, fd, EV_READ);
+        // remember the new peer and its address
+        if (addr_peer(fd, &p->addr) < 0)
+            perror("peer name error");
+        p->flag = ESTABLISHED;
+        p->listenport = ntohs(cm.cands[p->cand].addr.ep.port);
+        cm_connected(&cm, p->cand);
+        nconn++;
+        metric_add(neighbors, 1);
+
+        logger_msg(LOGGER_INFO, "connection established for \"%s %d\"\n", addr_ntop(&p->addr, ip, sizeof(ip)),
+                   p->addr.port);
+        send_hello(i);
+    }
+    // one of the existing connection becomes readable
+    else if (p->flag == ESTABLISHED && (events & EV_READ)) {
+        if ((n = read(fd, p->inbuf + p->inlen, PEER_INSIZE - p->inlen)) <= 0) { // the peer quits
+            if (n < 0)
+                perror("read error");
+            logger_msg(LOGGER_INFO, "disconnection from \"%s %d\"\n", addr_ntop(&p->addr, ip, sizeof(ip)),
+                       p->addr.port);
+
+            // a peer we dialed is redialed later; another candidate takes its place
+            if (p->cand >= 0)
+                cm_disconnected(&cm, p->cand);
+            release_peer(i);
+            nconn--;
+            metric_add(neighbors, -1);
+        }
+        else {
+            metric_add(NET_BYTES_IN, n);
+            p->inlen += n;
+            handle_input(i);
+        }
+    }
+}
+
+// a new connection arrives
+static void
+peer_accepted(struct reactor *r, int connfd, const struct endpoint *cliaddr, void *arg)
+{
+    struct endpoint host;
+    char            ip[ADDR_STRLEN];
+    int             i;
+
+    // get local address
+    bzero(&host, sizeof(host));
+    if (addr_local(connfd, &host) < 0)
+        perror("socket name error");
+
+    if ((i = free_slot()) == FD_SETSIZE || (currentpeers[i].inbuf = pool_alloc(PEER_INSIZE)) == NULL ||
+        reactor_add(r, connfd, EV_READ, peer_io, (void *) (long) i) < 0) {
+        logger_msg(LOGGER_WARN, "too many peers\n");
+        if (i < FD_SETSIZE) {
+            pool_free(currentpeers[i].inbuf, PEER_INSIZE);
+            currentpeers[i].inbuf = NULL;
+        }
+        close(connfd);
+        return;
+    }
+    // remember this new peer
+    currentpeers[i].addr = *cliaddr;
+    currentpeers[i].host = host;
+    currentpeers[i].fd = connfd;
+    currentpeers[i].flag = ESTABLISHED;
+    currentpeers[i].cand = -1;
+    if (max < i)
+        max = i;
+
+    nconn++;
+    metric_add(neighbors, 1);
+    logger_msg(LOGGER_INFO, "connection established for \"%s %d\"\n", addr_ntop(cliaddr, ip, sizeof(ip)),
+               cliaddr->port);
+    send_hello(i);
+}
+
+// the resolver threads have looked up some names
+static void
+resolved(struct reactor *r, int fd, int events, void *arg)
+{
+    collect_resolutions();
+}
+
+// exchange peers with a neighbor, then again after about PEX_INTERVAL seconds
+static void
+pex_timer(struct reactor *r, void *arg)
+{
+    pex_shuffle();
+    // spread the exchanges of peers started together
+    reactor_timer(r, PEX_INTERVAL * 500 + rand() % (PEX_INTERVAL * 500 + 1), pex_timer, NULL);
+}
+
+// standard input is readable
+static void
+user_input(struct reactor *r, int fd, int events, void *arg)
+{
+    struct message m;
+    char           *text;
+    int            i, ttl, skip;
+
+    // the input is consumed even without neighbors, otherwise the reactor keeps waking up
+    if (fgets(buff, MAXLINE, stdin) == NULL) {
+        reactor_remove(r, fd); // end of input
+        return;
+    }
+    if (nconn == 0)
+        return;
+
+    // "/hops <k> <text>" limits the message to the peers within k hops
+    ttl = defaultttl;
+    text = buff;
+    if (sscanf(buff, "/hops %d %n", &ttl, &skip) == 1 && skip > 0) {
+        ttl = max(1, min(ttl, MAX_TTL));
+        text = buff + skip;
+    }
+
+    seqnum++; // increment the sequence number for messages send from the current host
+    // the ip, port number, and sequence number of the current host serve
+    // as the id of the message used for duplication detection
+    bzero(&m, sizeof(m));
+    for (i = 0; i <= max && currentpeers[i].flag != ESTABLISHED; i++)
+        ;
+    m.origin = currentpeers[i].host;
+    m.origin.port = htons(serverport);
+    m.seq = seqnum;
+    m.ttl = ttl;
+    m.text = text;
+    gossip_accept(&seen, &m);
+    broadcast(-1, &m);
+}
+
 int
 main(int argc, char **argv)
 {
-    int                listenfd, connfd, maxpeers, nconn, flag, fd, error, seqnum, received, peerfd, sender, found;
-    struct sockaddr_in cliaddr;
-    char               sendbuff[MAXLINE], recvbuff[MAXLINE];
+    int            listenfd, resolverfd, maxpeers;
+    struct timeval tv;
 
-    if (argc != 4) {
-        perror("usage: peer <port> <maxpeers> <peersfile>");
+    if (argc != 4 && argc != 5) {
+        perror("usage: peer <port> <maxpeers> <peersfile> [ttl]");
         exit(0);
     }
 
-    // create a listen socket
-    if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("socket error");
+    if (argc == 5 && ((defaultttl = atoi(argv[4])) < 1 || defaultttl > MAX_TTL)) {
+        printf("ttl must be between 1 and %d\n", MAX_TTL);
         exit(0);
     }
 
-    bzero(&servaddr, sizeof(servaddr));
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    servaddr.sin_port = htons(atoi(argv[1]));
-
-    if (bind(listenfd, (struct sockaddr *) &servaddr, sizeof(servaddr)) < 0) {
+    // create a listen socket, for IPv6 and IPv4 peers
+    serverport = atoi(argv[1]);
+    if ((listenfd = tcp_listen(serverport, NULL)) < 0) {
         perror("error in binding");
         exit(0);
     }
 
-    if (listen(listenfd, LISTENQ) < 0)
+    // a neighbor that goes away while being written to must not kill the peer
+    signal(SIGPIPE, SIG_IGN);
+
+    received = metric_counter("p2p_messages_total{copy=\"received\"}", "User messages, by what became of them.");
+    duplicates = metric_counter("p2p_messages_total{copy=\"duplicate\"}", NULL);
+    relayed = metric_counter("p2p_messages_total{copy=\"sent\"}", NULL);
+    neighbors = metric_gauge("p2p_neighbors", "Neighbors connected.");
+    if (metrics_start() < 0) {
+        perror("metrics error");
         exit(0);
+    }
 
     struct peer *allpeers = read_peers(argv[3]);
 
-    FD_ZERO(&rset);
-    FD_ZERO(&wset);
-    FD_SET(fileno(stdin), &rset); // standard input
-    FD_SET(listenfd, &rset);
-    maxfd = max(fileno(stdin), listenfd);
+    // the peer listens right away while the peersfile is being resolved
+    resolverfd = resolver_init(RESOLVE_THREADS);
+    if (reactor_init(&loop, REACTOR_DEFAULT) < 0 || reactor_add(&loop, fileno(stdin), EV_READ, user_input, NULL) < 0 ||
+        reactor_add(&loop, resolverfd, EV_READ, resolved, NULL) < 0 ||
+        listener_add(&loop, listenfd, 0, peer_accepted, NULL) < 0) {
+        perror("reactor error");
+        exit(0);
+    }
+    // the neighbors may come from the peers learned through PEX as well as
+    // from the peersfile, so only the room for candidates bounds them
     maxpeers = atoi(argv[2]);
-    if (maxpeers > npeers)
-        maxpeers = npeers;
+    if (maxpeers > npeers + PASSIVE_MAX)
+        maxpeers = npeers + PASSIVE_MAX;
 
-    bzero(&empty, sizeof(empty));
     for (i = 0; i < FD_SETSIZE; i++) {
         bzero(&currentpeers[i], sizeof(struct peerconn));
     }
 
     // establish connections with other peers
-    int index = 0;
+    cm_init(&cm, allpeers, npeers, maxpeers);
+    gossip_init(&seen, SEEN_BUCKETS);
+    // start the sequence numbers from the clock so that the messages of a
+    // restarted peer are not taken for the ones it sent before
+    seqnum = (int) (time(NULL) & 0x3fffffff);
     nconn = 0;
-    while (nconn < maxpeers) {
-        peer_connect(&allpeers[index]);
-        nconn++;
-        index++;
-    }
+    maintain_neighbors();
+    reactor_timer(&loop, PEX_INTERVAL * 1000, pex_timer, NULL);
 
     for ( ; ; ) {
-        rs = rset;
-        ws = wset;
-        n = select(maxfd + 1, &rs, &ws, NULL, NULL);
-        // a new connection arrives
-        if (FD_ISSET(listenfd, &rs)) {
-            if ((connfd = accept(listenfd, NULL, NULL)) < 0) {
-                perror("connection error");
-                continue;
-            }
-
-            // get local address
-            bzero(&localaddr, sizeof(localaddr));
-            addrlen = sizeof(localaddr);
-            if (getsockname(connfd, (struct sockaddr *) &localaddr, &addrlen) < 0)
-                perror("socket name error");
-
-            // get peer address
-            bzero(&cliaddr, sizeof(cliaddr));
-            addrlen = sizeof(cliaddr);
-            if (getpeername(connfd, (struct sockaddr *) &cliaddr, &addrlen) < 0)
-                perror("peer name error");
-
-            for (i = 0; i < FD_SETSIZE; i++) {
-                if ((n = memcmp(&currentpeers[i], &empty, sizeof(empty))) == 0) {
-                    break;
-                }
-            }
-            // remember this new peer
-            strcpy(currentpeers[i].ipaddr, inet_ntoa(cliaddr.sin_addr));
-            currentpeers[i].port = cliaddr.sin_port;
-            currentpeers[i].hostport = localaddr.sin_port;
-            strcpy(currentpeers[i].hostipaddr, inet_ntoa(localaddr.sin_addr));
-            currentpeers[i].fd = connfd;
-            currentpeers[i].flag = ESTABLISHED;
-            currentpeers[i].seqnum = 0;
-            if (max < i)
-                max = i;
-
-            // add this connection for to the readset for future select
-            FD_SET(connfd, &rset);
-            if (connfd > maxfd) {
-                maxfd = connfd;
-            }
-            nconn++;
-            printf("connection established for \"%s %d\"\n", currentpeers[i].ipaddr, currentpeers[i].port);
+        // wake up in time for the earliest retry of a backed off peer; the
+        // peer exchange is a timer of the reactor
+        if (reactor_poll(&loop, cm_timeout(&cm, now_ms(), &tv) ? tv.tv_sec * 1000LL + tv.tv_usec / 1000 : -1) < 0) {
+            perror("reactor error");
+            exit(0);
         }
 
-        for (i = 0; i <= max; i++) {
-            flag = currentpeers[i].flag;
-            if (flag == 0 || flag == INACTIVE)
-                continue;
-            fd = currentpeers[i].fd;
-            // check for nonblocking connection
-            if (flag == CONNECTING && (FD_ISSET(fd, &rs) || FD_ISSET(fd, &ws))) {
-                n = sizeof(error);
-                // address both Berkeley-deprived implementations and Solaris
-                if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &n) < 0 || error != 0) {
-                    currentpeers[i].flag = INACTIVE;
-                    perror("nonblocking connect failed");
-                } else {
-                    FD_CLR(fd, &wset);
-                    // get peer address
-                    bzero(&cliaddr, sizeof(cliaddr));
-                    addrlen = sizeof(cliaddr);
-                    if (getpeername(fd, (struct sockaddr *) &cliaddr, &addrlen) < 0)
-                        perror("peer name error");
-
-                    // remember the new peer
-                    strcpy(currentpeers[i].ipaddr, inet_ntoa(cliaddr.sin_addr));
-                    currentpeers[i].port = cliaddr.sin_port;
-                    currentpeers[i].flag = ESTABLISHED;
-                    currentpeers[i].seqnum = 0;
-
-                    printf("connection established for \"%s %d\"\n", currentpeers[i].ipaddr, currentpeers[i].port);
-                }
-            }
-            // one of the existing connection becomes readable
-            else if (flag == ESTABLISHED && FD_ISSET(fd, &rs)) {
-                bzero(recvbuff, sizeof(recvbuff));
-                if ((n = read(fd, recvbuff, sizeof(recvbuff))) == 0) { // the peer quits
-                    close(fd);
-                    FD_CLR(fd, &rset);
-                    currentpeers[i].flag = DONE;
-                    nconn--;
-
-                    printf("disconnection from \"%s %d\"\n", currentpeers[i].ipaddr, currentpeers[i].port);
-                }
-                else if (n > 0) {
-                    // parse the message for ip, port, and sequence number
-                    bzero(buff, sizeof(buff));
-                    strcpy(buff, recvbuff);
-                    char *token = strtok(buff, ":");
-                    char ipaddr[MAXLINE], message[MAXLINE];
-                    int  port, seq;
-                    if (token != NULL) {
-                        strcpy(ipaddr, token);
-                        token = strtok(NULL, ":");
-                        port = atoi(token);
-                        token = strtok(NULL, ":");
-                        seq = atoi(token);
-                        token = strtok(NULL, ":");
-                        strcpy(message, token);
-                    }
-
-                    // first check if the current host sent the received message itself
-                    // for example, two peers might connect to one another.
-                    // Therefore, a message sent from one peer will go back to itself.
-                    sender = NO;
-                    for (i = 0; i <= max; i++) {
-                        if (compare_host(&currentpeers[i], ipaddr, port) == 1) {
-                            sender = YES;
-                        }
-                    }
-
-                    // check if the current host received this message before
-                    // using the sequence number of the message
-                    if (sender == NO) {
-                        received = YES;
-                        found = NO;
-                        struct peerconn peer;
-                        for (i = 0; i <= max; i++) {
-                            peer = currentpeers[i];
-                            if (currentpeers[i].flag == ESTABLISHED) {
-                                if (compare_peer(&peer, ipaddr, port) == 1) {
-                                    found = YES;
-                                    if (peer.seqnum != seq) { // if the message has not been received before
-                                        received = NO;
-                                        break;
-                                    }
-                                }
-                            }
-                        }
-
-                        // found is used in case when a message is sent from a peer
-                        // that is not directly connected to the current host
-                        if (received == NO || found == NO) {
-                            if (received == NO) {
-                                currentpeers[i].seqnum = seq; // update the sequence number
-                            }
-                            printf("Peer %s %d: %s", ipaddr, port, message);
-                            fflush(stdout);
-
-                            // relay the message to all the connected peers
-                            for (i = 0; i <= max; i++) {
-                                if (currentpeers[i].flag == ESTABLISHED) {
-                                    peerfd = currentpeers[i].fd;
-                                    if (peerfd != fd) { // only send to peers who are not the senders of the message
-                                        if (write(peerfd, recvbuff, strlen(recvbuff)) < 0) {
-                                            perror("write error");
-                                        }
-                                    }
-                                }
-                            }
-                        }
-                    }
-                }
-                else {
-                    perror("read error");
-                }
-            }
-        }
-        // standard input is readable
-        if (FD_ISSET(fileno(stdin), &rs)) {
-            if (nconn > 0) {
-                bzero(buff, sizeof(buff));
-                bzero(sendbuff, sizeof(sendbuff));
-                if (fgets(buff, MAXLINE, stdin) != NULL) {
-                    seqnum++; // increment the sequence number for messages send from the current host
-                    for (i = 0; i <= max; i++) {
-                        flag = currentpeers[i].flag;
-                        // send the message to all the connected peers
-                        if (flag == ESTABLISHED) {
-                            peerfd = currentpeers[i].fd;
-                            // send the ip, port number, and sequence nummber along with the message
-                            // ip:port:seqnum serves as the id for the message used for duplication detection
-                            sprintf(sendbuff, "%s:%d:%d:%s", currentpeers[i].hostipaddr, currentpeers[i].hostport,
-                                    seqnum, buff);
-                            if (write(peerfd, sendbuff, strlen(sendbuff)) < 0) {
-                                perror("write error");
-                                exit(0);
-                            }
-                        }
-                    }
-                }
-            }
-        }
+        // replace the neighbors that failed or went away
+        cm_expire(&cm, now_ms());
+        maintain_neighbors();
     }
 }
@@ -0,0 +1,431 @@
+//
+// This program simulates a P2P network of peers in a single process, to
+// evaluate how user messages spread without launching one peer per line of
+// the peersfile. Each simulated peer runs the same gossip core as the peer
+// program (message format, duplicate detection and time to live) over an
+// in-memory transport: a message sent on a link is delivered after a random
+// latency by a discrete event loop. Peers can go down and come back during
+// the run (churn); a peer that is down loses the messages sent to it and
+// comes back with an empty seen cache, like a restarted peer.
+//
+// At the end, the program reports the delivery ratio (deliveries over the
+// peers that were up when the message was written), the duplicate ratio
+// (copies received that were already seen over all the copies received), the
+// latency of the deliveries for each hop count, and the bytes sent on the
+// links per delivered message.
+//
+// Author: Tien Ho
+// Date:   12/08/16
+//
+
+#include "utils.h"
+#include "gossip.h"
+
+#define RANDOM     1    /* every peer dials <degree> random peers */
+#define RING       2    /* every peer links to its <degree> closest peers on a ring */
+
+#define EV_DELIVER 1    /* a copy of a message reaches a peer */
+#define EV_PUBLISH 2    /* a random peer writes a new message */
+#define EV_CHURN   3    /* peers go down or come back */
+
+struct event {
+    long long when;     /* simulated time in microseconds */
+    int       type;
+    int       to;       /* receiving peer */
+    int       from;     /* sending peer */
+    int       hops;     /* links traveled so far */
+    char      *line;    /* the message as sent on the link */
+};
+
+struct node {
+    struct gossip   seen;
+    int             *nbrs;
+    int             nnbrs;
+    int             capnbrs;
+    int             up;
+    int             seq;
+    struct endpoint addr;
+};
+
+struct msginfo {
+    long long sent;     /* when the message was written */
+    int       receivers;/* peers other than the writer that were up then */
+};
+
+struct sample {
+    int       hops;
+    long long latency;
+};
+
+// simulation parameters
+static int          nnodes = 1000, degree = 4, topology = RANDOM, nmessages = 200, ttl = DEFAULT_TTL;
+static double       rate = 20.0, churn = 0.0;
+static int          minlat = 5, maxlat = 50;
+static unsigned int seenbuckets = 256;
+
+static struct node    *nodes;
+static struct msginfo *msgs;
+static struct event   *heap;
+static int            nheap, capheap;
+static struct sample  *samples;
+static int            nsamples, capsamples;
+static long long      deliveries, duplicates, lost, bytes, published;
+
+static void *
+xrealloc(void *p, size_t size)
+{
+    if ((p = realloc(p, size)) == NULL) {
+        perror("allocation error");
+        exit(0);
+    }
+
+    return p;
+}
+
+static void
+push(struct event ev)
+{
+    int i;
+    struct event tmp;
+
+    if (nheap == capheap) {
+        capheap = capheap ? capheap * 2 : 1024;
+        heap = xrealloc(heap, capheap * sizeof(struct event));
+    }
+
+    i = nheap++;
+    heap[i] = ev;
+    while (i > 0 && heap[(i - 1) / 2].when > heap[i].when) {
+        tmp = heap[i];
+        heap[i] = heap[(i - 1) / 2];
+        heap[(i - 1) / 2] = tmp;
+        i = (i - 1) / 2;
+    }
+}
+
+static struct event
+pop()
+{
+    struct event top = heap[0], tmp;
+    int          i = 0, child;
+
+    heap[0] = heap[--nheap];
+    for ( ; ; ) {
+        child = 2 * i + 1;
+        if (child >= nheap)
+            break;
+        if (child + 1 < nheap && heap[child + 1].when < heap[child].when)
+            child++;
+        if (heap[i].when <= heap[child].when)
+            break;
+        tmp = heap[i];
+        heap[i] = heap[child];
+        heap[child] = tmp;
+        i = child;
+    }
+
+    return top;
+}
+
+static int
+linked(int a, int b)
+{
+    int i;
+
+    for (i = 0; i < nodes[a].nnbrs; i++) {
+        if (nodes[a].nbrs[i] == b)
+            return 1;
+    }
+
+    return 0;
+}
+
+static void
+link_nodes(int a, int b)
+{
+    struct node *n;
+    int         k, ends[2] = { a, b };
+
+    if (a == b || linked(a, b))
+        return;
+
+    for (k = 0; k < 2; k++) {
+        n = &nodes[ends[k]];
+        if (n->nnbrs == n->capnbrs) {
+            n->capnbrs = n->capnbrs ? n->capnbrs * 2 : 8;
+            n->nbrs = xrealloc(n->nbrs, n->capnbrs * sizeof(int));
+        }
+        n->nbrs[n->nnbrs++] = ends[1 - k];
+    }
+}
+
+static void
+build_topology()
+{
+    int i, j;
+
+    for (i = 0; i < nnodes; i++) {
+        for (j = 1; j <= degree; j++) {
+            if (topology == RING)
+                link_nodes(i, (i + (j + 1) / 2 * (j % 2 ? 1 : -1) + nnodes) % nnodes);
+            else
+                link_nodes(i, rand() % nnodes);
+        }
+    }
+}
+
+// a random link latency in microseconds
+static long long
+latency()
+{
+    return (minlat + rand() % (maxlat - minlat + 1)) * 1000LL + rand() % 1000;
+}
+
+// send a message line from node "from" to all its neighbors except "except"
+static void
+send_to_neighbors(int from, int except, const char *line, long long now, int hops)
+{
+    struct event ev;
+    int          i;
+
+    for (i = 0; i < nodes[from].nnbrs; i++) {
+        if (nodes[from].nbrs[i] == except)
+            continue;
+
+        bzero(&ev, sizeof(ev));
+        ev.type = EV_DELIVER;
+        ev.when = now + latency();
+        ev.to = nodes[from].nbrs[i];
+        ev.from = from;
+        ev.hops = hops + 1;
+        ev.line = strdup(line);
+        bytes += strlen(line);
+        push(ev);
+    }
+}
+
+static void
+publish(long long now)
+{
+    struct message m;
+    struct event   ev;
+    char           text[MAXCHAR], line[MAXLINE];
+    int            i, origin, nup = 0;
+
+    for (i = 0; i < nnodes; i++)
+        nup += nodes[i].up;
+    if (nup > 0) {
+        do {
+            origin = rand() % nnodes;
+        } while (!nodes[origin].up);
+
+        // the text carries the index of the message so that the deliveries can be matched
+        bzero(&m, sizeof(m));
+        m.origin = nodes[origin].addr;
+        m.seq = ++nodes[origin].seq;
+        m.ttl = ttl;
+        sprintf(text, "m%lld\n", published);
+        m.text = text;
+        msg_format(line, sizeof(line), &m);
+        gossip_accept(&nodes[origin].seen, &m);
+
+        msgs[published].sent = now;
+        msgs[published].receivers = nup - 1;
+        send_to_neighbors(origin, -1, line, now, 0);
+    }
+
+    if (++published < nmessages) {
+        bzero(&ev, sizeof(ev));
+        ev.type = EV_PUBLISH;
+        ev.when = now + (long long) (1000000 / rate);
+        push(ev);
+    }
+}
+
+static void
+deliver(struct event *ev)
+{
+    struct node    *n = &nodes[ev->to];
+    struct message m;
+    long long      idx;
+
+    if (!n->up) {
+        lost++;
+        return;
+    }
+    if (msg_parse(ev->line, &m) < 0 || sscanf(m.text, "m%lld", &idx) != 1)
+        return;
+
+    if (gossip_accept(&n->seen, &m) == 0) {
+        duplicates++;
+        return;
+    }
+
+    deliveries++;
+    if (nsamples == capsamples) {
+        capsamples = capsamples ? capsamples * 2 : 4096;
+        samples = xrealloc(samples, capsamples * sizeof(struct sample));
+    }
+    samples[nsamples].hops = ev->hops;
+    samples[nsamples].latency = ev->when - msgs[idx].sent;
+    nsamples++;
+
+    // relay with one hop less, like relay_message() in the peer
+    if (--m.ttl > 0) {
+        char line[MAXLINE];
+        msg_format(line, sizeof(line), &m);
+        send_to_neighbors(ev->to, ev->from, line, ev->when, ev->hops);
+    }
+}
+
+static void
+flip_nodes(long long now)
+{
+    struct event ev;
+    int          i;
+
+    for (i = 0; i < nnodes; i++) {
+        if ((double) rand() / RAND_MAX >= churn)
+            continue;
+        nodes[i].up = !nodes[i].up;
+        // a peer that comes back has forgotten the messages it saw
+        if (nodes[i].up) {
+            bzero(nodes[i].seen.keys, nodes[i].seen.nbuckets * SEEN_WAYS * sizeof(unsigned long long));
+            bzero(nodes[i].seen.stamps, nodes[i].seen.nbuckets * SEEN_WAYS * sizeof(unsigned int));
+        }
+    }
+
+    // keep churning while messages are still spreading
+    if (nheap > 0) {
+        bzero(&ev, sizeof(ev));
+        ev.type = EV_CHURN;
+        ev.when = now + 1000000;
+        push(ev);
+    }
+}
+
+static int
+compare_sample(const void *a, const void *b)
+{
+    const struct sample *x = a, *y = b;
+
+    if (x->hops != y->hops)
+        return x->hops - y->hops;
+    return (x->latency > y->latency) - (x->latency < y->latency);
+}
+
+static void
+report()
+{
+    long long receivers = 0, links = 0;
+    int       i, j, hops;
+
+    for (i = 0; i < published; i++)
+        receivers += msgs[i].receivers;
+    for (i = 0; i < nnodes; i++)
+        links += nodes[i].nnbrs;
+
+    printf("peers %d, links per peer %.1f, messages %lld, ttl %d, churn %.3f/s\n", nnodes,
+           (double) links / nnodes, published, ttl, churn);
+    printf("delivery ratio        %.4f (%lld of %lld)\n", receivers ? (double) deliveries / receivers : 0.0,
+           deliveries, receivers);
+    printf("duplicate ratio       %.4f (%lld duplicates)\n",
+           deliveries + duplicates ? (double) duplicates / (deliveries + duplicates) : 0.0, duplicates);
+    printf("lost to down peers    %lld\n", lost);
+    printf("bytes per delivery    %.1f (%lld bytes)\n", deliveries ? (double) bytes / deliveries : 0.0, bytes);
+
+    // latency percentiles of the deliveries, grouped by the number of hops
+    qsort(samples, nsamples, sizeof(struct sample), compare_sample);
+    printf("\n%4s %10s %10s %10s %10s\n", "hops", "deliveries", "p50 ms", "p90 ms", "p99 ms");
+    for (i = 0; i < nsamples; i = j) {
+        hops = samples[i].hops;
+        for (j = i; j < nsamples && samples[j].hops == hops; j++)
+            ;
+        printf("%4d %10d %10.1f %10.1f %10.1f\n", hops, j - i,
+               samples[i + (j - i) * 50 / 100].latency / 1000.0,
+               samples[i + (j - i) * 90 / 100].latency / 1000.0,
+               samples[i + (j - i) * 99 / 100].latency / 1000.0);
+    }
+}
+
+static void
+usage()
+{
+    printf("usage: peersim [-n peers] [-d degree] [-t random|ring] [-m messages] [-r rate]\n"
+           "               [-c churn] [-l minms-maxms] [-T ttl] [-b seenbuckets] [-s seed]\n");
+    exit(0);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct event ev;
+    int          c, i;
+    unsigned int seed = (unsigned int) time(NULL);
+    char         text[ADDR_STRLEN];
+
+    while ((c = getopt(argc, argv, "n:d:t:m:r:c:l:T:b:s:")) != -1) {
+        switch (c) {
+        case 'n': nnodes = atoi(optarg); break;
+        case 'd': degree = atoi(optarg); break;
+        case 't': topology = strcmp(optarg, "ring") == 0 ? RING : RANDOM; break;
+        case 'm': nmessages = atoi(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 'c': churn = atof(optarg); break;
+        case 'l':
+            if (sscanf(optarg, "%d-%d", &minlat, &maxlat) != 2)
+                usage();
+            break;
+        case 'T': ttl = atoi(optarg); break;
+        case 'b': seenbuckets = (unsigned int) atoi(optarg); break;
+        case 's': seed = (unsigned int) atoi(optarg); break;
+        default: usage();
+        }
+    }
+    if (nnodes < 2 || degree < 1 || nmessages < 1 || rate <= 0 || minlat < 0 || maxlat < minlat ||
+        ttl < 1 || ttl > MAX_TTL || seenbuckets < 1)
+        usage();
+
+    srand(seed);
+    nodes = calloc(nnodes, sizeof(struct node));
+    msgs = calloc(nmessages, sizeof(struct msginfo));
+    if (nodes == NULL || msgs == NULL) {
+        perror("allocation error");
+        exit(0);
+    }
+    for (i = 0; i < nnodes; i++) {
+        gossip_init(&nodes[i].seen, seenbuckets);
+        nodes[i].up = 1;
+        sprintf(text, "10.%d.%d.%d", (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff);
+        addr_pton(&nodes[i].addr, text, 8877);
+    }
+    build_topology();
+
+    bzero(&ev, sizeof(ev));
+    ev.type = EV_PUBLISH;
+    push(ev);
+    if (churn > 0) {
+        ev.type = EV_CHURN;
+        ev.when = 1000000;
+        push(ev);
+    }
+
+    while (nheap > 0) {
+        ev = pop();
+        switch (ev.type) {
+        case EV_DELIVER:
+            deliver(&ev);
+            free(ev.line);
+            break;
+        case EV_PUBLISH:
+            publish(ev.when);
+            break;
+        case EV_CHURN:
+            flip_nodes(ev.when);
+            break;
+        }
+    }
+
+    report();
+    exit(0);
+}
@@ -0,0 +1,229 @@
+//
+// The asynchronous resolver of the peer program. Requests are queued to a
+// pool of threads that call getaddrinfo(). Each host name has one cache entry:
+// a request for a host whose address is still fresh completes immediately,
+// and requests for a host that is already being looked up wait for that
+// lookup instead of starting another one. Finished requests are queued for
+// the main thread, which is woken up by a byte written to a pipe.
+//
+// Author: Tien Ho
+// Date:   12/06/16
+//
+
+#include "resolver.h"
+#include "connmgr.h"
+#include "logger.h"
+#include <pthread.h>
+
+struct dnsentry {
+    char            hostname[MAXHOST];
+    struct endpoint addr;
+    long long       expires;
+    int             resolving;      /* a lookup is queued or in progress */
+    int             *waiters;       /* tags of the requests waiting for it */
+    int             nwaiters;
+    int             capwaiters;
+    struct dnsentry *next;          /* next entry in the same bucket */
+    struct dnsentry *nextjob;       /* next entry in the job queue */
+};
+
+static struct dnsentry   *cache[RESOLVE_BUCKETS];
+static struct dnsentry   *jobhead, *jobtail;
+static struct resolution *done;     /* completions not yet polled */
+static int               ndone, capdone;
+static int               notifyfd[2];
+static pthread_mutex_t   lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t    jobready = PTHREAD_COND_INITIALIZER;
+
+static unsigned int
+hash_name(const char *s)
+{
+    unsigned int h = 5381;
+
+    while (*s)
+        h = h * 33 + (unsigned char) *s++;
+
+    return h % RESOLVE_BUCKETS;
+}
+
+static struct dnsentry *
+find_entry(const char *hostname)
+{
+    struct dnsentry *e;
+    unsigned int    b = hash_name(hostname);
+
+    for (e = cache[b]; e != NULL; e = e->next) {
+        if (strcmp(e->hostname, hostname) == 0)
+            return e;
+    }
+
+    if ((e = calloc(1, sizeof(struct dnsentry))) == NULL) {
+        perror("resolver allocation error");
+        exit(0);
+    }
+    strncpy(e->hostname, hostname, sizeof(e->hostname) - 1);
+    e->next = cache[b];
+    cache[b] = e;
+
+    return e;
+}
+
+// queue a completion for the main thread; called with the lock held
+static void
+complete(int tag, const struct dnsentry *e)
+{
+    if (ndone == capdone) {
+        capdone = capdone ? capdone * 2 : 64;
+        if ((done = realloc(done, capdone * sizeof(struct resolution))) == NULL) {
+            perror("resolver allocation error");
+            exit(0);
+        }
+    }
+
+    bzero(&done[ndone], sizeof(struct resolution));
+    done[ndone].tag = tag;
+    done[ndone].addr = e->addr;
+    done[ndone].expires = e->expires;
+    ndone++;
+
+    // wake up select() in the main thread; the pipe is nonblocking and one
+    // pending byte is enough to get the queue drained
+    write(notifyfd[1], "r", 1);
+}
+
+static void *
+resolve_thread(void *arg)
+{
+    struct dnsentry *e;
+    struct addrinfo hints, *res;
+    struct endpoint addr;
+    char            hostname[MAXHOST];
+    int             i;
+
+    for ( ; ; ) {
+        pthread_mutex_lock(&lock);
+        while (jobhead == NULL)
+            pthread_cond_wait(&jobready, &lock);
+        e = jobhead;
+        jobhead = e->nextjob;
+        if (jobhead == NULL)
+            jobtail = NULL;
+        strcpy(hostname, e->hostname);
+        pthread_mutex_unlock(&lock);
+
+        // only the first address of the host is used, IPv6 or IPv4 in the
+        // order getaddrinfo() prefers, and only of a family the host has
+        bzero(&addr, sizeof(addr));
+        bzero(&hints, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_ADDRCONFIG;
+        if ((i = getaddrinfo(hostname, NULL, &hints, &res)) != 0) {
+            logger_msg(LOGGER_WARN, "cannot resolve \"%s\": %s\n", hostname, gai_strerror(i));
+        } else {
+            addr_from(&addr, res->ai_addr);
+            addr.port = 0;
+            freeaddrinfo(res);
+        }
+
+        pthread_mutex_lock(&lock);
+        e->addr = addr;
+        // a failed lookup is not cached so that the next request retries it
+        e->expires = !addr_unset(&addr) ? now_ms() + RESOLVE_TTL * 1000LL : 0;
+        e->resolving = 0;
+        for (i = 0; i < e->nwaiters; i++)
+            complete(e->waiters[i], e);
+        e->nwaiters = 0;
+        pthread_mutex_unlock(&lock);
+    }
+
+    return NULL;
+}
+
+// Start the resolver threads. Returns the descriptor to select() on for
+// completions.
+int
+resolver_init(int nthreads)
+{
+    pthread_t tid;
+    int       i, flags;
+
+    if (pipe(notifyfd) < 0) {
+        perror("pipe error");
+        exit(0);
+    }
+    for (i = 0; i < 2; i++) {
+        flags = fcntl(notifyfd[i], F_GETFL, 0);
+        fcntl(notifyfd[i], F_SETFL, flags | O_NONBLOCK);
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&tid, NULL, resolve_thread, NULL) != 0) {
+            perror("resolver thread error");
+            exit(0);
+        }
+        pthread_detach(tid);
+    }
+
+    return notifyfd[0];
+}
+
+// Ask for the address of a host name. The result is delivered with the given
+// tag by a later resolver_poll(), even when it comes from the cache.
+void
+resolver_submit(const char *hostname, int tag)
+{
+    struct dnsentry *e;
+
+    pthread_mutex_lock(&lock);
+    e = find_entry(hostname);
+    if (!e->resolving && e->expires > now_ms()) {
+        complete(tag, e);
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+
+    if (e->nwaiters == e->capwaiters) {
+        e->capwaiters = e->capwaiters ? e->capwaiters * 2 : 4;
+        if ((e->waiters = realloc(e->waiters, e->capwaiters * sizeof(int))) == NULL) {
+            perror("resolver allocation error");
+            exit(0);
+        }
+    }
+    e->waiters[e->nwaiters++] = tag;
+
+    if (!e->resolving) {
+        e->resolving = 1;
+        e->nextjob = NULL;
+        if (jobtail != NULL)
+            jobtail->nextjob = e;
+        else
+            jobhead = e;
+        jobtail = e;
+        pthread_cond_signal(&jobready);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+// Collect up to nres finished requests. Returns the number collected.
+int
+resolver_poll(struct resolution *res, int nres)
+{
+    char drain[64];
+    int  n;
+
+    while (read(notifyfd[0], drain, sizeof(drain)) > 0)
+        ;
+
+    pthread_mutex_lock(&lock);
+    n = min(nres, ndone);
+    memcpy(res, done, n * sizeof(struct resolution));
+    memmove(done, done + n, (ndone - n) * sizeof(struct resolution));
+    ndone -= n;
+    // leave a wakeup behind for the completions that did not fit
+    if (ndone > 0)
+        write(notifyfd[1], "r", 1);
+    pthread_mutex_unlock(&lock);
+
+    return n;
+}
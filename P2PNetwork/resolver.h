@@ -0,0 +1,32 @@
+//
+// The header file for the asynchronous resolver of the peer program. Host
+// names from the peersfile are resolved by a small pool of threads so that the
+// peer can listen and connect to the peers already resolved while the other
+// lookups are still in progress. Results are cached for RESOLVE_TTL seconds.
+// Completions are reported through a pipe that the peer adds to its select()
+// read set.
+//
+// Author: Tien Ho
+// Date: 12/06/16.
+//
+
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include "utils.h"
+
+#define RESOLVE_THREADS   4     /* number of lookups run in parallel */
+#define RESOLVE_TTL     300     /* seconds a resolved address is reused */
+#define RESOLVE_BUCKETS 256     /* buckets of the host name cache */
+
+struct resolution {
+    int             tag;         /* identifies the request for the caller */
+    struct endpoint addr;        /* unset if the host name did not resolve; no port */
+    long long       expires;     /* when the address must be looked up again, in ms */
+};
+
+int  resolver_init(int nthreads);
+void resolver_submit(const char *hostname, int tag);
+int  resolver_poll(struct resolution *res, int nres);
+
+#endif //RESOLVER_H
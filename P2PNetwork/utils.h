@@ -8,20 +8,17 @@
 #ifndef UTILS_H
 #define UTILS_H
 
-#include	<sys/socket.h>	/* basic socket definitions */
-#include	<arpa/inet.h>	/* inet(3) functions */
-#include	<errno.h>
-#include	<stdio.h>
-#include	<stdlib.h>
-#include	<string.h>
+#include "net.h"
+#include "addr.h"
 #include    <signal.h>
 #include    <fcntl.h>
 #include    <netdb.h>
+#include    <time.h>
+#include    <sys/time.h>
+#include    <limits.h>
 
-#define	MAXLINE	    4096	/* max text line length */
 #define MAXCHAR       30
-#define	BUFFSIZE    8192	/* buffer size for reads and writes */
-#define LISTENQ       10
+#define MAXHOST      256    /* max host name length */
 #define YES            1
 #define NO             2
 #define CONNECTING     3    /* connect() in progress */
@@ -29,22 +26,28 @@
 #define INACTIVE       5
 #define DONE           6
 
-#define	min(a,b)	((a) < (b) ? (a) : (b))
-#define	max(a,b)	((a) > (b) ? (a) : (b))
+#define DEFAULT_TTL    8    /* hops a user message travels by default */
+#define MAX_TTL      255
+
+#define PEX_INTERVAL  10    /* seconds between two peer exchanges */
+#define PEX_SAMPLE     8    /* max number of peers sent in one exchange */
+
+#define PEER_INSIZE  MAXLINE    /* the input buffer of a neighbor, a 4 KB pool chunk */
 
 struct peer {
-    char ipaddr[MAXCHAR];
-    int  port;
+    char            hostname[MAXHOST];
+    struct endpoint ep;     /* the address, unset until resolved, and the port */
 };
 
 struct peerconn {
-    char ipaddr[MAXCHAR];
-    int  port;
-    int  hostport;
-    char hostipaddr[MAXCHAR];
-    int  flag;
-    int  seqnum;
-    int  fd;
+    struct endpoint addr;   /* the other end of the connection */
+    struct endpoint host;   /* this end */
+    int             flag;
+    int             fd;
+    int             cand;           /* index of the candidate dialed, or -1 if accepted */
+    int             listenport;     /* port the neighbor accepts peers on, 0 if unknown */
+    int             inlen;
+    char            *inbuf;         /* bytes received but not yet a complete line */
 };
 
 #endif //UTILS_H
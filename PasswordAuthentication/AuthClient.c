@@ -1,47 +1,132 @@
 //
-// The iterative server program to authenticate a username and password pair
-// received from a client, using a provided file of legitimate pairs of usernames
-// and passwords. This server is iterative because it can only serve one client at
-// a time.
+// The client program to prompt the user for a username and password, which
+// are then sent to the server for authentication. Given a session file, the
+// client saves the session token that the server sends after a successful
+// login, and logs in with the token the next time instead of prompting.
+//
+// With -b the client does not prompt but benchmarks the server instead,
+// replaying the credentials of a password file; see authbench.c.
 //
 // Author: Tien Ho
 // Date:   9/20/16
 //
 
 #include "utils.h"
+#include "protocol.h"
+#include "authbench.h"
+#include <netdb.h>
+
+static struct linebuf in;       /* the replies received and not yet read */
+static int            nextid = 1;
+
+// Send a request to the server and read its reply, without the id, into
+// recvmsg.
+static void
+exchange(int sockfd, const char *request, char *recvmsg)
+{
+    char buff[MAXREQUEST];
+    char line[MAXREQUEST];
+    int  id, replyid, skip;
+
+    id = nextid++;
+    snprintf(buff, sizeof(buff), "%d %s\n", id, request);
+    if (write(sockfd, buff, strlen(buff)) < 0) {
+        perror("write error");
+        exit(0);
+    }
+
+    for ( ; ; ) {
+        while (linebuf_next(&in, line)) {
+            skip = 0;
+            if (sscanf(line, "%d %n", &replyid, &skip) == 1 && skip > 0 && replyid == id) {
+                strcpy(recvmsg, line + skip);
+                return;
+            }
+        }
+        if (linebuf_fill(sockfd, &in) <= 0) {
+            perror("cannot read server feedback");
+            exit(0);
+        }
+    }
+}
 
 int
 main(int argc, char **argv)
 {
     int                sockfd;
-    struct sockaddr_in servaddr;
+    struct addrinfo    hints, *servaddr;
     char               username[MAXCHAR];
     char               password[MAXCHAR];
-    char               buff[MAXLINE];
-    char               recvmsg[MAXLINE];
+    char               buff[MAXREQUEST];
+    char               recvmsg[MAXREQUEST];
+    char               token[MAXREQUEST];
+    FILE               *session;
+    struct benchopts   bench;
+    int                c;
+
+    bzero(&bench, sizeof(bench));
+    bench.nconns = 8;
+    bench.nrequests = 10000;
+    bench.goodratio = 0.9;
+    bench.depth = 1;
+    while ((c = getopt(argc, argv, "b:c:n:g:d:")) != -1) {
+        switch (c) {
+        case 'b':
+            bench.credfile = optarg;
+            break;
+        case 'c':
+            bench.nconns = atoi(optarg);
+            break;
+        case 'n':
+            bench.nrequests = atol(optarg);
+            break;
+        case 'g':
+            bench.goodratio = atof(optarg);
+            break;
+        case 'd':
+            bench.depth = atoi(optarg);
+            break;
+        default:
+            exit(0);
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
 
     // ensure that the IP address and the port number are provided when the program is executed
-    if (argc != 3) {
-        perror("usage: AuthClient <IPaddress> <port>");
+    if (argc != 3 && argc != 4) {
+        perror("usage: AuthClient [-b credential file [-c connections] [-n requests] [-g good ratio] [-d depth]] "
+               "<IPaddress> <port> [session file]");
+        exit(0);
+    }
+    if (bench.nconns < 1 || bench.nrequests < 1 || bench.goodratio < 0 || bench.goodratio > 1 ||
+        bench.depth < 1 || bench.depth > BENCH_MAXDEPTH) {
+        fprintf(stderr, "invalid benchmark options\n");
         exit(0);
     }
 
-    if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("socket error");
+    // specify the ip address, IPv4 or IPv6, and port number of the server to connect
+    bzero(&hints, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+    if (getaddrinfo(argv[1], argv[2], &hints, &servaddr) != 0) { // argv[2] = port
+        printf("inet_pton error for %s", argv[1]); // argv[1] == IP address
         exit(0);
     }
 
-    // specify the ip address and port number of the server to connect
-    bzero(&servaddr, sizeof(servaddr));
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_port = htons(atoi(argv[2])); // argv[2] = port
+    if (bench.credfile != NULL) {
+        memcpy(&bench.servaddr, servaddr->ai_addr, servaddr->ai_addrlen);
+        bench.servlen = servaddr->ai_addrlen;
+        return run_benchmark(&bench);
+    }
 
-    if (inet_pton(AF_INET, argv[1], &servaddr.sin_addr) <= 0) {
-        printf("inet_pton error for %s", argv[1]); // argv[1] == IP address
+    if ((sockfd = socket(servaddr->ai_family, SOCK_STREAM, 0)) < 0) {
+        perror("socket error");
         exit(0);
     }
 
-    if (connect(sockfd, (struct sockaddr *) &servaddr, sizeof(servaddr)) < 0) {
+    if (connect(sockfd, servaddr->ai_addr, servaddr->ai_addrlen) < 0) {
         perror("connect error");
         exit(0);
     }
@@ -52,6 +137,21 @@ main(int argc, char **argv)
     // he/she has not succeeded and has not passed the limited number of
     // authentication attempts
     strcpy(recvmsg, "failure");
+
+    // log in with the saved session token, if there is one
+    if (argc == 4 && (session = fopen(argv[3], "r")) != NULL) { // argv[3] = session file
+        bzero(token, sizeof(token));
+        if (fscanf(session, "%400s", token) == 1) {
+            snprintf(buff, sizeof(buff), "token %s", token);
+            exchange(sockfd, buff, recvmsg);
+            if (strcmp(recvmsg, "failure") == 0 || strncmp(recvmsg, "error", 5) == 0) {
+                printf("Your session has expired\n");
+                strcpy(recvmsg, "failure");
+            }
+        }
+        fclose(session);
+    }
+
     while (strcmp(recvmsg, "failure") == 0) {
         // read in the input username and password
         printf("Enter your username: ");
@@ -63,37 +163,42 @@ main(int argc, char **argv)
         printf("\n");
 
         // combine the username and password into one
-        // single message to send to the server
-        bzero(buff, sizeof(buff));
-        strcpy(buff, username);
-        strcat(buff, " ");
-        strcat(buff, password);
+        // single request to send to the server
+        snprintf(buff, sizeof(buff), "auth %s %s", username, password);
 
         // send the username and password to the server
-        if (write(sockfd, buff, strlen(buff)) < 0) {
-            perror("write error");
-            exit(0);
-        }
-
-        if (read(sockfd, recvmsg, MAXLINE) < 0) {
-            perror("read error");
-            exit(0);
-        }
+        exchange(sockfd, buff, recvmsg);
     }
 
-    if (strcmp(recvmsg, "success") == 0) {
+    // a successful login may come with a session token, "success <token>"
+    if (strncmp(recvmsg, "success", 7) == 0 && (recvmsg[7] == '\0' || recvmsg[7] == ' ')) {
         printf("Logged in successfully\n");
+        if (argc == 4 && recvmsg[7] == ' ') {
+            if ((session = fopen(argv[3], "w")) == NULL) {
+                perror("cannot save the session");
+                exit(0);
+            }
+            fprintf(session, "%s\n", recvmsg + 8);
+            fclose(session);
+        }
     }
     else if (strcmp(recvmsg, "final failure") == 0) {
         printf("Failed to authenticate\n");
     }
+    else if (strcmp(recvmsg, "busy") == 0) {
+        printf("The server is busy, try again later\n");
+    }
+    else if (strcmp(recvmsg, "throttled") == 0) {
+        printf("Too many attempts, try again later\n");
+    }
+    else if (strncmp(recvmsg, "error ", 6) == 0) {
+        printf("The server refused the request: %s\n", recvmsg + 6);
+    }
     else {
         perror("cannot read server feedback");
         exit(0);
     }
 
-    // exit when the connection is closed by the server
-    if (read(sockfd, recvmsg, strlen(recvmsg)) == 0) {
-        exit(0);
-    }
+    close(sockfd);
+    return 0;
 }
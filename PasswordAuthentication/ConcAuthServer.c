@@ -4,146 +4,781 @@
 // and passwords. This server is concurrent because it can serve multiple clients at
 // the same time by dispatching a child process for each client.
 //
+// With --workers=N the server instead forks N worker processes at startup. Each
+// worker accepts clients from the shared listen socket and serves all of its
+// clients in one event loop, so that a login costs no fork. The salted
+// password hashes are verified by a pool of threads in each worker, so that the
+// loop goes on serving the other clients while a hash is computed. A client
+// that does not read its replies is no longer read from once MAXQUEUED bytes
+// of replies are owed to it, and never holds up the others.
+//
+// With METRICS_ENDPOINT set, the server answers requests for the metrics of
+// all its processes there.
+//
 // Author: Tien Ho
 // Date:   9/20/16
 //
 
 #include "utils.h"
+#include "credwatch.h"
+#include "kdfpool.h"
+#include "ratelimit.h"
+#include "session.h"
+#include "protocol.h"
+#include "listener.h"
+#include "metrics.h"
+#include <getopt.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#define MAXWORKERS  256
+#define MAXINFLIGHT  32      /* verifications in progress per connection */
+#define MAXQUEUED    (MAXINFLIGHT * MAXREQUEST)  /* reply bytes owed to a connection */
+#define SPAWN_RETRY  1       /* seconds before a failed fork is tried again */
+
+static volatile sig_atomic_t report;     /* SIGUSR1 asked for the KDF pool stats */
+static struct ratelimit      *limiter;   /* shared by all the server processes */
+static struct sessions       *sessions;  /* shared by all the server processes */
+static char                  decoy[PASSHASH_MAXLEN];  /* verified for unknown users */
+
+// the ids of the metrics
+static int                   succeeded, failed, throttled, refused;
+static int                   kdftime, kdfinflight;
+
+// what to do after a request from a client
+#define MSG_REPLY     0      /* send the reply and read the next request */
+#define MSG_CLOSE     1      /* send the reply and close the connection */
+#define MSG_VERIFY    2      /* verify the password first */
+
+// the state of a connected client
+struct client {
+    int            attempt;         /* failed attempts in a row, -1 if no client */
+    unsigned int   gen;             /* tells apart the connections on one fd */
+    int            inflight;        /* requests waiting for the KDF pool */
+    int            finishing;       /* close once the queued replies are sent */
+    struct endpoint addr;           /* the port is not used */
+    struct linebuf in;
+    char           *out;            /* the replies the socket did not take, or NULL */
+    int            outlen;
+};
+
+// a request waiting for the KDF pool, with what it takes to answer it
+struct pending {
+    int          fd;                         /* -1 if the slot is free */
+    unsigned int gen;
+    long long    submitted;                  /* reactor_usec() when it went to the pool */
+    char         id[MAXID];
+    char         username[SESSION_MAXUSER];  /* whom a token would be issued to */
+};
+
+// Write the reply to an attempt into buff. A successful client gets a new
+// session token along with the success.
+static int
+attempt_result(struct client *c, int ok, const char *id, const char *username, char *buff)
+{
+    char token[SESSION_MAXTOKEN];
+
+    metric_add(ok ? succeeded : failed, 1);
+    if (ok) {
+        c->attempt = 0;
+        if (username[0] != '\0' && session_issue(sessions, username, token, sizeof(token)) == 0)
+            snprintf(buff, MAXREQUEST, "%s success %s\n", id, token);
+        else
+            snprintf(buff, MAXREQUEST, "%s success\n", id);
+        return MSG_REPLY;
+    }
 
+    // send the final failure message to the client
+    // to indicate that the server no longer allows any
+    // additional authentication attempts
+    if (++c->attempt == MAXATTEMPT) {
+        snprintf(buff, MAXREQUEST, "%s final failure\n", id);
+        return MSG_CLOSE;
+    }
+
+    snprintf(buff, MAXREQUEST, "%s failure\n", id);
+    return MSG_REPLY;
+}
+
+// Make the decoy for the users not in the store. It is made again with each
+// store, since the hashes of a new password file may be slower or faster.
+static void
+make_decoy(const credstore *store)
+{
+    if (passhash_decoy(credstore_sample(store), decoy, sizeof(decoy)) < 0) {
+        perror("cannot make the decoy password");
+        exit(0);
+    }
+}
+
+// Handle a request from a client up to the password verification, checking
+// the rate limits before anything else. Returns MSG_VERIFY with *password set
+// to the stored password or hash of the user, *recvpasswrd to the password
+// sent and username to the user, or else the reply in buff. An unknown user
+// is verified against the decoy, so that the time of the reply does not tell
+// whether the user exists; the decoy never matches.
+static int
+handle_request(const credstore *store, char *line, struct client *c, struct request *req,
+               const char **password, char **recvpasswrd, char *username, char *buff)
+{
+    int ok;
+
+    username[0] = '\0';
+    if (parse_request(line, req) < 0) {
+        snprintf(buff, MAXREQUEST, "0 error malformed request\n");
+        return MSG_CLOSE;
+    }
+
+    // a returning client only has its address limited, since a token costs
+    // one HMAC at most; the user must still be in the password file
+    if (strcmp(req->verb, "token") == 0 && req->arg1 != NULL) {
+        if (!ratelimit_check_addr(limiter, &c->addr)) {
+            metric_add(throttled, 1);
+            snprintf(buff, MAXREQUEST, "%s throttled\n", req->id);
+            return MSG_REPLY;
+        }
+        ok = session_verify(sessions, req->arg1, username, SESSION_MAXUSER) &&
+             credstore_lookup(store, username) != NULL;
+        return attempt_result(c, ok, req->id, username, buff);
+    }
+
+    if (strcmp(req->verb, "auth") != 0 || req->arg2 == NULL) {
+        snprintf(buff, MAXREQUEST, "%s error unknown request\n", req->id);
+        return MSG_REPLY;
+    }
+
+    // no password this long is verified, so it is not worth a hash or a slot
+    // in the KDF pool
+    if (strlen(req->arg2) >= KDF_MAXPASS) {
+        snprintf(buff, MAXREQUEST, "%s error password too long\n", req->id);
+        return MSG_REPLY;
+    }
+
+    // a client over its limits is turned away without looking at its password
+    if (!ratelimit_check(limiter, &c->addr, req->arg1)) {
+        metric_add(throttled, 1);
+        snprintf(buff, MAXREQUEST, "%s throttled\n", req->id);
+        return MSG_REPLY;
+    }
+
+    // check the record to find any matching for the client's provided username and password
+    if ((*password = credstore_lookup(store, req->arg1)) == NULL)
+        *password = decoy;
+    else if (strlen(req->arg1) < SESSION_MAXUSER)
+        strcpy(username, req->arg1);
+    *recvpasswrd = req->arg2;
+    return MSG_VERIFY;
+}
+
+// Serve a client in its own process, answering its requests in order.
 int
-authenticate(const int connfd, const userinfo *record)
-{
-    char               recvusername[MAXCHAR];
-    char               recvpasswrd[MAXCHAR];
-    char               buff[MAXLINE];
-    char               recvline[MAXLINE];
-    int                attempt = 0;
-    int                success = 0;
-    int                found = 0;
-
-    // only perform authentication if the client has not succeeded
-    // and has not exceeded the allowed number of authentication attempts
-    while (attempt != 3 && success != 1) {
-        bzero(recvline, sizeof(recvline));
-        if (read(connfd, recvline, MAXLINE) < 0) {
-            perror("read error");
-            exit(0);
+authenticate(const int connfd, const credstore *store, const struct endpoint *addr)
+{
+    char               buff[MAXREQUEST];
+    char               line[MAXREQUEST];
+    char               username[SESSION_MAXUSER];
+    char               *recvpasswrd;
+    const char         *password;
+    struct request     req;
+    struct client      c;
+    int                action;
+    ssize_t            n;
+
+    bzero(&c, sizeof(c));
+    c.addr = *addr;
+
+    for ( ; ; ) {
+        // the client left or sent a line too long to be a request
+        if ((n = linebuf_fill(connfd, &c.in)) <= 0) {
+            if (n < 0 && errno == EMSGSIZE)
+                write(connfd, "0 error request too long\n", 25);
+            return 0;
         }
 
-        // the username and password pair sent from the client
-        // is assumed to be separated by a space
-        char * token = strtok(recvline, " ");
-        if (token != NULL) {
-            bzero(recvusername, sizeof(recvusername));
-            strcpy(recvusername, token);
-            token = strtok(NULL, " "); // scan from the end of the last token
-            bzero(recvpasswrd, sizeof(recvpasswrd));
-            strcpy(recvpasswrd, token);
-        }
-
-        // check the record to find any matching for the client's provided username and password
-        size_t n = sizeof(record) / sizeof(record[0]);
-        size_t i;
-        for (i = 0; i < sizeof(record); i++) {
-            if (strcmp(record[i].username, recvusername) == 0) {
-                found = 1;
-                if (strcmp(record[i].password, recvpasswrd) == 0) {
-                    strcpy(buff, "success");
-                    success = 1;
-                    break;
-                }
-                else {
-                    strcpy(buff, "failure");
-                    attempt++;
-                    break;
-                }
+        while (linebuf_next(&c.in, line)) {
+            action = handle_request(store, line, &c, &req, &password, &recvpasswrd, username, buff);
+            if (action == MSG_VERIFY)
+                action = attempt_result(&c, passhash_verify(password, recvpasswrd), req.id, username, buff);
+
+            if (write(connfd, buff, strlen(buff)) < 0) {
+                perror("write error");
+                exit(0);
             }
+            if (action == MSG_CLOSE)
+                return 0;
         }
+    }
+}
+
+// reap the child server processes as they finish
+static void
+sig_chld(int signo)
+{
+    int saved = errno;
+
+    while (waitpid(-1, NULL, WNOHANG) > 0)
+        ;
+    errno = saved;
+}
+
+static void
+sig_usr1(int signo)
+{
+    report = 1;
+}
+
+// the state of a worker process
+static struct client  clients[FD_SETSIZE];
+static struct reactor loop;
+static credstore      *wstore;      /* the store the worker answers from */
+static struct credwatch wwatcher;   /* reloads wstore */
+static struct pending *pending;     /* one slot per verification the pool holds */
+static int            *freeslots;   /* the free slots of pending */
+static int            nfree;
+
+// Swap in the store the watcher reloaded, if any, before answering more
+// requests. Only this thread reads the store, so the old one can go at once;
+// the verifications in progress work on copies.
+static void
+take_store(void)
+{
+    credstore *fresh;
+
+    if ((fresh = credwatch_take(&wwatcher)) != NULL) {
+        credstore_free(wstore);
+        wstore = fresh;
+        make_decoy(wstore);
+    }
+}
 
-        if (found == 0) {
-            strcpy(buff, "failure");
-            attempt++;
+static void
+close_client(int fd)
+{
+    reactor_remove(&loop, fd);
+    close(fd);
+    free(clients[fd].out);
+    clients[fd].out = NULL;
+    clients[fd].outlen = 0;
+    clients[fd].attempt = -1;
+}
+
+// Whether the client has room for the reply to one more request, besides the
+// batched bytes not written yet and the replies its verifications will need.
+// Every reply counts, so that a client that sends requests without reading
+// the replies is no longer read from once MAXQUEUED bytes are owed to it.
+static int
+has_room(const struct client *c, int batched)
+{
+    return c->outlen + batched + (c->inflight + 1) * MAXREQUEST <= MAXQUEUED;
+}
+
+// Send replies to the client on fd, and queue what the socket does not take
+// at once; the queue is written when the socket drains. Returns -1 if the
+// client is gone.
+static int
+client_write(int fd, const char *data, int len)
+{
+    struct client *c = &clients[fd];
+    ssize_t       n = 0;
+
+    if (c->outlen == 0) {
+        while ((n = write(fd, data, len)) < 0 && errno == EINTR)
+            ;
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+        if ((n = max(n, 0)) == len)
+            return 0;
+    }
+
+    if ((c->out == NULL && (c->out = malloc(MAXQUEUED)) == NULL) || c->outlen + len - n > MAXQUEUED)
+        return -1;
+    memcpy(c->out + c->outlen, data + n, len - n);
+    c->outlen += len - n;
+
+    return 0;
+}
+
+// Write the queued replies as far as the socket takes them. Returns -1 if the
+// client is gone.
+static int
+client_flush(int fd)
+{
+    struct client *c = &clients[fd];
+    ssize_t       n;
+
+    while ((n = write(fd, c->out, c->outlen)) < 0 && errno == EINTR)
+        ;
+    if (n < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+
+    c->outlen -= n;
+    if (c->outlen > 0) {
+        memmove(c->out, c->out + n, c->outlen);
+    }
+    else {
+        free(c->out);
+        c->out = NULL;
+    }
+
+    return 0;
+}
+
+// Wait for what the client needs next: room in its socket for the queued
+// replies, and more requests while it has room for their replies. A client
+// that is finishing is closed once its replies are sent.
+static void
+client_events(int fd)
+{
+    struct client *c = &clients[fd];
+
+    if (c->finishing && c->outlen == 0)
+        close_client(fd);
+    else if (c->finishing)
+        reactor_modify(&loop, fd, EV_WRITE);
+    else
+        reactor_modify(&loop, fd, (has_room(c, 0) ? EV_READ : 0) | (c->outlen > 0 ? EV_WRITE : 0));
+}
+
+// Answer the requests buffered for the client on fd. The replies that can be
+// given at once are gathered and written together; the hashes go to the pool.
+// The client is read from again only while it has room for more replies.
+static void
+serve_client(int fd, const credstore *store)
+{
+    struct client  *c = &clients[fd];
+    struct pending *p;
+    struct request req;
+    char           out[MAXLINE];
+    char           line[MAXREQUEST];
+    char           buff[MAXREQUEST];
+    char           username[SESSION_MAXUSER];
+    char           *recvpasswrd;
+    const char     *password;
+    int            action = MSG_REPLY, outlen = 0, slot;
+
+    while (!c->finishing && action != MSG_CLOSE && has_room(c, outlen) && linebuf_next(&c->in, line)) {
+        action = handle_request(store, line, c, &req, &password, &recvpasswrd, username, buff);
+        if (action == MSG_VERIFY && !passhash_is_hashed(password)) {
+            action = attempt_result(c, passhash_verify(password, recvpasswrd), req.id, username, buff);
+        }
+        else if (action == MSG_VERIFY) {
+            // a verification needs a pending slot as well as room in the pool
+            slot = nfree > 0 ? freeslots[nfree - 1] : -1;
+            if (slot >= 0 && kdfpool_submit(password, recvpasswrd, slot) == 0) {
+                nfree--;
+                p = &pending[slot];
+                p->fd = fd;
+                p->gen = c->gen;
+                p->submitted = reactor_usec();
+                strcpy(p->id, req.id);
+                strcpy(p->username, username);
+                c->inflight++;
+                metric_add(kdfinflight, 1);
+                continue;
+            }
+            metric_add(refused, 1);
+            snprintf(buff, sizeof(buff), "%s busy\n", req.id);
+            action = MSG_REPLY;
         }
 
-        // send the final failure message to the client
-        // to indicate that the server no longer allows any
-        // additional authentication attempts
-        if (attempt == 3) {
-            strcpy(buff, "final failure");
+        if (outlen + (int) strlen(buff) > (int) sizeof(out)) {
+            if (client_write(fd, out, outlen) < 0) {
+                close_client(fd);
+                return;
+            }
+            outlen = 0;
         }
+        memcpy(out + outlen, buff, strlen(buff));
+        outlen += strlen(buff);
+    }
 
-        if (write(connfd, buff, strlen(buff)) < 0) {
-            perror("write error");
+    if (outlen > 0 && client_write(fd, out, outlen) < 0) {
+        close_client(fd);
+        return;
+    }
+    if (action == MSG_CLOSE)
+        c->finishing = 1;
+    client_events(fd);
+}
+
+// Answer a request whose hash the pool has verified, unless its client has
+// left in the meantime.
+static void
+finish_request(int slot, int ok, const credstore *store)
+{
+    struct pending *p = &pending[slot];
+    struct client  *c = &clients[p->fd];
+    char           buff[MAXREQUEST];
+    int            action;
+
+    freeslots[nfree++] = slot;
+    metric_add(kdfinflight, -1);
+    metric_observe(kdftime, reactor_usec() - p->submitted);
+    if (c->attempt < 0 || c->gen != p->gen)
+        return;
+
+    c->inflight--;
+    if (c->finishing)
+        return;
+    action = attempt_result(c, ok, p->id, p->username, buff);
+    if (client_write(p->fd, buff, strlen(buff)) < 0) {
+        close_client(p->fd);
+        return;
+    }
+    if (action == MSG_CLOSE) {
+        c->finishing = 1;
+        client_events(p->fd);
+        return;
+    }
+
+    // the client may have stopped for room for more replies
+    serve_client(p->fd, store);
+}
+
+// a client sent some requests or can take more of its replies
+static void
+client_ready(struct reactor *r, int fd, int events, void *arg)
+{
+    struct client *c = &clients[fd];
+    ssize_t       n;
+
+    if ((events & EV_WRITE) && client_flush(fd) < 0) {
+        close_client(fd);
+        return;
+    }
+
+    if ((events & EV_READ) && !c->finishing) {
+        // the client left or sent a line too long to be a request
+        if ((n = linebuf_fill(fd, &c->in)) == 0 ||
+            (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            if (n < 0 && errno == EMSGSIZE && client_write(fd, "0 error request too long\n", 25) == 0) {
+                c->finishing = 1;
+                client_events(fd);
+            }
+            else {
+                close_client(fd);
+            }
+            return;
+        }
+    }
+
+    // the replies sent may have made room for the requests buffered
+    take_store();
+    serve_client(fd, wstore);
+}
+
+// the KDF pool has verified some hashes
+static void
+kdf_ready(struct reactor *r, int fd, int events, void *arg)
+{
+    struct kdfresult results[64];
+    int              i, nres;
+
+    take_store();
+    while ((nres = kdfpool_poll(results, 64)) > 0) {
+        for (i = 0; i < nres; i++)
+            finish_request(results[i].tag, results[i].ok, wstore);
+    }
+}
+
+// The listen socket is shared by all workers, so a worker that lost the race
+// for a client gets nothing.
+static void
+client_accepted(struct reactor *r, int connfd, const struct endpoint *cliaddr, void *arg)
+{
+    if (connfd >= FD_SETSIZE || reactor_add(r, connfd, EV_READ, client_ready, NULL) < 0) {
+        close(connfd);
+        return;
+    }
+    clients[connfd].attempt = 0;
+    clients[connfd].gen++;
+    clients[connfd].inflight = 0;
+    clients[connfd].finishing = 0;
+    clients[connfd].addr = *cliaddr;
+    clients[connfd].in.len = 0;
+}
+
+// The event loop of a worker process. The worker takes the clients that it
+// can accept from the listen socket and answers the requests of whichever of
+// them sent some. The requests of a client are answered as they are ready:
+// one whose hash is being verified does not hold up the ones behind it.
+static void
+run_worker(int listenfd, credstore *store, const char *path, int kdfthreads, int kdfqueue)
+{
+    struct kdfstats    stats;
+    struct sigaction   sa;
+    sigset_t           set;
+    int                kdffd, fd, i, nslots;
+
+    // the threads started here leave SIGUSR1 to the event loop, where it
+    // interrupts the wait for events
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    credwatch_start(&wwatcher, path);
+    kdffd = kdfpool_init(kdfthreads, kdfqueue);
+    bzero(&sa, sizeof(sa));
+    sa.sa_handler = sig_usr1;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+
+    // a client that goes away while being written to must not kill the worker
+    signal(SIGPIPE, SIG_IGN);
+
+    // the pool holds at most kdfqueue verifications waiting and one running
+    // in each thread
+    nslots = kdfqueue + kdfthreads;
+    pending = calloc(nslots, sizeof(struct pending));
+    freeslots = calloc(nslots, sizeof(int));
+    if (pending == NULL || freeslots == NULL) {
+        perror("worker allocation error");
+        exit(0);
+    }
+    for (i = 0; i < nslots; i++)
+        freeslots[nfree++] = nslots - 1 - i;
+
+    for (fd = 0; fd < FD_SETSIZE; fd++)
+        clients[fd].attempt = -1;
+    wstore = store;
+    if (reactor_init(&loop, REACTOR_DEFAULT) < 0 || reactor_add(&loop, kdffd, EV_READ, kdf_ready, NULL) < 0 ||
+        listener_add(&loop, listenfd, 1, client_accepted, NULL) < 0) {
+        perror("reactor error");
+        exit(0);
+    }
+
+    for ( ; ; ) {
+        // the store is swapped as the clients wake the worker up, not here,
+        // where the requests that end the wait would find the old one
+        if (report) {
+            report = 0;
+            kdfpool_stats(&stats);
+            fprintf(stderr, "worker %d: kdf queue depth %u (max %u), %llu verified, %llu refused\n",
+                    (int) getpid(), stats.depth, stats.maxdepth, stats.completed, stats.rejected);
+        }
+
+        if (reactor_poll(&loop, -1) < 0) {
+            perror("reactor error");
             exit(0);
         }
     }
+}
 
-    return 0;
+static pid_t
+spawn_worker(int listenfd, credstore *store, const char *path, int kdfthreads, int kdfqueue)
+{
+    pid_t    pid;
+    sigset_t set;
+
+    if ((pid = fork()) < 0) {
+        perror("fork error");
+        return -1;
+    }
+    if (pid == 0) {
+        sigemptyset(&set);
+        sigaddset(&set, SIGCHLD);
+        sigaddset(&set, SIGTERM);
+        sigaddset(&set, SIGINT);
+        sigaddset(&set, SIGUSR1);
+        sigaddset(&set, SIGALRM);
+        sigprocmask(SIG_UNBLOCK, &set, NULL);
+        run_worker(listenfd, store, path, kdfthreads, kdfqueue);
+        exit(0);
+    }
+
+    return pid;
+}
+
+// The parent of the workers only supervises them: it restarts the workers
+// that die, passes SIGHUP on to them so that they reload the password file
+// and SIGUSR1 so that they report their KDF pool, and stops them when it is
+// stopped itself. A worker that cannot be forked is tried again every
+// SPAWN_RETRY seconds until it is.
+static void
+run_workers(int listenfd, credstore *store, const char *path, int nworkers, int kdfthreads, int kdfqueue)
+{
+    pid_t    workers[MAXWORKERS];
+    pid_t    pid;
+    sigset_t set;
+    int      sig, i, status, retrying = 0;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGALRM);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+    sigprocmask(SIG_BLOCK, &set, NULL);
+
+    for (i = 0; i < nworkers; i++)
+        workers[i] = spawn_worker(listenfd, store, path, kdfthreads, kdfqueue);
+
+    for ( ; ; ) {
+        // the slots left empty by a failed fork are retried on a timer
+        for (i = 0; i < nworkers && workers[i] > 0; i++)
+            ;
+        if (i < nworkers && !retrying) {
+            alarm(SPAWN_RETRY);
+            retrying = 1;
+        }
+
+        if (sigwait(&set, &sig) != 0)
+            continue;
+
+        if (sig == SIGALRM) {
+            retrying = 0;
+            for (i = 0; i < nworkers; i++) {
+                if (workers[i] <= 0)
+                    workers[i] = spawn_worker(listenfd, store, path, kdfthreads, kdfqueue);
+            }
+        }
+        else if (sig == SIGHUP || sig == SIGUSR1) {
+            for (i = 0; i < nworkers; i++) {
+                if (workers[i] > 0)
+                    kill(workers[i], sig);
+            }
+        }
+        else if (sig == SIGCHLD) {
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                for (i = 0; i < nworkers; i++) {
+                    if (workers[i] == pid) {
+                        fprintf(stderr, "worker %d exited, restarting it\n", (int) pid);
+                        workers[i] = spawn_worker(listenfd, store, path, kdfthreads, kdfqueue);
+                    }
+                }
+            }
+        }
+        else {
+            for (i = 0; i < nworkers; i++) {
+                if (workers[i] > 0)
+                    kill(workers[i], SIGTERM);
+            }
+            exit(0);
+        }
+    }
 }
 
 int
 main(int argc, char **argv)
 {
     pid_t              pid;
-    int                listenfd, connfd, n;
-    struct sockaddr_in servaddr, cliaddr;
+    int                listenfd, connfd, n, c;
+    int                nworkers = 0;
+    int                kdfthreads = KDF_THREADS;
+    int                kdfqueue = KDF_QUEUE;
+    int                ratelimited = 1;
+    struct sockaddr_storage cliaddr;
+    struct endpoint    addr;
     socklen_t          len;
-    userinfo           record[7];
-    FILE *             userrecord;
-    char               buff[MAXLINE];
+    credstore          *store, *fresh;
+    struct credwatch   watcher;
+    struct sigaction   sa;
+    static struct option longopts[] = {
+        { "workers", required_argument, NULL, 'w' },
+        { "kdf-threads", required_argument, NULL, 't' },
+        { "kdf-queue", required_argument, NULL, 'q' },
+        { "no-ratelimit", no_argument, NULL, 'r' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    while ((c = getopt_long(argc, argv, "w:t:q:r", longopts, NULL)) != -1) {
+        if (c == 'w' && ((nworkers = atoi(optarg)) < 1 || nworkers > MAXWORKERS)) {
+            fprintf(stderr, "the number of workers must be between 1 and %d\n", MAXWORKERS);
+            exit(0);
+        }
+        else if (c == 't' && (kdfthreads = atoi(optarg)) < 1) {
+            fprintf(stderr, "the number of KDF threads must be positive\n");
+            exit(0);
+        }
+        else if (c == 'q' && (kdfqueue = atoi(optarg)) < 1) {
+            fprintf(stderr, "the KDF queue length must be positive\n");
+            exit(0);
+        }
+        else if (c == 'r') {
+            ratelimited = 0;
+        }
+        else if (c == '?') {
+            exit(0);
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
 
     if (argc != 3) {
-        perror("usage: AuthClient <port> <password>");
+        perror("usage: ConcAuthServer [--workers=N [--kdf-threads=N] [--kdf-queue=N]] [--no-ratelimit] "
+               "<port> <password file>");
         exit(0);
     }
 
     // open and read the password file
-    userrecord = fopen(argv[2], "r");
-    int index = 0;
-    while (fgets(buff, MAXCHAR, userrecord) != NULL) {
-        // each username and password pair is separated by a space
-        char * token = strtok(buff, " ");
-        if (token != NULL) {
-            bzero(record[index].username, sizeof(record[index].username));
-            strcpy(record[index].username, token);
-            token = strtok(NULL, " "); // scan from the end of the last token
-            bzero(record[index].password, sizeof(record[index].password));
-            strncpy(record[index].password, token, strlen(token)-1);
-        }
-        index++;
+    if ((store = credstore_load(argv[2])) == NULL) {
+        perror("cannot read the password file");
+        exit(0);
     }
+    make_decoy(store);
 
     // create a listen socket and bind it to the server's wellknown address
-    if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("listen error");
+    if ((listenfd = tcp_listen(atoi(argv[1]), NULL)) < 0) { // argv[1] = port
+        perror("error in binding");
         exit(0);
     }
 
-    bzero(&servaddr, sizeof(servaddr));
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    servaddr.sin_port = htons(atoi(argv[1])); // argv[1] = port
+    // the rate limits and the sessions are shared by the processes forked from here on
+    limiter = ratelimited ? ratelimit_create() : NULL;
+    sessions = sessions_create();
 
-    if (bind(listenfd, (struct sockaddr *) &servaddr, sizeof(servaddr)) < 0) {
-        perror("error in binding");
+    // and so are the metrics
+    succeeded = metric_counter("auth_requests_total{result=\"success\"}", "Requests answered, by result.");
+    failed = metric_counter("auth_requests_total{result=\"failure\"}", NULL);
+    throttled = metric_counter("auth_requests_total{result=\"throttled\"}", NULL);
+    refused = metric_counter("auth_requests_total{result=\"busy\"}", NULL);
+    kdftime = metric_histogram("auth_kdf_seconds", "Time from handing a hash to the KDF pool to its result.", 1e-6);
+    kdfinflight = metric_gauge("auth_kdf_inflight", "Hashes in the KDF pools.");
+    if (metrics_start() < 0) {
+        perror("metrics error");
         exit(0);
     }
 
-    if (listen(listenfd, LISTENQ) < 0)
+    if (nworkers > 0)
+        run_workers(listenfd, store, argv[2], nworkers, kdfthreads, kdfqueue);
+
+    // reap the children dispatched for the clients
+    bzero(&sa, sizeof(sa));
+    sa.sa_handler = sig_chld;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    if (sigaction(SIGCHLD, &sa, NULL) < 0) {
+        perror("sigaction error");
         exit(0);
+    }
+
+    // reload the password file when it changes or on SIGHUP
+    credwatch_start(&watcher, argv[2]);
 
     for ( ; ; ) {
+        len = sizeof(cliaddr);
         connfd = accept(listenfd, (struct sockaddr *) &cliaddr, &len);
         if (connfd < 0) {
-            perror("connection error");
+            if (errno != EINTR)
+                perror("connection error");
             continue;
         }
 
+        // swap in the password file reloaded since the last client; the
+        // children already dispatched keep their own copy of the old one
+        if ((fresh = credwatch_take(&watcher)) != NULL) {
+            credstore_free(store);
+            store = fresh;
+            make_decoy(store);
+        }
+
         // dispatch a child server process for each established client
         pid = fork();
         if (pid == 0) {
             close(listenfd);
-            n = authenticate(connfd, record);
+            addr_from(&addr, (struct sockaddr *) &cliaddr);
+            n = authenticate(connfd, store, &addr);
             close(connfd);
             exit(0);
         }
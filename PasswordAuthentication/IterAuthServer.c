@@ -1,139 +1,123 @@
 //
-// The client program to prompt the user for a username and password, which
-// are then sent to the server for authentication.
+// The iterative server program to authenticate a username and password pair
+// received from a client, using a provided file of legitimate pairs of usernames
+// and passwords. This server is iterative because it can only serve one client at
+// a time.
 //
 // Author: Tien Ho
 // Date:   9/20/16
 //
 
 #include "utils.h"
+#include "credstore.h"
+#include "passhash.h"
+#include "ratelimit.h"
+#include "protocol.h"
+#include "listener.h"
 
 int
 main(int argc, char **argv)
 {
     int                listenfd, connfd;
-    struct sockaddr_in servaddr, cliaddr;
+    struct sockaddr_storage cliaddr;
+    struct endpoint    addr;
     socklen_t          len;
-    char               buff[MAXLINE];
-    char               recvusername[MAXCHAR];
-    char               recvpasswrd[MAXCHAR];
-    char               recvline[MAXLINE];
-    userinfo           record[7];
-    FILE *             userrecord;
-    int                attempt = 0;
-    int                success = 0;
-    int                found = 0;
+    char               buff[MAXREQUEST];
+    char               line[MAXREQUEST];
+    const char         *password;
+    char               decoy[PASSHASH_MAXLEN];
+    struct linebuf     in;
+    struct request     req;
+    credstore          *store;
+    struct ratelimit   *limiter;
+    int                attempt;
+    int                ratelimited = 1;
+
+    // --no-ratelimit turns the rate limits off, e.g. for a benchmark
+    if (argc == 4 && strcmp(argv[1], "--no-ratelimit") == 0) {
+        ratelimited = 0;
+        argc--;
+        argv++;
+    }
 
     // make sure that the port number and the password file are provided when the program
     // is executed
     if (argc != 3) {
-        perror("usage: AuthClient <port> <password_file>");
+        perror("usage: IterAuthServer [--no-ratelimit] <port> <password_file>");
         exit(0);
     }
 
     // open and read the password file
-    userrecord = fopen(argv[2], "r"); // argv[2] = password file
-    int index = 0;
-    while (fgets(buff, MAXCHAR, userrecord) != NULL) {
-        // each username and password pair is separated by a space
-        char * token = strtok(buff, " ");
-        if (token != NULL) {
-            bzero(record[index].username, sizeof(record[index].username));
-            strcpy(record[index].username, token);
-            token = strtok(NULL, " "); // scan from the end of the last token
-            bzero(record[index].password, sizeof(record[index].password));
-            strncpy(record[index].password, token, strlen(token)-1);
-        }
-        index++;
+    if ((store = credstore_load(argv[2])) == NULL) { // argv[2] = password file
+        perror("cannot read the password file");
+        exit(0);
     }
 
-    // create a listen socket and bind it to the server's wellknown address
-    if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("socket error");
+    // an unknown user is verified against a decoy that never matches, so that
+    // the time of the reply does not tell whether the user exists
+    if (passhash_decoy(credstore_sample(store), decoy, sizeof(decoy)) < 0) {
+        perror("cannot make the decoy password");
         exit(0);
     }
 
-    bzero(&servaddr, sizeof(servaddr));
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    servaddr.sin_port = htons(atoi(argv[1])); // argv[1] = port
+    limiter = ratelimited ? ratelimit_create() : NULL;
 
-    if (bind(listenfd, (struct sockaddr *) &servaddr, sizeof(servaddr)) < 0) {
+    // create a listen socket and bind it to the server's wellknown address
+    if ((listenfd = tcp_listen(atoi(argv[1]), NULL)) < 0) { // argv[1] = port
         perror("error in binding");
         exit(0);
     }
 
-    if (listen(listenfd, LISTENQ) < 0)
-        exit(0);
-
     for ( ; ; ) {
+        len = sizeof(cliaddr);
         connfd = accept(listenfd, (struct sockaddr *) &cliaddr, &len);
         if (connfd < 0) {
             perror("connection error");
             continue;
         }
+        addr_from(&addr, (struct sockaddr *) &cliaddr);
 
-        // only perform authentication if the client has not succeeded
-        // and has not exceeded the allowed number of authentication attempts
-        while (attempt != 3 && success != 1) {
-            bzero(recvline, sizeof(recvline));
-            if (read(connfd, recvline, MAXLINE) < 0) {
-                perror("read error");
-                exit(0);
-            }
-
-            // the username and password pair sent from the client
-            // is assumed to be separated by a space
-            char * token = strtok(recvline, " ");
-            if (token != NULL) {
-                bzero(recvusername, sizeof(recvusername));
-                strcpy(recvusername, token);
-                token = strtok(NULL, " "); // scan from the end of the last token
-                bzero(recvpasswrd, sizeof(recvpasswrd));
-                strcpy(recvpasswrd, token);
-            }
-
-            // check the record to find any matching for the client's provided username and password
-            size_t n = sizeof(record) / sizeof(record[0]);
-            size_t i;
-            for (i = 0; i < n; i++) {
-                if (strcmp(record[i].username, recvusername) == 0) {
-                    found = 1;
-                    if (strcmp(record[i].password, recvpasswrd) == 0) {
-                        strcpy(buff, "success");
-                        success = 1;
-                        break;
-                    }
-                    else {
-                        strcpy(buff, "failure");
-                        attempt++;
-                        break;
-                    }
+        // answer the requests of the client in order until it leaves or
+        // fails too many times in a row
+        bzero(&in, sizeof(in));
+        attempt = 0;
+        while (attempt != MAXATTEMPT && linebuf_fill(connfd, &in) > 0) {
+            while (attempt != MAXATTEMPT && linebuf_next(&in, line)) {
+                if (parse_request(line, &req) < 0) {
+                    snprintf(buff, sizeof(buff), "0 error malformed request\n");
+                    attempt = MAXATTEMPT;
+                }
+                else if (strcmp(req.verb, "auth") != 0 || req.arg2 == NULL) {
+                    snprintf(buff, sizeof(buff), "%s error unknown request\n", req.id);
+                }
+                // a client over its limits is turned away without looking at its password
+                else if (!ratelimit_check(limiter, &addr, req.arg1)) {
+                    snprintf(buff, sizeof(buff), "%s throttled\n", req.id);
+                }
+                // check the record to find any matching for the client's provided username and password
+                else if (passhash_verify((password = credstore_lookup(store, req.arg1)) != NULL ? password : decoy,
+                                         req.arg2)) {
+                    snprintf(buff, sizeof(buff), "%s success\n", req.id);
+                    attempt = 0;
+                }
+                // send the final failure message to the client
+                // to indicate that the server no longer allows any
+                // additional authentication attempts
+                else if (++attempt == MAXATTEMPT) {
+                    snprintf(buff, sizeof(buff), "%s final failure\n", req.id);
+                }
+                else {
+                    snprintf(buff, sizeof(buff), "%s failure\n", req.id);
                 }
-            }
-
-            if (found == 0) {
-                strcpy(buff, "failure");
-                attempt++;
-            }
-
-            // send the final failure message to the client
-            // to indicate that the server no longer allows any
-            // additional authentication attempts
-            if (attempt == 3) {
-                strcpy(buff, "final failure");
-            }
 
-            if (write(connfd, buff, strlen(buff)) < 0) {
-                perror("write error");
-                exit(0);
+                if (write(connfd, buff, strlen(buff)) < 0) {
+                    perror("write error");
+                    attempt = MAXATTEMPT;
+                }
             }
         }
 
-        // closes the client socket after 3 failed attempts or a success
+        // closes the client socket after 3 failed attempts in a row or when the client leaves
         close(connfd);
-        success = 0;
-        attempt = 0;
-        found = 0;
     }
 }
@@ -0,0 +1,295 @@
+//
+// The benchmark mode of the authentication client. Each connection is served
+// by its own thread, which keeps up to depth requests in flight and matches
+// the replies by their ids, so the same code measures the servers that
+// answer in order and the worker mode that does not. A connection closed by
+// the server, e.g. after three failures in a row, is opened again.
+//
+// Author: Tien Ho
+// Date:   12/17/16
+//
+
+#include "authbench.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+
+// the results counted, by the reply of the server
+#define R_SUCCESS     0
+#define R_FAILURE     1
+#define R_FINAL       2     /* final failure */
+#define R_THROTTLED   3
+#define R_BUSY        4
+#define R_ERROR       5     /* error reply or reply not understood */
+#define R_DROPPED     6     /* no reply before the connection closed */
+#define NRESULTS      7
+
+static const char *resultnames[NRESULTS] = {
+    "success", "failure", "final failure", "throttled", "busy", "error", "dropped"
+};
+
+struct credential {
+    char username[MAXCHAR];
+    char password[MAXCHAR];
+};
+
+struct inflight {
+    int    id;
+    int    good;                /* sent with the right password */
+    double sent;                /* in ms */
+};
+
+struct benchthread {
+    pthread_t  tid;
+    long       counts[NRESULTS];
+    long       wrong;           /* a good password failed or a bad one succeeded */
+    long       reconnects;
+    double     *latencies;      /* in ms, of the requests answered */
+    long       nlatencies;
+    long       caplatencies;
+};
+
+static const struct benchopts *opts;
+static struct credential      *creds;
+static int                    ncreds;
+static long                   remaining;    /* requests not sent yet */
+
+static double
+now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static int
+compare_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+// Read the username and password pairs of a password file.
+static void
+load_credentials(const char *path)
+{
+    char buff[MAXLINE];
+    char *username, *password, *saveptr;
+    FILE *file;
+    int  cap = 0;
+
+    if ((file = fopen(path, "r")) == NULL) {
+        perror("cannot read the credential file");
+        exit(0);
+    }
+
+    while (fgets(buff, sizeof(buff), file) != NULL) {
+        // each username and password pair is separated by a space
+        if ((username = strtok_r(buff, " \t\r\n", &saveptr)) == NULL)
+            continue;
+        if ((password = strtok_r(NULL, " \t\r\n", &saveptr)) == NULL)
+            continue;
+        if (strlen(username) >= MAXCHAR || strlen(password) >= MAXCHAR - 1)
+            continue;
+
+        if (ncreds == cap) {
+            cap = cap ? cap * 2 : 64;
+            if ((creds = realloc(creds, cap * sizeof(struct credential))) == NULL) {
+                perror("benchmark allocation error");
+                exit(0);
+            }
+        }
+        strcpy(creds[ncreds].username, username);
+        strcpy(creds[ncreds].password, password);
+        ncreds++;
+    }
+    fclose(file);
+
+    if (ncreds == 0) {
+        fprintf(stderr, "no credentials in %s\n", path);
+        exit(0);
+    }
+}
+
+static int
+open_connection(void)
+{
+    int sockfd;
+
+    if ((sockfd = socket(opts->servaddr.ss_family, SOCK_STREAM, 0)) < 0) {
+        perror("socket error");
+        exit(0);
+    }
+    if (connect(sockfd, (const struct sockaddr *) &opts->servaddr, opts->servlen) < 0) {
+        perror("connect error");
+        exit(0);
+    }
+
+    return sockfd;
+}
+
+static void
+record(struct benchthread *t, const struct inflight *req, const char *reply)
+{
+    int result;
+
+    if (strncmp(reply, "success", 7) == 0)
+        result = R_SUCCESS;
+    else if (strcmp(reply, "failure") == 0)
+        result = R_FAILURE;
+    else if (strcmp(reply, "final failure") == 0)
+        result = R_FINAL;
+    else if (strcmp(reply, "throttled") == 0)
+        result = R_THROTTLED;
+    else if (strcmp(reply, "busy") == 0)
+        result = R_BUSY;
+    else
+        result = R_ERROR;
+
+    t->counts[result]++;
+    if ((result == R_SUCCESS && !req->good) || ((result == R_FAILURE || result == R_FINAL) && req->good))
+        t->wrong++;
+
+    if (t->nlatencies == t->caplatencies) {
+        t->caplatencies = t->caplatencies ? t->caplatencies * 2 : 1024;
+        if ((t->latencies = realloc(t->latencies, t->caplatencies * sizeof(double))) == NULL) {
+            perror("benchmark allocation error");
+            exit(0);
+        }
+    }
+    t->latencies[t->nlatencies++] = now_ms() - req->sent;
+}
+
+static void *
+bench_thread(void *arg)
+{
+    struct benchthread *t = arg;
+    struct inflight    window[BENCH_MAXDEPTH];
+    struct linebuf     in;
+    char               buff[MAXREQUEST];
+    char               line[MAXREQUEST];
+    unsigned int       seed = (unsigned int) (uintptr_t) t ^ (unsigned int) time(NULL);
+    int                sockfd, nflight = 0, nextid = 1, id, skip, i, c;
+    ssize_t            n;
+
+    sockfd = open_connection();
+    bzero(&in, sizeof(in));
+
+    for ( ; ; ) {
+        // fill the window with new requests while there are some to send
+        while (nflight < opts->depth && __atomic_sub_fetch(&remaining, 1, __ATOMIC_RELAXED) >= 0) {
+            c = rand_r(&seed) % ncreds;
+            window[nflight].id = nextid++;
+            window[nflight].good = rand_r(&seed) < opts->goodratio * ((double) RAND_MAX + 1);
+            snprintf(buff, sizeof(buff), "%d auth %s %s%s\n", window[nflight].id, creds[c].username,
+                     creds[c].password, window[nflight].good ? "" : "x");
+            window[nflight].sent = now_ms();
+            nflight++;
+            if (write(sockfd, buff, strlen(buff)) < 0)
+                break;
+        }
+        if (nflight == 0)
+            break;
+
+        // the server closed the connection: what was in flight is lost
+        if ((n = linebuf_fill(sockfd, &in)) <= 0) {
+            t->counts[R_DROPPED] += nflight;
+            nflight = 0;
+            close(sockfd);
+            sockfd = open_connection();
+            bzero(&in, sizeof(in));
+            t->reconnects++;
+            continue;
+        }
+
+        while (linebuf_next(&in, line)) {
+            skip = 0;
+            if (sscanf(line, "%d %n", &id, &skip) != 1 || skip == 0)
+                continue;
+            for (i = 0; i < nflight && window[i].id != id; i++)
+                ;
+            if (i == nflight)
+                continue;
+            record(t, &window[i], line + skip);
+            window[i] = window[--nflight];
+        }
+    }
+
+    close(sockfd);
+    return NULL;
+}
+
+// Run the benchmark and print its report. Returns 0.
+int
+run_benchmark(const struct benchopts *o)
+{
+    struct benchthread *threads;
+    long               counts[NRESULTS] = { 0 };
+    long               wrong = 0, reconnects = 0, nlat = 0, total = 0;
+    double             *lat, start, elapsed;
+    int                i, r;
+
+    opts = o;
+    load_credentials(opts->credfile);
+    signal(SIGPIPE, SIG_IGN); // a closed connection is noticed by read()
+    remaining = opts->nrequests;
+
+    if ((threads = calloc(opts->nconns, sizeof(struct benchthread))) == NULL) {
+        perror("benchmark allocation error");
+        exit(0);
+    }
+
+    start = now_ms();
+    for (i = 0; i < opts->nconns; i++) {
+        if (pthread_create(&threads[i].tid, NULL, bench_thread, &threads[i]) != 0) {
+            perror("benchmark thread error");
+            exit(0);
+        }
+    }
+    for (i = 0; i < opts->nconns; i++)
+        pthread_join(threads[i].tid, NULL);
+    elapsed = (now_ms() - start) / 1000.0;
+
+    for (i = 0; i < opts->nconns; i++) {
+        for (r = 0; r < NRESULTS; r++)
+            counts[r] += threads[i].counts[r];
+        wrong += threads[i].wrong;
+        reconnects += threads[i].reconnects;
+        nlat += threads[i].nlatencies;
+    }
+
+    // gather the latencies of all the connections to take their percentiles
+    if ((lat = malloc((nlat + 1) * sizeof(double))) == NULL) {
+        perror("benchmark allocation error");
+        exit(0);
+    }
+    for (i = 0, nlat = 0; i < opts->nconns; i++) {
+        memcpy(lat + nlat, threads[i].latencies, threads[i].nlatencies * sizeof(double));
+        nlat += threads[i].nlatencies;
+        free(threads[i].latencies);
+    }
+    qsort(lat, nlat, sizeof(double), compare_double);
+
+    for (r = 0; r < NRESULTS; r++)
+        total += counts[r];
+    printf("%ld requests over %d connections (depth %d, %.0f%% good) in %.2f s\n",
+           total, opts->nconns, opts->depth, opts->goodratio * 100, elapsed);
+    printf("throughput: %.1f replies/s, %.1f logins/s\n", nlat / elapsed, counts[R_SUCCESS] / elapsed);
+    for (r = 0; r < NRESULTS; r++) {
+        if (counts[r] > 0)
+            printf("%-14s %8ld  %5.1f%%\n", resultnames[r], counts[r], 100.0 * counts[r] / total);
+    }
+    printf("wrong results: %ld, reconnections: %ld\n", wrong, reconnects);
+    if (nlat > 0) {
+        printf("latency (ms): p50 %.3f  p90 %.3f  p99 %.3f  p99.9 %.3f  max %.3f\n",
+               lat[(long) (nlat * 0.50)], lat[(long) (nlat * 0.90)], lat[(long) (nlat * 0.99)],
+               lat[(long) (nlat * 0.999)], lat[nlat - 1]);
+    }
+
+    free(lat);
+    free(threads);
+    return 0;
+}
@@ -0,0 +1,31 @@
+//
+// The header file for the benchmark mode of the authentication client. The
+// benchmark replays the username and password pairs of a password file, some
+// of them with a wrong password, over several connections at once, and
+// reports the throughput, the results and the latencies of the server.
+//
+// Author: Tien Ho
+// Date: 12/17/16.
+//
+
+#ifndef AUTHBENCH_H
+#define AUTHBENCH_H
+
+#include "utils.h"
+#include "protocol.h"
+
+#define BENCH_MAXDEPTH    64    /* most requests in flight per connection */
+
+struct benchopts {
+    const char              *credfile;  /* password file with plaintext passwords */
+    struct sockaddr_storage servaddr;   /* IPv4 or IPv6 */
+    socklen_t               servlen;
+    int                     nconns;     /* connections used at once */
+    long                    nrequests;  /* requests sent in all */
+    double                  goodratio;  /* share of requests with the right password */
+    int                     depth;      /* requests in flight per connection */
+};
+
+int run_benchmark(const struct benchopts *opts);
+
+#endif //AUTHBENCH_H
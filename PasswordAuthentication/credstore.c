@@ -0,0 +1,383 @@
+//
+// The credential store shared by the authentication servers. The password
+// file is read in one piece, the table is sized from its number of lines, and
+// every "username password" line becomes one record in the arena and one slot
+// in the table. Collisions are resolved by linear probing; since the table is
+// kept at most half full, a probe sequence stays short.
+//
+// A database compiled by mkuserdb holds the same table and arena and is mapped
+// read-only instead of parsed: loading it costs a few system calls whatever its
+// size, and the forked servers share its pages.
+//
+// Author: Tien Ho
+// Date:   12/10/16
+//
+
+#include "credstore.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// 32-bit FNV-1a hash of a username
+static uint32_t
+hash_username(const char *username)
+{
+    uint32_t h = 2166136261u;
+
+    while (*username)
+        h = (h ^ (unsigned char) *username++) * 16777619u;
+
+    return h;
+}
+
+// The block and the bits of a username in the Bloom filter: the block is
+// picked by the hash of the username, and the bits by the hash mixed again
+// (by the constants of splitmix64), 9 bits for each bit of the block.
+static uint64_t
+bloom_mix(uint32_t hash, uint32_t *block, const credstore *store)
+{
+    uint64_t x = hash * 0x9e3779b97f4a7c15ULL;
+
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    *block = hash & (store->bloomblocks - 1);
+
+    return x;
+}
+
+static void
+bloom_add(credstore *store, uint32_t hash)
+{
+    uint64_t *words;
+    uint64_t bits;
+    uint32_t block;
+    int      i, bit;
+
+    bits = bloom_mix(hash, &block, store);
+    words = store->bloom + (size_t) block * BLOOM_WORDS;
+    for (i = 0; i < BLOOM_PROBES; i++) {
+        bit = (bits >> (9 * i)) & (BLOOM_WORDS * 64 - 1);
+        words[bit / 64] |= 1ULL << (bit % 64);
+    }
+}
+
+// Returns 0 if the username is certainly unknown.
+static int
+bloom_test(const credstore *store, uint32_t hash)
+{
+    const uint64_t *words;
+    uint64_t       bits;
+    uint32_t       block;
+    int            i, bit;
+
+    bits = bloom_mix(hash, &block, store);
+    words = store->bloom + (size_t) block * BLOOM_WORDS;
+    for (i = 0; i < BLOOM_PROBES; i++) {
+        bit = (bits >> (9 * i)) & (BLOOM_WORDS * 64 - 1);
+        if ((words[bit / 64] & (1ULL << (bit % 64))) == 0)
+            return 0;
+    }
+
+    return 1;
+}
+
+// Find the slot of a username: either the slot holding it or the empty slot
+// where it would be inserted.
+static struct credslot *
+find_slot(const credstore *store, const char *username, uint32_t hash)
+{
+    struct credslot *slot;
+    uint32_t        i;
+
+    for (i = hash & (store->nslots - 1); ; i = (i + 1) & (store->nslots - 1)) {
+        slot = &store->slots[i];
+        if (slot->offset == 0)
+            return slot;
+        if (slot->hash == hash && strcmp(store->arena + slot->offset, username) == 0)
+            return slot;
+    }
+}
+
+// read a whole file into a NUL-terminated buffer
+static char *
+read_file(const char *path, long *len)
+{
+    FILE *file;
+    char *data;
+
+    if ((file = fopen(path, "r")) == NULL)
+        return NULL;
+
+    fseek(file, 0, SEEK_END);
+    *len = ftell(file);
+    rewind(file);
+    if (*len < 0 || (data = malloc(*len + 1)) == NULL) {
+        fclose(file);
+        return NULL;
+    }
+    *len = fread(data, 1, *len, file);
+    data[*len] = '\0';
+    fclose(file);
+
+    return data;
+}
+
+// Whether a record lies within the arena: its username ends before the last
+// byte, so that its password starts in the arena, and the arena ends with a
+// NUL, which ends the password at the latest.
+static int
+record_ok(const char *arena, uint32_t arenalen, uint32_t offset)
+{
+    return offset < arenalen && memchr(arena + offset, '\0', arenalen - 1 - offset) != NULL;
+}
+
+// Check the table and the arena of a database once, so that a lookup never
+// reads outside the mapping nor probes a table without an empty slot.
+static int
+check_records(const struct credslot *slots, uint32_t nslots, const char *arena, uint32_t arenalen, uint32_t nusers)
+{
+    uint32_t i, nempty = 0;
+
+    if (arena[arenalen - 1] != '\0' || (nusers > 0 && !record_ok(arena, arenalen, 1)))
+        return 0;
+
+    for (i = 0; i < nslots; i++) {
+        if (slots[i].offset == 0)
+            nempty++;
+        else if (!record_ok(arena, arenalen, slots[i].offset))
+            return 0;
+    }
+
+    return nempty > 0;
+}
+
+// Map a compiled database. Returns NULL if the file is not a valid database.
+static credstore *
+map_database(int fd, size_t len)
+{
+    credstore      *store;
+    struct credhdr *hdr;
+    void           *map;
+    size_t         need, bloomoff;
+
+    if (len < sizeof(*hdr)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if ((map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+        return NULL;
+
+    hdr = map;
+    need = sizeof(*hdr) + (size_t) hdr->nslots * sizeof(struct credslot) + hdr->arenalen;
+    bloomoff = (need + 7) & ~(size_t) 7;
+    if (hdr->bloomblocks > 0)
+        need = bloomoff + (size_t) hdr->bloomblocks * BLOOM_WORDS * sizeof(uint64_t);
+    if (hdr->nslots == 0 || (hdr->nslots & (hdr->nslots - 1)) != 0 || hdr->nusers >= hdr->nslots ||
+        hdr->arenalen == 0 || (hdr->bloomblocks & (hdr->bloomblocks - 1)) != 0 || need > len ||
+        !check_records((struct credslot *) (hdr + 1), hdr->nslots,
+                       (char *) ((struct credslot *) (hdr + 1) + hdr->nslots), hdr->arenalen, hdr->nusers) ||
+        (store = calloc(1, sizeof(credstore))) == NULL) {
+        munmap(map, len);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    store->map = map;
+    store->maplen = len;
+    store->nslots = hdr->nslots;
+    store->nusers = hdr->nusers;
+    store->arenalen = hdr->arenalen;
+    store->slots = (struct credslot *) (hdr + 1);
+    store->arena = (char *) (store->slots + store->nslots);
+    store->bloomblocks = hdr->bloomblocks;
+    store->bloom = hdr->bloomblocks > 0 ? (uint64_t *) ((char *) map + bloomoff) : NULL;
+
+    return store;
+}
+
+// Parse a password file with one "username password" pair per line. Lines
+// that do not have both fields are skipped, and the first line of a username
+// wins.
+static credstore *
+parse_text(const char *path)
+{
+    credstore       *store;
+    struct credslot *slot;
+    char            *data, *line, *next, *username, *password, *saveptr;
+    long            len, nlines = 1;
+    uint32_t        hash;
+    size_t          ulen, plen;
+    char            *p;
+
+    if ((data = read_file(path, &len)) == NULL)
+        return NULL;
+
+    for (p = data; *p; p++) {
+        if (*p == '\n')
+            nlines++;
+    }
+
+    if ((store = calloc(1, sizeof(credstore))) == NULL) {
+        free(data);
+        return NULL;
+    }
+    store->nslots = 16;
+    while (store->nslots < 2 * nlines)
+        store->nslots *= 2;
+    store->slots = calloc(store->nslots, sizeof(struct credslot));
+    // a record never takes more room than its line
+    store->arena = malloc(len + 2);
+    store->bloomblocks = 1;
+    while ((uint64_t) store->bloomblocks * BLOOM_WORDS * 64 < (uint64_t) nlines * BLOOM_BITS)
+        store->bloomblocks *= 2;
+    store->bloom = calloc((size_t) store->bloomblocks * BLOOM_WORDS, sizeof(uint64_t));
+    if (store->slots == NULL || store->arena == NULL || store->bloom == NULL) {
+        free(data);
+        credstore_free(store);
+        return NULL;
+    }
+    store->arena[0] = '\0';
+    store->arenalen = 1;
+
+    for (line = data; line != NULL; line = next) {
+        if ((next = strchr(line, '\n')) != NULL)
+            *next++ = '\0';
+
+        // each username and password pair is separated by a space
+        if ((username = strtok_r(line, " \t\r", &saveptr)) == NULL)
+            continue;
+        if ((password = strtok_r(NULL, " \t\r", &saveptr)) == NULL)
+            continue;
+
+        hash = hash_username(username);
+        slot = find_slot(store, username, hash);
+        if (slot->offset != 0)
+            continue;
+
+        ulen = strlen(username) + 1;
+        plen = strlen(password) + 1;
+        slot->hash = hash;
+        slot->offset = store->arenalen;
+        memcpy(store->arena + store->arenalen, username, ulen);
+        memcpy(store->arena + store->arenalen + ulen, password, plen);
+        store->arenalen += ulen + plen;
+        store->nusers++;
+        bloom_add(store, hash);
+    }
+
+    free(data);
+    return store;
+}
+
+// Load a compiled database or a password file, whichever the file is.
+// Returns NULL if the file cannot be read.
+credstore *
+credstore_load(const char *path)
+{
+    struct credhdr hdr;
+    struct stat    st;
+    credstore      *store;
+    int            fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return NULL;
+
+    bzero(&hdr, sizeof(hdr));
+    if (fstat(fd, &st) < 0 || read(fd, &hdr, sizeof(hdr)) < 0)
+        store = NULL;
+    else if (memcmp(hdr.magic, CREDDB_MAGIC, sizeof(hdr.magic)) == 0)
+        store = map_database(fd, st.st_size);
+    else
+        store = parse_text(path);
+
+    close(fd);
+    return store;
+}
+
+// Write a store as a compiled database. The database is written next to its
+// final name and renamed over it, so that a server loading it never sees a
+// partial file. Returns -1 on error.
+int
+credstore_save(const credstore *store, const char *path)
+{
+    struct credhdr hdr;
+    char           tmppath[PATH_MAX];
+    char           pad[8] = { 0 };
+    size_t         npad, nwords;
+    FILE           *file;
+    int            ok;
+
+    snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+    if ((file = fopen(tmppath, "w")) == NULL)
+        return -1;
+
+    bzero(&hdr, sizeof(hdr));
+    memcpy(hdr.magic, CREDDB_MAGIC, sizeof(hdr.magic));
+    hdr.nslots = store->nslots;
+    hdr.nusers = store->nusers;
+    hdr.arenalen = store->arenalen;
+    hdr.bloomblocks = store->bloomblocks;
+    npad = -(sizeof(hdr) + store->nslots * sizeof(struct credslot) + store->arenalen) & 7;
+    nwords = (size_t) store->bloomblocks * BLOOM_WORDS;
+
+    ok = fwrite(&hdr, sizeof(hdr), 1, file) == 1 &&
+         fwrite(store->slots, sizeof(struct credslot), store->nslots, file) == store->nslots &&
+         fwrite(store->arena, 1, store->arenalen, file) == store->arenalen &&
+         fwrite(pad, 1, npad, file) == npad &&
+         fwrite(store->bloom, sizeof(uint64_t), nwords, file) == nwords;
+    if (fclose(file) != 0 || !ok || rename(tmppath, path) < 0) {
+        unlink(tmppath);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Returns the password of a user, or NULL if the user is unknown. Most
+// unknown users are turned away by the Bloom filter without a probe.
+const char *
+credstore_lookup(const credstore *store, const char *username)
+{
+    struct credslot *slot;
+    uint32_t        hash = hash_username(username);
+
+    if (store->bloomblocks > 0 && !bloom_test(store, hash))
+        return NULL;
+
+    slot = find_slot(store, username, hash);
+    if (slot->offset == 0)
+        return NULL;
+
+    return store->arena + slot->offset + strlen(store->arena + slot->offset) + 1;
+}
+
+// Returns the password of one of the users, or NULL if the store is empty.
+const char *
+credstore_sample(const credstore *store)
+{
+    // the first record follows the reserved byte
+    if (store->nusers == 0)
+        return NULL;
+
+    return store->arena + 1 + strlen(store->arena + 1) + 1;
+}
+
+void
+credstore_free(credstore *store)
+{
+    if (store == NULL)
+        return;
+
+    if (store->map != NULL) {
+        munmap(store->map, store->maplen);
+    }
+    else {
+        free(store->slots);
+        free(store->arena);
+        free(store->bloom);
+    }
+    free(store);
+}
@@ -0,0 +1,69 @@
+//
+// The header file for the credential store shared by the authentication
+// servers. The store is an open-addressing hash table of usernames whose
+// records live in one arena of strings, so that a lookup costs one hash and
+// usually one probe however many users the password file holds.
+//
+// Author: Tien Ho
+// Date: 12/10/16.
+//
+
+#ifndef CREDSTORE_H
+#define CREDSTORE_H
+
+#include "utils.h"
+#include <stdint.h>
+#include <sys/types.h>
+
+// A slot of the hash table. The offset locates the record of the user in the
+// arena, "username\0password\0"; offset 0 marks an empty slot since the arena
+// starts with a reserved byte.
+struct credslot {
+    uint32_t hash;
+    uint32_t offset;
+};
+
+struct credstore {
+    struct credslot *slots;
+    uint32_t        nslots;     /* a power of two, at least twice nusers */
+    uint32_t        nusers;
+    char            *arena;
+    uint32_t        arenalen;
+    uint64_t        *bloom;     /* bloomblocks blocks of BLOOM_WORDS words */
+    uint32_t        bloomblocks; /* a power of two, 0 if there is no filter */
+    void            *map;       /* the mapped database file, or NULL */
+    size_t          maplen;
+};
+
+// The Bloom filter of the usernames. A username sets BLOOM_PROBES bits of
+// one block, and a block is one cache line, so that rejecting an unknown
+// username costs one hash and one cache miss and never touches the table.
+#define BLOOM_WORDS     8       /* 64-bit words per block */
+#define BLOOM_PROBES    7       /* bits set per username */
+#define BLOOM_BITS     10       /* bits per user */
+
+typedef struct credstore credstore;
+
+// The compiled user database written by mkuserdb: the header, the nslots
+// slots of the table, the arenalen bytes of the arena, padded to 8 bytes,
+// and the bloomblocks blocks of the Bloom filter, one after the other, so that
+// the file is used as it is once mapped into memory. A database written
+// before the filter existed has no blocks. The numbers are in the byte order
+// of the host that wrote the file.
+#define CREDDB_MAGIC   "CREDDB1"
+
+struct credhdr {
+    char     magic[8];
+    uint32_t nslots;
+    uint32_t nusers;
+    uint32_t arenalen;
+    uint32_t bloomblocks;
+};
+
+credstore  *credstore_load(const char *path);
+int        credstore_save(const credstore *store, const char *path);
+const char *credstore_lookup(const credstore *store, const char *username);
+const char *credstore_sample(const credstore *store);
+void       credstore_free(credstore *store);
+
+#endif //CREDSTORE_H
@@ -0,0 +1,100 @@
+//
+// The watcher that reloads the credential store while a server runs. The new
+// store is built by the watcher thread, away from the accept loop, and is
+// published with one atomic exchange of a pointer: the main thread takes it
+// the next time it looks, and frees the old store it no longer reads. The
+// children forked before the swap keep the store they were forked with.
+//
+// Author: Tien Ho
+// Date:   12/12/16
+//
+
+#include "credwatch.h"
+#include <signal.h>
+#include <time.h>
+
+// Whether the file was replaced or modified since the last load. mkuserdb
+// renames a new database over the old one, which changes the inode.
+static int
+file_changed(const struct stat *a, const struct stat *b)
+{
+    return a->st_ino != b->st_ino || a->st_dev != b->st_dev || a->st_size != b->st_size ||
+           a->st_mtim.tv_sec != b->st_mtim.tv_sec || a->st_mtim.tv_nsec != b->st_mtim.tv_nsec;
+}
+
+static void *
+watch(void *arg)
+{
+    struct credwatch *w = arg;
+    struct timespec  interval;
+    struct stat      st;
+    sigset_t         set;
+    credstore        *store;
+    int              sig;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+
+    for ( ; ; ) {
+        interval.tv_sec = RELOAD_INTERVAL;
+        interval.tv_nsec = 0;
+        sig = sigtimedwait(&set, NULL, &interval);
+
+        if (stat(w->path, &st) < 0) {
+            if (sig == SIGHUP)
+                perror("cannot reload the password file");
+            continue;
+        }
+        if (sig != SIGHUP && !file_changed(&st, &w->st))
+            continue;
+
+        if ((store = credstore_load(w->path)) == NULL) {
+            perror("cannot reload the password file");
+            continue;
+        }
+        w->st = st;
+
+        // a store that was never taken is replaced by the newer one
+        credstore_free(__atomic_exchange_n(&w->pending, store, __ATOMIC_ACQ_REL));
+        printf("reloaded %s: %u users\n", w->path, store->nusers);
+        fflush(stdout);
+    }
+
+    return NULL;
+}
+
+// Start watching a password file. SIGHUP is blocked in the calling thread and
+// in the threads it creates later, so that only the watcher receives it.
+void
+credwatch_start(struct credwatch *w, const char *path)
+{
+    sigset_t set;
+
+    bzero(w, sizeof(*w));
+    w->path = path;
+    if (stat(path, &w->st) < 0) {
+        perror("cannot watch the password file");
+        exit(0);
+    }
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    if ((errno = pthread_create(&w->tid, NULL, watch, w)) != 0) {
+        perror("cannot start the watcher thread");
+        exit(0);
+    }
+    pthread_detach(w->tid);
+}
+
+// Returns the store loaded since the last call, or NULL if the file has not
+// changed. The caller owns the returned store.
+credstore *
+credwatch_take(struct credwatch *w)
+{
+    if (__atomic_load_n(&w->pending, __ATOMIC_RELAXED) == NULL)
+        return NULL;
+
+    return __atomic_exchange_n(&w->pending, NULL, __ATOMIC_ACQ_REL);
+}
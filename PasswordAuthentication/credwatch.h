@@ -0,0 +1,30 @@
+//
+// The header file for the watcher that reloads the credential store while a
+// server runs. A thread of the server loads the password file again when the
+// file changes or the server receives SIGHUP, and hands the new store over to
+// the main thread, which swaps it in between two clients.
+//
+// Author: Tien Ho
+// Date: 12/12/16.
+//
+
+#ifndef CREDWATCH_H
+#define CREDWATCH_H
+
+#include "credstore.h"
+#include <sys/stat.h>
+#include <pthread.h>
+
+#define RELOAD_INTERVAL 2       /* seconds between two checks of the file */
+
+struct credwatch {
+    const char  *path;
+    struct stat st;             /* the file as it was at the last load */
+    credstore   *pending;       /* loaded but not taken yet, or NULL */
+    pthread_t   tid;
+};
+
+void      credwatch_start(struct credwatch *w, const char *path);
+credstore *credwatch_take(struct credwatch *w);
+
+#endif //CREDWATCH_H
@@ -0,0 +1,67 @@
+//
+// The offline tool to replace the plaintext passwords of a password file with
+// salted PBKDF2 hashes. The entries that are already hashed are kept as they
+// are, so the tool can be run again after adding users.
+//
+// Author: Tien Ho
+// Date:   12/13/16
+//
+
+#include "utils.h"
+#include "passhash.h"
+
+int
+main(int argc, char **argv)
+{
+    char         buff[MAXLINE];
+    char         hash[PASSHASH_MAXLEN];
+    char         *username, *password, *saveptr;
+    unsigned int iterations = PASSHASH_ITER;
+    FILE         *in, *out;
+    int          nhashed = 0;
+
+    if (argc != 3 && argc != 4) {
+        perror("usage: hashpasswd <password file> <hashed password file> [iterations]");
+        exit(0);
+    }
+    if (argc == 4 && (iterations = strtoul(argv[3], NULL, 10)) == 0) {
+        perror("the number of iterations must be positive");
+        exit(0);
+    }
+
+    if ((in = fopen(argv[1], "r")) == NULL) { // argv[1] = password file
+        perror("cannot read the password file");
+        exit(0);
+    }
+    if ((out = fopen(argv[2], "w")) == NULL) { // argv[2] = hashed password file
+        perror("cannot write the hashed password file");
+        exit(0);
+    }
+
+    while (fgets(buff, sizeof(buff), in) != NULL) {
+        // each username and password pair is separated by a space
+        if ((username = strtok_r(buff, " \t\r\n", &saveptr)) == NULL)
+            continue;
+        if ((password = strtok_r(NULL, " \t\r\n", &saveptr)) == NULL)
+            continue;
+
+        if (!passhash_is_hashed(password)) {
+            if (passhash_make(password, iterations, hash, sizeof(hash)) < 0) {
+                perror("cannot hash a password");
+                exit(0);
+            }
+            password = hash;
+            nhashed++;
+        }
+        fprintf(out, "%s %s\n", username, password);
+    }
+
+    fclose(in);
+    if (fclose(out) != 0) {
+        perror("cannot write the hashed password file");
+        exit(0);
+    }
+    printf("%d passwords hashed\n", nhashed);
+
+    return 0;
+}
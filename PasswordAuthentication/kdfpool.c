@@ -0,0 +1,166 @@
+//
+// The KDF pool of the concurrent server. Requests are copied into a ring of
+// maxqueue jobs, taken by the pool threads in order, and their results are
+// queued for the worker thread, which is woken up by a byte written to a pipe.
+// The jobs hold copies of the stored hash and the password, so that the store
+// can be swapped by a reload while a verification is in progress.
+//
+// Author: Tien Ho
+// Date:   12/13/16
+//
+
+#include "kdfpool.h"
+#include <fcntl.h>
+#include <pthread.h>
+
+struct kdfjob {
+    int  tag;
+    char stored[PASSHASH_MAXLEN];
+    char password[KDF_MAXPASS];
+};
+
+static struct kdfjob    *jobs;          /* ring of maxqueue jobs */
+static int              maxjobs, jobhead, njobs;
+static struct kdfresult *done;          /* completions not yet polled */
+static int              ndone, capdone;
+static struct kdfstats  stats;
+static int              notifyfd[2];
+static pthread_mutex_t  lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   jobready = PTHREAD_COND_INITIALIZER;
+
+static void *
+kdf_thread(void *arg)
+{
+    struct kdfjob job;
+    int           ok;
+
+    for ( ; ; ) {
+        pthread_mutex_lock(&lock);
+        while (njobs == 0)
+            pthread_cond_wait(&jobready, &lock);
+        job = jobs[jobhead];
+        jobhead = (jobhead + 1) % maxjobs;
+        njobs--;
+        pthread_mutex_unlock(&lock);
+
+        ok = passhash_verify(job.stored, job.password);
+        bzero(job.password, sizeof(job.password));
+
+        pthread_mutex_lock(&lock);
+        if (ndone == capdone) {
+            capdone = capdone ? capdone * 2 : 64;
+            if ((done = realloc(done, capdone * sizeof(struct kdfresult))) == NULL) {
+                perror("kdf pool allocation error");
+                exit(0);
+            }
+        }
+        done[ndone].tag = job.tag;
+        done[ndone].ok = ok;
+        ndone++;
+        stats.depth--;
+        stats.completed++;
+        pthread_mutex_unlock(&lock);
+
+        // wake up select() in the worker; the pipe is nonblocking and one
+        // pending byte is enough to get the queue drained
+        write(notifyfd[1], "k", 1);
+    }
+
+    return NULL;
+}
+
+// Start the pool threads. Returns the descriptor to select() on for
+// completions.
+int
+kdfpool_init(int nthreads, int maxqueue)
+{
+    pthread_t tid;
+    int       i, flags;
+
+    maxjobs = maxqueue;
+    if ((jobs = calloc(maxjobs, sizeof(struct kdfjob))) == NULL) {
+        perror("kdf pool allocation error");
+        exit(0);
+    }
+
+    if (pipe(notifyfd) < 0) {
+        perror("pipe error");
+        exit(0);
+    }
+    for (i = 0; i < 2; i++) {
+        flags = fcntl(notifyfd[i], F_GETFL, 0);
+        fcntl(notifyfd[i], F_SETFL, flags | O_NONBLOCK);
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&tid, NULL, kdf_thread, NULL) != 0) {
+            perror("kdf pool thread error");
+            exit(0);
+        }
+        pthread_detach(tid);
+    }
+
+    return notifyfd[0];
+}
+
+// Queue the verification of a password against a stored hash. The result is
+// delivered with the given tag by a later kdfpool_poll(). Returns -1 without
+// queueing anything if the queue is full or the request does not fit.
+int
+kdfpool_submit(const char *stored, const char *password, int tag)
+{
+    struct kdfjob *job;
+
+    if (strlen(stored) >= PASSHASH_MAXLEN || strlen(password) >= KDF_MAXPASS)
+        return -1;
+
+    pthread_mutex_lock(&lock);
+    if (njobs == maxjobs) {
+        stats.rejected++;
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+
+    job = &jobs[(jobhead + njobs) % maxjobs];
+    job->tag = tag;
+    strcpy(job->stored, stored);
+    strcpy(job->password, password);
+    njobs++;
+    stats.depth++;
+    stats.maxdepth = max(stats.maxdepth, stats.depth);
+    pthread_cond_signal(&jobready);
+    pthread_mutex_unlock(&lock);
+
+    return 0;
+}
+
+// Collect up to nres finished verifications. Returns the number collected.
+int
+kdfpool_poll(struct kdfresult *res, int nres)
+{
+    char drain[64];
+    int  n;
+
+    while (read(notifyfd[0], drain, sizeof(drain)) > 0)
+        ;
+
+    pthread_mutex_lock(&lock);
+    n = min(nres, ndone);
+    memcpy(res, done, n * sizeof(struct kdfresult));
+    memmove(done, done + n, (ndone - n) * sizeof(struct kdfresult));
+    ndone -= n;
+    // leave a wakeup behind for the completions that did not fit
+    if (ndone > 0)
+        write(notifyfd[1], "k", 1);
+    pthread_mutex_unlock(&lock);
+
+    return n;
+}
+
+void
+kdfpool_stats(struct kdfstats *st)
+{
+    pthread_mutex_lock(&lock);
+    *st = stats;
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,40 @@
+//
+// The header file for the KDF pool of the concurrent server. Verifying a
+// salted password hash takes milliseconds of CPU, so a worker hands it over to
+// a small pool of threads and goes on serving its other clients meanwhile.
+// The queue of the pool is bounded: when it is full a verification is refused
+// instead of queued, so that a login storm cannot make every client wait.
+// Completions are reported through a pipe that the worker adds to its select()
+// read set.
+//
+// Author: Tien Ho
+// Date: 12/13/16.
+//
+
+#ifndef KDFPOOL_H
+#define KDFPOOL_H
+
+#include "passhash.h"
+
+#define KDF_THREADS     4       /* default number of verifications run in parallel */
+#define KDF_QUEUE      64       /* default number of verifications waiting at most */
+#define KDF_MAXPASS   256       /* longest password verified */
+
+struct kdfresult {
+    int tag;                    /* identifies the request for the caller */
+    int ok;                     /* 1 if the password matched */
+};
+
+struct kdfstats {
+    unsigned int       depth;       /* verifications waiting or running */
+    unsigned int       maxdepth;    /* highest depth seen */
+    unsigned long long completed;
+    unsigned long long rejected;    /* refused because the queue was full */
+};
+
+int  kdfpool_init(int nthreads, int maxqueue);
+int  kdfpool_submit(const char *stored, const char *password, int tag);
+int  kdfpool_poll(struct kdfresult *res, int nres);
+void kdfpool_stats(struct kdfstats *stats);
+
+#endif //KDFPOOL_H
@@ -0,0 +1,38 @@
+//
+// The offline tool to compile a password file into the user database loaded
+// by the authentication servers. The servers map the database instead of
+// parsing the text file at every start.
+//
+// Author: Tien Ho
+// Date:   12/11/16
+//
+
+#include "utils.h"
+#include "credstore.h"
+
+int
+main(int argc, char **argv)
+{
+    credstore *store;
+
+    if (argc != 3) {
+        perror("usage: mkuserdb <password file> <database>");
+        exit(0);
+    }
+
+    if ((store = credstore_load(argv[1])) == NULL) { // argv[1] = password file
+        perror("cannot read the password file");
+        exit(0);
+    }
+
+    if (credstore_save(store, argv[2]) < 0) { // argv[2] = database
+        perror("cannot write the database");
+        exit(0);
+    }
+
+    printf("%u users, %u slots, %u bytes of records, %u filter blocks\n",
+           store->nusers, store->nslots, store->arenalen, store->bloomblocks);
+    credstore_free(store);
+
+    return 0;
+}
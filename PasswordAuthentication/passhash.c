@@ -0,0 +1,159 @@
+//
+// The salted password hashes stored in the password file. Verifying a hashed
+// password runs PBKDF2 with the iterations of the stored hash, which is meant
+// to be slow; the servers that serve many clients at once hand it over to the
+// KDF pool.
+//
+// Author: Tien Ho
+// Date:   12/13/16
+//
+
+#include "passhash.h"
+#include <ctype.h>
+#include <fcntl.h>
+#include <limits.h>
+
+static void
+to_hex(const uint8_t *data, size_t len, char *out)
+{
+    static const char digits[] = "0123456789abcdef";
+    size_t            i;
+
+    for (i = 0; i < len; i++) {
+        out[2 * i] = digits[data[i] >> 4];
+        out[2 * i + 1] = digits[data[i] & 0xf];
+    }
+    out[2 * len] = '\0';
+}
+
+// Returns the number of bytes decoded, or -1 if the text is not hexadecimal.
+static int
+from_hex(const char *text, size_t textlen, uint8_t *out, size_t outlen)
+{
+    size_t i;
+    int    hi, lo;
+
+    if (textlen % 2 != 0 || textlen / 2 > outlen)
+        return -1;
+
+    for (i = 0; i < textlen / 2; i++) {
+        hi = text[2 * i];
+        lo = text[2 * i + 1];
+        if (!isxdigit(hi) || !isxdigit(lo))
+            return -1;
+        hi = isdigit(hi) ? hi - '0' : tolower(hi) - 'a' + 10;
+        lo = isdigit(lo) ? lo - '0' : tolower(lo) - 'a' + 10;
+        out[i] = (uint8_t) (hi << 4 | lo);
+    }
+
+    return textlen / 2;
+}
+
+// Compare two buffers in a time that depends on their length only.
+static int
+equal_const(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    uint8_t diff = 0;
+    size_t  i;
+
+    for (i = 0; i < len; i++)
+        diff |= a[i] ^ b[i];
+
+    return diff == 0;
+}
+
+// Hash a password with a fresh random salt. Returns -1 on error.
+int
+passhash_make(const char *password, unsigned int iterations, char *out, size_t outlen)
+{
+    uint8_t salt[PASSHASH_SALT], hash[SHA256_DIGEST];
+    char    salthex[2 * PASSHASH_SALT + 1], hashhex[2 * SHA256_DIGEST + 1];
+    int     fd, n;
+
+    if ((fd = open("/dev/urandom", O_RDONLY)) < 0)
+        return -1;
+    n = read(fd, salt, sizeof(salt));
+    close(fd);
+    if (n != sizeof(salt))
+        return -1;
+
+    pbkdf2_sha256(password, strlen(password), salt, sizeof(salt), iterations, hash, sizeof(hash));
+    to_hex(salt, sizeof(salt), salthex);
+    to_hex(hash, sizeof(hash), hashhex);
+    n = snprintf(out, outlen, "%s%u$%s$%s", PASSHASH_PREFIX, iterations, salthex, hashhex);
+
+    return n < 0 || (size_t) n >= outlen ? -1 : 0;
+}
+
+int
+passhash_is_hashed(const char *stored)
+{
+    return strncmp(stored, PASSHASH_PREFIX, strlen(PASSHASH_PREFIX)) == 0;
+}
+
+// Returns the iterations of a stored hash and sets *end past them, or 0 if
+// the hash is malformed.
+static unsigned int
+hash_iterations(const char *stored, char **end)
+{
+    const char    *p = stored + strlen(PASSHASH_PREFIX);
+    unsigned long iterations;
+
+    iterations = strtoul(p, end, 10);
+    if (*end == p || **end != '$' || iterations > UINT_MAX)
+        return 0;
+
+    return iterations;
+}
+
+// Returns 1 if the password matches the stored password or hash.
+int
+passhash_verify(const char *stored, const char *password)
+{
+    uint8_t       salt[PASSHASH_MAXLEN], hash[SHA256_DIGEST], computed[SHA256_DIGEST];
+    const char    *p, *saltend;
+    char          *end;
+    unsigned int  iterations;
+    int           saltlen;
+    size_t        len;
+
+    if (!passhash_is_hashed(stored)) {
+        len = strlen(stored);
+        return len == strlen(password) && equal_const((const uint8_t *) stored, (const uint8_t *) password, len);
+    }
+
+    if ((iterations = hash_iterations(stored, &end)) == 0)
+        return 0;
+
+    p = end + 1;
+    if ((saltend = strchr(p, '$')) == NULL || (saltlen = from_hex(p, saltend - p, salt, sizeof(salt))) < 0)
+        return 0;
+    if (from_hex(saltend + 1, strlen(saltend + 1), hash, sizeof(hash)) != SHA256_DIGEST)
+        return 0;
+
+    pbkdf2_sha256(password, strlen(password), salt, saltlen, iterations, computed, sizeof(computed));
+
+    return equal_const(hash, computed, sizeof(hash));
+}
+
+// Make a decoy to verify the password of an unknown user against, so that
+// the reply to an unknown user takes as long as a wrong password: a hash of
+// the same iterations as the sample password of the store, or a plaintext
+// password if the sample is plaintext. The decoy is a password with a space,
+// which no request can carry, so that it never matches. Returns -1 on error.
+int
+passhash_decoy(const char *sample, char *out, size_t outlen)
+{
+    unsigned int iterations;
+    char         *end;
+
+    if (sample == NULL || !passhash_is_hashed(sample)) {
+        snprintf(out, outlen, "no such user");
+        return 0;
+    }
+
+    if ((iterations = hash_iterations(sample, &end)) == 0)
+        iterations = PASSHASH_ITER;
+
+    return passhash_make("no such user", iterations, out, outlen);
+}
@@ -0,0 +1,27 @@
+//
+// The header file for the salted password hashes stored in the password file,
+// "$pbkdf2-sha256$<iterations>$<salt>$<hash>" with the salt and the hash in
+// hexadecimal. A password that does not start with the prefix is a plaintext
+// password from an older file and is still accepted.
+//
+// Author: Tien Ho
+// Date: 12/13/16.
+//
+
+#ifndef PASSHASH_H
+#define PASSHASH_H
+
+#include "utils.h"
+#include "sha256.h"
+
+#define PASSHASH_PREFIX  "$pbkdf2-sha256$"
+#define PASSHASH_ITER    100000     /* default PBKDF2 iterations */
+#define PASSHASH_SALT    16         /* bytes of salt */
+#define PASSHASH_MAXLEN  160        /* longest stored hash, with the NUL */
+
+int passhash_make(const char *password, unsigned int iterations, char *out, size_t outlen);
+int passhash_is_hashed(const char *stored);
+int passhash_verify(const char *stored, const char *password);
+int passhash_decoy(const char *sample, char *out, size_t outlen);
+
+#endif //PASSHASH_H
@@ -0,0 +1,69 @@
+//
+// The line framing of the protocol between the authentication client and
+// servers, shared by both sides.
+//
+// Author: Tien Ho
+// Date:   12/16/16
+//
+
+#include "protocol.h"
+
+// Read what is available on a connection into the line buffer. Returns the
+// result of read(), or -1 with EMSGSIZE if the buffer holds a line too long
+// to be completed.
+ssize_t
+linebuf_fill(int fd, struct linebuf *lb)
+{
+    ssize_t n;
+
+    if (lb->len == sizeof(lb->data)) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if ((n = read(fd, lb->data + lb->len, sizeof(lb->data) - lb->len)) > 0)
+        lb->len += n;
+
+    return n;
+}
+
+// Take the next complete line out of the buffer, without its newline.
+// Returns 1 if there was one and 0 otherwise.
+int
+linebuf_next(struct linebuf *lb, char *line)
+{
+    char *end;
+    int  n;
+
+    if ((end = memchr(lb->data, '\n', lb->len)) == NULL)
+        return 0;
+
+    n = end - lb->data;
+    memcpy(line, lb->data, n);
+    line[n] = '\0';
+    if (n > 0 && line[n - 1] == '\r')
+        line[n - 1] = '\0';
+
+    lb->len -= n + 1;
+    memmove(lb->data, end + 1, lb->len);
+
+    return 1;
+}
+
+// Split a request line into its id, verb and arguments. Returns -1 if the
+// line has no id or no verb.
+int
+parse_request(char *line, struct request *req)
+{
+    char *saveptr;
+
+    bzero(req, sizeof(*req));
+    if ((req->id = strtok_r(line, " ", &saveptr)) == NULL || strlen(req->id) >= MAXID)
+        return -1;
+    if ((req->verb = strtok_r(NULL, " ", &saveptr)) == NULL)
+        return -1;
+    req->arg1 = strtok_r(NULL, " ", &saveptr);
+    req->arg2 = req->arg1 != NULL ? strtok_r(NULL, " ", &saveptr) : NULL;
+
+    return 0;
+}
@@ -0,0 +1,48 @@
+//
+// The header file for the protocol between the authentication client and
+// servers. Every request and reply is one line that starts with the id of the
+// request, so that a client can send many requests on one connection without
+// waiting, and match the replies, which may come back in another order:
+//
+//     <id> auth <username> <password>      <id> success [<session token>]
+//     <id> token <session token>           <id> failure
+//                                          <id> final failure
+//                                          <id> throttled
+//                                          <id> busy
+//                                          <id> error <reason>
+//
+// The connection stays open until the client closes it or fails MAXATTEMPT
+// times in a row, which is answered by "final failure".
+//
+// Author: Tien Ho
+// Date: 12/16/16.
+//
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include "utils.h"
+
+#define MAXREQUEST   512    /* longest request or reply line */
+#define MAXID         24    /* longest request id, with the NUL */
+#define MAXATTEMPT     3    /* failed attempts in a row allowed per connection */
+
+// the bytes received on a connection and not yet split into lines
+struct linebuf {
+    char data[MAXREQUEST];
+    int  len;
+};
+
+// a request split into its fields; the fields point into the parsed line
+struct request {
+    char *id;
+    char *verb;
+    char *arg1;
+    char *arg2;
+};
+
+ssize_t linebuf_fill(int fd, struct linebuf *lb);
+int     linebuf_next(struct linebuf *lb, char *line);
+int     parse_request(char *line, struct request *req);
+
+#endif //PROTOCOL_H
@@ -0,0 +1,168 @@
+//
+// The rate limiter of the authentication servers. The table of token buckets
+// is set-associative: a bucket name hashes to one shard, which has its own
+// process-shared lock, and to one set of RATE_WAYS entries in it. A new name
+// takes an empty entry of its set or else the entry idle for the longest time;
+// an entry idle long enough to be full again holds no information, so old
+// names are forgotten first.
+//
+// Author: Tien Ho
+// Date:   12/14/16
+//
+
+#include "ratelimit.h"
+#include <sys/mman.h>
+#include <time.h>
+
+static const struct ratepolicy ippolicy = { RATE_IP_BURST, RATE_IP_PERMIN };
+static const struct ratepolicy userpolicy = { RATE_USER_BURST, RATE_USER_PERMIN };
+
+static int64_t
+now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+#define FNV_BASIS   14695981039346656037ULL
+
+// 64-bit FNV-1a hash of len bytes, continuing from h
+static uint64_t
+fnv(uint64_t h, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+
+    while (len-- > 0)
+        h = (h ^ *p++) * 1099511628211ULL;
+
+    return h;
+}
+
+// the key of the bucket of a name; 0 marks an empty entry
+static uint64_t
+hash_name(const char *name)
+{
+    uint64_t h = fnv(FNV_BASIS, name, strlen(name));
+
+    return h ? h : 1;
+}
+
+// The key of the bucket of an address, hashed from its bytes after a prefix
+// no name starts with, so that the address need not be written out. The
+// port is left out: a client gets a new one with every connection.
+static uint64_t
+hash_addr(const struct endpoint *addr)
+{
+    uint64_t h = fnv(FNV_BASIS, "ip\0", 3);
+
+    h = fnv(h, addr->ip, sizeof(addr->ip));
+    return h ? h : 1;
+}
+
+// Map a table shared with the processes forked later.
+struct ratelimit *
+ratelimit_create(void)
+{
+    struct ratelimit    *rl;
+    pthread_mutexattr_t attr;
+    int                 i;
+
+    rl = mmap(NULL, sizeof(struct ratelimit), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (rl == MAP_FAILED) {
+        perror("rate limiter allocation error");
+        exit(0);
+    }
+
+    // a robust lock is released when a process dies holding it
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    for (i = 0; i < RATE_SHARDS; i++)
+        pthread_mutex_init(&rl->shards[i].lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    return rl;
+}
+
+// Take a token from the bucket of key. Returns 1 if there was one.
+static int
+take(struct ratelimit *rl, uint64_t key, const struct ratepolicy *policy)
+{
+    struct rateshard *shard;
+    struct rateentry *set, *e = NULL;
+    int64_t          now = now_ms(), tokens;
+    int              i, allowed;
+
+    shard = &rl->shards[key % RATE_SHARDS];
+    set = &shard->entries[(key / RATE_SHARDS) % RATE_BUCKETS * RATE_WAYS];
+
+    if (pthread_mutex_lock(&shard->lock) == EOWNERDEAD)
+        pthread_mutex_consistent(&shard->lock);
+
+    for (i = 0; i < RATE_WAYS; i++) {
+        if (set[i].key == key) {
+            e = &set[i];
+            break;
+        }
+    }
+
+    if (e == NULL) {
+        // take an empty entry of the set, or else the one idle the longest
+        e = &set[0];
+        for (i = 1; i < RATE_WAYS && e->key != 0; i++) {
+            if (set[i].key == 0 || set[i].last < e->last)
+                e = &set[i];
+        }
+        e->key = key;
+        e->last = now;
+        e->millitokens = policy->burst * 1000;
+    }
+
+    // refill for the time elapsed: perminute tokens per 60000 ms
+    tokens = e->millitokens + (now - e->last) * policy->perminute / 60;
+    e->millitokens = (int32_t) min(tokens, (int64_t) policy->burst * 1000);
+    e->last = now;
+
+    if ((allowed = e->millitokens >= 1000))
+        e->millitokens -= 1000;
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return allowed;
+}
+
+// Take a token from the bucket of a name. Returns 1 if there was one.
+int
+ratelimit_allow(struct ratelimit *rl, const char *name, const struct ratepolicy *policy)
+{
+    return take(rl, hash_name(name), policy);
+}
+
+// Check an attempt against the limit of its source address. Returns 1 if the
+// attempt may go on. A server without a rate limiter passes NULL.
+int
+ratelimit_check_addr(struct ratelimit *rl, const struct endpoint *addr)
+{
+    if (rl == NULL)
+        return 1;
+
+    return take(rl, hash_addr(addr), &ippolicy);
+}
+
+// Check an attempt against the limits of its source address and its username.
+// Returns 1 if the attempt may go on.
+int
+ratelimit_check(struct ratelimit *rl, const struct endpoint *addr, const char *username)
+{
+    char name[MAXLINE];
+
+    if (rl == NULL)
+        return 1;
+    if (!ratelimit_check_addr(rl, addr))
+        return 0;
+
+    snprintf(name, sizeof(name), "user %s", username);
+    return ratelimit_allow(rl, name, &userpolicy);
+}
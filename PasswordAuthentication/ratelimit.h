@@ -0,0 +1,56 @@
+//
+// The header file for the rate limiter of the authentication servers. Every
+// attempt takes a token from the bucket of its source address and from the
+// bucket of its username before the password is looked at; the buckets refill
+// at a steady rate up to a burst. The buckets live in shared memory, so that
+// the limits hold across the processes of a server and across reconnections.
+//
+// Author: Tien Ho
+// Date: 12/14/16.
+//
+
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include "utils.h"
+#include "addr.h"
+#include <stdint.h>
+#include <pthread.h>
+
+#define RATE_SHARDS       16    /* independently locked parts of the table */
+#define RATE_BUCKETS     256    /* buckets per shard */
+#define RATE_WAYS          4    /* entries per bucket */
+
+#define RATE_IP_BURST     20    /* attempts from one address at once */
+#define RATE_IP_PERMIN    60    /* attempts from one address per minute */
+#define RATE_USER_BURST    5    /* attempts for one username at once */
+#define RATE_USER_PERMIN  10    /* attempts for one username per minute */
+
+struct ratepolicy {
+    int burst;
+    int perminute;
+};
+
+// A token bucket. The tokens are counted in thousandths and refilled lazily
+// from the time elapsed since the last attempt.
+struct rateentry {
+    uint64_t key;               /* hash of the bucket name, 0 if empty */
+    int64_t  last;              /* time of the last attempt, in ms */
+    int32_t  millitokens;
+};
+
+struct rateshard {
+    pthread_mutex_t  lock;
+    struct rateentry entries[RATE_BUCKETS * RATE_WAYS];
+};
+
+struct ratelimit {
+    struct rateshard shards[RATE_SHARDS];
+};
+
+struct ratelimit *ratelimit_create(void);
+int              ratelimit_allow(struct ratelimit *rl, const char *name, const struct ratepolicy *policy);
+int              ratelimit_check_addr(struct ratelimit *rl, const struct endpoint *addr);
+int              ratelimit_check(struct ratelimit *rl, const struct endpoint *addr, const char *username);
+
+#endif //RATELIMIT_H
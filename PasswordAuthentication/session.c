@@ -0,0 +1,162 @@
+//
+// The session tokens of the authentication servers. The secret and the cache
+// of recent sessions live in shared memory created before the server forks,
+// so that a token issued by one process is accepted by all the others. The
+// cache is set-associative like the rate limiter: a token maps to one set by
+// its MAC and replaces the least recently used entry of the set when the set
+// is full. An entry only matches a token equal to the one it was made from,
+// so a hit is as good as checking the HMAC.
+//
+// Author: Tien Ho
+// Date:   12/15/16
+//
+
+#include "session.h"
+#include <ctype.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+
+static void
+compute_mac(const struct sessions *s, long expires, const char *username, uint8_t mac[SESSION_MACLEN])
+{
+    struct hmac_sha256 ctx;
+    uint8_t            digest[SHA256_DIGEST];
+    char               buff[32];
+
+    snprintf(buff, sizeof(buff), "%ld:", expires);
+    hmac_sha256_init(&ctx, s->secret, sizeof(s->secret));
+    sha256_update(&ctx.inner, buff, strlen(buff));
+    sha256_update(&ctx.inner, username, strlen(username));
+    hmac_sha256_final(&ctx, digest);
+    memcpy(mac, digest, SESSION_MACLEN);
+}
+
+// Compare two MACs in a time that depends on their length only.
+static int
+equal_const(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    uint8_t diff = 0;
+    size_t  i;
+
+    for (i = 0; i < len; i++)
+        diff |= a[i] ^ b[i];
+
+    return diff == 0;
+}
+
+// Map the sessions shared with the processes forked later, with a fresh secret.
+struct sessions *
+sessions_create(void)
+{
+    struct sessions     *s;
+    pthread_mutexattr_t attr;
+    int                 fd;
+
+    s = mmap(NULL, sizeof(struct sessions), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (s == MAP_FAILED) {
+        perror("session allocation error");
+        exit(0);
+    }
+
+    if ((fd = open("/dev/urandom", O_RDONLY)) < 0 || read(fd, s->secret, sizeof(s->secret)) != sizeof(s->secret)) {
+        perror("cannot make the session secret");
+        exit(0);
+    }
+    close(fd);
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&s->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    return s;
+}
+
+// Make a token for a user. Returns -1 if the username is too long to get one.
+int
+session_issue(const struct sessions *s, const char *username, char *token, size_t len)
+{
+    uint8_t mac[SESSION_MACLEN];
+    long    expires = time(NULL) + SESSION_TTL;
+    int     i, n;
+
+    if (strlen(username) >= SESSION_MAXUSER)
+        return -1;
+
+    compute_mac(s, expires, username, mac);
+    n = snprintf(token, len, "%ld:", expires);
+    for (i = 0; i < SESSION_MACLEN && n + 2 < (int) len; i++)
+        n += snprintf(token + n, len - n, "%02x", mac[i]);
+    n += snprintf(token + n, len - n, ":%s", username);
+
+    return n < (int) len ? 0 : -1;
+}
+
+// Check a token and copy the username it was issued to. Returns 1 if the
+// token is genuine and has not expired.
+int
+session_verify(struct sessions *s, const char *token, char *username, size_t len)
+{
+    struct sessionentry *set, *e;
+    uint8_t             mac[SESSION_MACLEN], expected[SESSION_MACLEN];
+    const char          *name;
+    char                *end;
+    long                expires;
+    unsigned int        byte;
+    uint64_t            key = 0;
+    long                now = time(NULL);
+    int                 i, hit = 0;
+
+    // parse "<expires>:<mac>:<username>"
+    expires = strtol(token, &end, 10);
+    if (end == token || *end != ':' || expires < now)
+        return 0;
+    for (i = 0, end++; i < SESSION_MACLEN; i++, end += 2) {
+        if (!isxdigit((unsigned char) end[0]) || !isxdigit((unsigned char) end[1]) || sscanf(end, "%2x", &byte) != 1)
+            return 0;
+        mac[i] = (uint8_t) byte;
+        key = key << 8 | byte;
+    }
+    name = end + 1;
+    if (*end != ':' || *name == '\0' || strlen(name) >= SESSION_MAXUSER || strlen(name) >= len)
+        return 0;
+
+    set = &s->entries[key % SESSION_SETS * SESSION_WAYS];
+    if (pthread_mutex_lock(&s->lock) == EOWNERDEAD)
+        pthread_mutex_consistent(&s->lock);
+    for (i = 0; i < SESSION_WAYS; i++) {
+        e = &set[i];
+        if (e->expires == expires && equal_const(e->mac, mac, SESSION_MACLEN) && strcmp(e->username, name) == 0) {
+            e->stamp = ++s->clock;
+            hit = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    if (!hit) {
+        compute_mac(s, expires, name, expected);
+        if (!equal_const(mac, expected, SESSION_MACLEN))
+            return 0;
+
+        // remember the session in place of an empty, expired or else the
+        // least recently used entry of the set
+        if (pthread_mutex_lock(&s->lock) == EOWNERDEAD)
+            pthread_mutex_consistent(&s->lock);
+        e = &set[0];
+        for (i = 1; i < SESSION_WAYS && e->expires >= now; i++) {
+            if (set[i].expires < now || set[i].stamp < e->stamp)
+                e = &set[i];
+        }
+        memcpy(e->mac, mac, SESSION_MACLEN);
+        e->expires = expires;
+        e->stamp = ++s->clock;
+        strcpy(e->username, name);
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    strcpy(username, name);
+    return 1;
+}
@@ -0,0 +1,45 @@
+//
+// The header file for the session tokens of the authentication servers. A
+// client that logs in gets a token, "<expires>:<mac>:<username>", where mac is
+// the HMAC-SHA256 of "<expires>:<username>" under a secret of the server. The
+// client logs in again with a token request, which costs an HMAC or a
+// lookup in the cache of recent sessions instead of a password verification.
+//
+// Author: Tien Ho
+// Date: 12/15/16.
+//
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "utils.h"
+#include "sha256.h"
+#include <pthread.h>
+
+#define SESSION_TTL       3600  /* seconds a token stays valid */
+#define SESSION_MACLEN      16  /* bytes of the HMAC kept in a token */
+#define SESSION_MAXUSER     64  /* longest username given a token, with the NUL */
+#define SESSION_MAXTOKEN   128  /* longest token, with the NUL */
+#define SESSION_SETS      1024  /* sets of the session cache */
+#define SESSION_WAYS         4  /* entries per set */
+
+// a session validated recently
+struct sessionentry {
+    uint8_t  mac[SESSION_MACLEN];
+    long     expires;           /* 0 if the entry is empty */
+    uint32_t stamp;             /* time of the last use, for LRU */
+    char     username[SESSION_MAXUSER];
+};
+
+struct sessions {
+    uint8_t             secret[SHA256_DIGEST];
+    pthread_mutex_t     lock;
+    uint32_t            clock;
+    struct sessionentry entries[SESSION_SETS * SESSION_WAYS];
+};
+
+struct sessions *sessions_create(void);
+int             session_issue(const struct sessions *s, const char *username, char *token, size_t len);
+int             session_verify(struct sessions *s, const char *token, char *username, size_t len);
+
+#endif //SESSION_H
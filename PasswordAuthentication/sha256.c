@@ -0,0 +1,190 @@
+//
+// SHA-256 (FIPS 180-4), HMAC-SHA256 (RFC 2104) and PBKDF2-HMAC-SHA256
+// (RFC 8018). The keyed HMAC states are computed once per password, so that
+// every PBKDF2 iteration costs two compressions only.
+//
+// Author: Tien Ho
+// Date:   12/13/16
+//
+
+#include "sha256.h"
+#include <string.h>
+
+static const uint32_t k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n)  (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void
+compress(uint32_t state[8], const uint8_t block[SHA256_BLOCK])
+{
+    uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+    int      i;
+
+    for (i = 0; i < 16; i++) {
+        w[i] = (uint32_t) block[4 * i] << 24 | (uint32_t) block[4 * i + 1] << 16 |
+               (uint32_t) block[4 * i + 2] << 8 | block[4 * i + 3];
+    }
+    for (i = 16; i < 64; i++) {
+        w[i] = w[i - 16] + (ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+               w[i - 7] + (ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10));
+    }
+
+    a = state[0]; b = state[1]; c = state[2]; d = state[3];
+    e = state[4]; f = state[5]; g = state[6]; h = state[7];
+    for (i = 0; i < 64; i++) {
+        t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+        t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+void
+sha256_init(struct sha256 *ctx)
+{
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    memcpy(ctx->state, iv, sizeof(iv));
+    ctx->length = 0;
+    ctx->used = 0;
+}
+
+void
+sha256_update(struct sha256 *ctx, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    size_t        n;
+
+    ctx->length += len;
+    while (len > 0) {
+        n = SHA256_BLOCK - ctx->used;
+        if (n > len)
+            n = len;
+        memcpy(ctx->block + ctx->used, p, n);
+        ctx->used += n;
+        p += n;
+        len -= n;
+        if (ctx->used == SHA256_BLOCK) {
+            compress(ctx->state, ctx->block);
+            ctx->used = 0;
+        }
+    }
+}
+
+void
+sha256_final(struct sha256 *ctx, uint8_t digest[SHA256_DIGEST])
+{
+    uint64_t bits = ctx->length * 8;
+    int      i;
+
+    // pad with a one bit, zeros and the length in bits
+    ctx->block[ctx->used++] = 0x80;
+    if (ctx->used > SHA256_BLOCK - 8) {
+        memset(ctx->block + ctx->used, 0, SHA256_BLOCK - ctx->used);
+        compress(ctx->state, ctx->block);
+        ctx->used = 0;
+    }
+    memset(ctx->block + ctx->used, 0, SHA256_BLOCK - 8 - ctx->used);
+    for (i = 0; i < 8; i++)
+        ctx->block[SHA256_BLOCK - 1 - i] = (uint8_t) (bits >> (8 * i));
+    compress(ctx->state, ctx->block);
+
+    for (i = 0; i < 8; i++) {
+        digest[4 * i] = (uint8_t) (ctx->state[i] >> 24);
+        digest[4 * i + 1] = (uint8_t) (ctx->state[i] >> 16);
+        digest[4 * i + 2] = (uint8_t) (ctx->state[i] >> 8);
+        digest[4 * i + 3] = (uint8_t) ctx->state[i];
+    }
+}
+
+void
+hmac_sha256_init(struct hmac_sha256 *ctx, const void *key, size_t keylen)
+{
+    uint8_t pad[SHA256_BLOCK];
+    uint8_t keyhash[SHA256_DIGEST];
+    int     i;
+
+    // a key longer than a block is replaced by its hash
+    if (keylen > SHA256_BLOCK) {
+        sha256_init(&ctx->inner);
+        sha256_update(&ctx->inner, key, keylen);
+        sha256_final(&ctx->inner, keyhash);
+        key = keyhash;
+        keylen = SHA256_DIGEST;
+    }
+
+    memset(pad, 0, sizeof(pad));
+    memcpy(pad, key, keylen);
+    for (i = 0; i < SHA256_BLOCK; i++)
+        pad[i] ^= 0x36;
+    sha256_init(&ctx->inner);
+    sha256_update(&ctx->inner, pad, SHA256_BLOCK);
+
+    for (i = 0; i < SHA256_BLOCK; i++)
+        pad[i] ^= 0x36 ^ 0x5c;
+    sha256_init(&ctx->outer);
+    sha256_update(&ctx->outer, pad, SHA256_BLOCK);
+}
+
+// Finish the HMAC of the message given to ctx->inner with sha256_update().
+void
+hmac_sha256_final(struct hmac_sha256 *ctx, uint8_t digest[SHA256_DIGEST])
+{
+    uint8_t innerhash[SHA256_DIGEST];
+
+    sha256_final(&ctx->inner, innerhash);
+    sha256_update(&ctx->outer, innerhash, SHA256_DIGEST);
+    sha256_final(&ctx->outer, digest);
+}
+
+void
+pbkdf2_sha256(const void *password, size_t passlen, const void *salt, size_t saltlen,
+              unsigned int iterations, uint8_t *out, size_t outlen)
+{
+    struct hmac_sha256 keyed, ctx;
+    uint8_t            u[SHA256_DIGEST], t[SHA256_DIGEST], counter[4];
+    uint32_t           blocknum;
+    unsigned int       i;
+    size_t             j, n;
+
+    hmac_sha256_init(&keyed, password, passlen);
+
+    for (blocknum = 1; outlen > 0; blocknum++) {
+        counter[0] = (uint8_t) (blocknum >> 24);
+        counter[1] = (uint8_t) (blocknum >> 16);
+        counter[2] = (uint8_t) (blocknum >> 8);
+        counter[3] = (uint8_t) blocknum;
+
+        ctx = keyed;
+        sha256_update(&ctx.inner, salt, saltlen);
+        sha256_update(&ctx.inner, counter, sizeof(counter));
+        hmac_sha256_final(&ctx, u);
+        memcpy(t, u, SHA256_DIGEST);
+
+        for (i = 1; i < iterations; i++) {
+            ctx = keyed;
+            sha256_update(&ctx.inner, u, SHA256_DIGEST);
+            hmac_sha256_final(&ctx, u);
+            for (j = 0; j < SHA256_DIGEST; j++)
+                t[j] ^= u[j];
+        }
+
+        n = outlen < SHA256_DIGEST ? outlen : SHA256_DIGEST;
+        memcpy(out, t, n);
+        out += n;
+        outlen -= n;
+    }
+}
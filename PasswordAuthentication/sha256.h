@@ -0,0 +1,41 @@
+//
+// The header file for SHA-256, HMAC-SHA256 and PBKDF2-HMAC-SHA256, which the
+// authentication servers use to verify salted password hashes.
+//
+// Author: Tien Ho
+// Date: 12/13/16.
+//
+
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_BLOCK    64
+#define SHA256_DIGEST   32
+
+struct sha256 {
+    uint32_t state[8];
+    uint64_t length;            /* bytes hashed so far */
+    uint8_t  block[SHA256_BLOCK];
+    size_t   used;              /* bytes waiting in block */
+};
+
+// the keyed inner and outer hashes of HMAC, ready to take a message
+struct hmac_sha256 {
+    struct sha256 inner;
+    struct sha256 outer;
+};
+
+void sha256_init(struct sha256 *ctx);
+void sha256_update(struct sha256 *ctx, const void *data, size_t len);
+void sha256_final(struct sha256 *ctx, uint8_t digest[SHA256_DIGEST]);
+
+void hmac_sha256_init(struct hmac_sha256 *ctx, const void *key, size_t keylen);
+void hmac_sha256_final(struct hmac_sha256 *ctx, uint8_t digest[SHA256_DIGEST]);
+
+void pbkdf2_sha256(const void *password, size_t passlen, const void *salt, size_t saltlen,
+                   unsigned int iterations, uint8_t *out, size_t outlen);
+
+#endif //SHA256_H
@@ -10,6 +10,7 @@
 //
 
 #include "utils.h"
+#include "addr.h"
 
 void
 sig_chld(int signo)
@@ -35,41 +36,38 @@ send_message(FILE *fp, int sockfd)
 int
 main(int argc, char **argv)
 {
-    int                sockfd, i, n;
-    pid_t              pid;
-    struct sockaddr_in servaddr;
-    char               recvbuff[MAXLINE], ipaddr[MAXLINE];
-    struct in_addr     **addr_list;
-    struct hostent     *hp;
+    int                     sockfd, n;
+    pid_t                   pid;
+    socklen_t               addrlen;
+    struct endpoint         server;
+    struct sockaddr_storage servaddr;
+    struct addrinfo         hints, *res;
+    char                    recvbuff[MAXLINE];
 
     if (argc != 3) {
         perror("usage: echoclient <servhost> <servport>");
         exit(0);
     }
 
-    if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("socket error");
+    // get the ip address from the hostname, IPv4 or IPv6
+    bzero(&hints, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(argv[1], NULL, &hints, &res) != 0) {
+        printf("inet_pton error for %s", argv[1]); // argv[1] == localhost
         exit(0);
     }
+    addr_from(&server, res->ai_addr);
+    freeaddrinfo(res);
+    server.port = atoi(argv[2]);
+    addrlen = addr_to(&server, 0, &servaddr);
 
-    bzero(&servaddr, sizeof(servaddr));
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_port = atoi(argv[2]);
-
-    // get the ip address from the hostname
-    hp = gethostbyname(argv[1]);
-    addr_list = (struct in_addr **)hp->h_addr_list;
-    strcpy(ipaddr, "");
-    for(i = 0; addr_list[i] != NULL; i++) {
-        strcat(ipaddr, inet_ntoa(*addr_list[i]));
-    }
-
-    if (inet_pton(AF_INET, ipaddr, &servaddr.sin_addr) <= 0) {
-        printf("inet_pton error for %s", argv[1]); // argv[1] == localhost
+    if ((sockfd = socket(servaddr.ss_family, SOCK_STREAM, 0)) < 0) {
+        perror("socket error");
         exit(0);
     }
 
-    if (connect(sockfd, (struct sockaddr *) &servaddr, sizeof(servaddr)) < 0) {
+    if (connect(sockfd, (struct sockaddr *) &servaddr, addrlen) < 0) {
         perror("connect error");
         exit(0);
     }
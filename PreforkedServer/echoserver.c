@@ -5,19 +5,40 @@
 // processes, each handling each client request. In order to avoid the
 // thundering herd, a lock is used so that only one child is blocked in the
 // call to accept at a time. The program accepts two arguments, the port
-// number and the number of children to create.
+// number and the number of children to create. The children count into
+// metrics the parent serves at METRICS_ENDPOINT, if it is set.
+//
+// On SIGTERM or SIGINT the children stop accepting, serve the sessions they
+// are in for DRAIN_SECONDS at most, end them by closing their side and exit;
+// the parent kills the ones still there after that. With HANDOFF_PATH set, a
+// new server started with the same path takes over the listen socket and the
+// old one stops the same way.
 //
 // Author: Tien Ho
 // Date:   12/01/16
 //
 
 #include "utils.h"
+#include "handoff.h"
+#include "listener.h"
+#include "logger.h"
+#include "metrics.h"
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#define DRAIN_SECONDS   5       /* a session goes on after the server is stopped */
+#define LINGER_SECONDS  1       /* a client has to close its side once it is ended */
 
 // global variables
 static int          nchildren;
-static pid_t        *pids;
+static pid_t        *pids;          /* 0 once the child is reaped */
+static int          live;           /* the children not reaped yet */
+static int          listenfd, handofffd = -1;
+static int          draining;
+static volatile sig_atomic_t stopping;  /* a child was told to stop */
 static struct flock lock_it, unlock_it;
 static int          lock_fd = -1;
+static int          sessions;       /* the id of the session length histogram */
 
 void
 lock_init(char *pathname)
@@ -42,18 +63,21 @@ lock_init(char *pathname)
     unlock_it.l_len = 0;
 }
 
-// Obtain the lock for the lock_file
-void
+// Obtain the lock for the lock_file. Returns -1 if the child is stopped
+// while it waits.
+int
 lock_wait()
 {
     int rc;
 
     while ((rc = fcntl(lock_fd, F_SETLKW, &lock_it)) < 0) {
-        if (errno = EINTR)
-            continue; // the lock is already obtained by some process
-        else
+        if (stopping)
+            return -1;
+        if (errno != EINTR)
             perror("fcntl error for lock_wait()");
     }
+
+    return 0;
 }
 
 // Release the lock on the lock_file for other processes to use
@@ -64,116 +88,265 @@ lock_release()
         perror("fcntl error for lock_release");
 }
 
+// the time in milliseconds
+static long long
+now_ms(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000LL + tv.tv_usec / 1000;
+}
+
 pid_t
-fork_child(int i, int listenfd, int addrlen)
+fork_child(int i, int listenfd)
 {
     pid_t pid;
-    void  child_main(int, int, int);
+    void  child_main(int, int);
 
     if ((pid = fork()) > 0)
         return pid;
 
-    child_main(i, listenfd, addrlen);
+    child_main(i, listenfd);
+}
+
+// the signal handler of a child: a blocked accept or read returns EINTR
+static void
+child_stop(int signo)
+{
+    stopping = 1;
+}
+
+// a read on the socket gives up after seconds
+static void
+read_timeout(int connfd, int seconds)
+{
+    struct timeval tv;
+
+    tv.tv_sec = seconds;
+    tv.tv_usec = 0;
+    setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+// The session outlasted the drain: end it by closing this side, which the
+// client reads as the end of the echo, and wait for the client to close its
+// side, so that what it still sends does not reset the connection.
+static void
+end_session(int connfd)
+{
+    char buff[MAXLINE];
+
+    shutdown(connfd, SHUT_WR);
+    read_timeout(connfd, LINGER_SECONDS);
+    while (read(connfd, buff, sizeof(buff)) > 0)
+        ;
 }
 
 void
-child_main(int i, int listenfd, int addrlen)
+child_main(int i, int listenfd)
 {
     int                connfd, n;
-    struct sockaddr_in cliaddr;
-    socklen_t          clilen;
-    char               buff[MAXLINE];
-
-    printf("child %ld starting\n", (long) getpid());
-    for ( ; ; ) {
-        lock_wait();
+    struct endpoint    cliaddr;
+    char               buff[MAXLINE], ip[ADDR_STRLEN];
+    long long          start, deadline;
+    struct sigaction   sa;
+
+    // no SA_RESTART, so that the signal ends the wait in accept or read
+    bzero(&sa, sizeof(sa));
+    sa.sa_handler = child_stop;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    logger_msg(LOGGER_INFO, "child %ld starting\n", (long) getpid());
+    while (!stopping) {
+        if (lock_wait() < 0)
+            break;
         connfd = accept(listenfd, NULL, NULL);
         lock_release();
-
-        clilen = addrlen;
-        if (getpeername(connfd, (struct sockaddr *) &cliaddr, &clilen) < 0)
+        metric_add(NET_SYS_ACCEPT, 1);
+        if (connfd < 0)
+            continue;
+        metric_add(NET_ACCEPTED, 1);
+        metric_add(NET_CONNECTIONS, 1);
+        start = now_ms();
+
+        bzero(&cliaddr, sizeof(cliaddr));
+        if (addr_peer(connfd, &cliaddr) < 0)
             perror("peer name error");
 
-        printf("Connected to client on \'%s\' at port \'%d\'\n", inet_ntoa(cliaddr.sin_addr), cliaddr.sin_port);
-        fflush(stdout);
+        addr_ntop(&cliaddr, ip, sizeof(ip));
+        logger_msg(LOGGER_INFO, "Connected to client on \'%s\' at port \'%d\'\n", ip, cliaddr.port);
 
-        for ( ; ; ) {
-            bzero(buff, sizeof(buff));
-            if ((n = read(connfd, buff, MAXLINE)) == 0) { // The client exits
-                printf("Disconnected from client on \'%s\' at port \'%d\'\n", inet_ntoa(cliaddr.sin_addr), cliaddr.sin_port);
+        for (deadline = 0; ; ) {
+            if (stopping && deadline == 0) {
+                deadline = now_ms() + DRAIN_SECONDS * 1000LL;
+                read_timeout(connfd, DRAIN_SECONDS);
+            }
+            if (deadline > 0 && now_ms() >= deadline) {
+                end_session(connfd);
+                break;
+            }
+            n = read(connfd, buff, MAXLINE);
+            metric_add(NET_SYS_READ, 1);
+            if (n == 0) { // The client exits
+                logger_msg(LOGGER_INFO, "Disconnected from client on \'%s\' at port \'%d\'\n", ip, cliaddr.port);
                 break;
             }
-            else if (n > 0) { // echo the message back to the client
-                if (write(connfd, buff, strlen(buff)) < 0)
+            else if (n > 0) { // echo the bytes back to the client as they came
+                metric_add(NET_BYTES_IN, n);
+                metric_add(NET_SYS_SEND, 1);
+                if (write(connfd, buff, n) < 0)
                     perror("write error");
+                else
+                    metric_add(NET_BYTES_OUT, n);
             }
-            else
+            else if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
                 perror("read error");
+                break;
+            }
         }
 
         close(connfd);
+        metric_add(NET_CONNECTIONS, -1);
+        metric_observe(sessions, now_ms() - start);
     }
+
+    logger_msg(LOGGER_INFO, "child %ld stopping\n", (long) getpid());
+    exit(0);
 }
 
-void
-sig_int(int signo)
+static void
+reap(struct reactor *r, int signo, void *arg)
+{
+    pid_t pid;
+    int   i;
+
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        for (i = 0; i < nchildren; i++) {
+            if (pids[i] == pid) {
+                pids[i] = 0;
+                live--;
+            }
+        }
+    }
+    if (draining && live == 0)
+        reactor_stop(r);
+}
+
+// the children still there at the deadline, and any that exited before the
+// parent watched for SIGCHLD
+static void
+kill_children(struct reactor *r, void *arg)
 {
     int i;
 
-    for (i = 0; i < nchildren; i++)
-        kill(pids[i], SIGTERM);
-    while (wait(NULL) > 0)
-        ;
+    for (i = 0; i < nchildren; i++) {
+        if (pids[i] > 0)
+            kill(pids[i], SIGKILL);
+    }
+    reap(r, SIGCHLD, NULL);
+}
 
-    if (errno != ECHILD)
-        perror("wait error");
+// stop the children, and the parent once they are gone
+static void
+drain(struct reactor *r)
+{
+    int i;
 
-    exit(0);
+    if (draining)
+        return;
+    draining = 1;
+
+    close(listenfd);
+    if (handofffd >= 0) {
+        reactor_remove(r, handofffd);
+        close(handofffd);
+    }
+    for (i = 0; i < nchildren; i++) {
+        if (pids[i] > 0)
+            kill(pids[i], SIGTERM);
+    }
+    reactor_timer(r, (DRAIN_SECONDS + LINGER_SECONDS + 1) * 1000LL, kill_children, NULL);
+    if (live == 0)
+        reactor_stop(r);
+}
+
+// when a user presses CTRL-C, or the server is told to stop
+static void
+stop(struct reactor *r, int signo, void *arg)
+{
+    drain(r);
+}
+
+// the new server accepts on the listen socket
+static void
+handed_over(struct reactor *r, void *arg)
+{
+    drain(r);
+}
+
+// a new server connected to the handoff socket to take over; the children
+// accept until it answers
+static void
+successor(struct reactor *r, int fd, int events, void *arg)
+{
+    handoff_give(r, fd, &listenfd, 1, handed_over, NULL);
 }
 
 int
 main(int argc, char **argv)
 {
-    int                listenfd, i;
-    socklen_t          addrlen;
-    struct sockaddr_in servaddr;
+    struct reactor     r;
+    const char         *path = getenv("HANDOFF_PATH");
+    int                i, n = 0, conn = -1;
 
     if (argc != 3) {
         perror("usage: echoserver <port> <children>");
         exit(0);
     }
 
-    // create a listen socket
-    if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("socket error");
+    // take the listen socket of the server this one replaces, if any, or
+    // create one; the clients give the port number as it is stored in the
+    // socket address
+    if (path != NULL && (n = handoff_take(path, &listenfd, 1, &conn)) < 0) {
+        perror("handoff error");
         exit(0);
     }
-
-    bzero(&servaddr, sizeof(servaddr));
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    servaddr.sin_port = atoi(argv[1]);
-
-    if (bind(listenfd, (struct sockaddr *) &servaddr, sizeof(servaddr)) < 0) {
+    if (n == 0 && (listenfd = tcp_listen(ntohs(atoi(argv[1])), NULL)) < 0) {
         perror("error in binding");
         exit(0);
     }
 
-    if (listen(listenfd, LISTENQ) < 0)
-        exit(0);
-
     nchildren = atoi(argv[2]);
     pids = calloc(nchildren, sizeof(pid_t));
 
+    // the metrics are set up before the children are, so that they count
+    // into memory the parent can read
+    sessions = metric_histogram("echo_session_seconds", "Time a client stays connected.", 1e-3);
+
     // create a lock file for all the children processes
     lock_init("/tmp/lock.XXXXXX");
     for (i = 0; i < nchildren; i++)
-        pids[i] = fork_child(i, listenfd, addrlen);
+        pids[i] = fork_child(i, listenfd);
+    live = nchildren;
 
-    // when a user presses CTRL-C
-    signal(SIGINT, sig_int);
+    if (metrics_start() < 0)
+        perror("metrics error");
+
+    // the parent waits for the signals and for a server to take over
+    if (reactor_init(&r, REACTOR_DEFAULT) < 0 || reactor_signal(&r, SIGINT, stop, NULL) < 0 ||
+        reactor_signal(&r, SIGTERM, stop, NULL) < 0 || reactor_signal(&r, SIGCHLD, reap, NULL) < 0) {
+        perror("reactor error");
+        exit(0);
+    }
+    handoff_ready(conn);
+    if (path != NULL &&
+        ((handofffd = handoff_listen(path)) < 0 || reactor_add(&r, handofffd, EV_READ, successor, NULL) < 0)) {
+        perror("handoff error");
+        exit(0);
+    }
 
-    // the rest of the program is processed by children and the parent can sleep
-    for ( ; ; )
-        pause();
+    reactor_run(&r);
+    exit(0);
 }
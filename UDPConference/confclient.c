@@ -10,9 +10,10 @@
 #include "utils.h"
 
 // global variables to be accessed by the signal handler
-char               sendbuff[MAXLINE];
-struct sockaddr_in servaddr;
-int                sockfd, n;
+char                    sendbuff[MAXLINE];
+struct sockaddr_storage servaddr;
+socklen_t               servlen;
+int                     sockfd, n;
 
 // This signal handler is used to catch a signal caused when the user types
 // CTRL-C to terminate the client. When this signal is catched, the client sends
@@ -22,7 +23,7 @@ terminate(int signo)
 {
     bzero(sendbuff, sizeof(sendbuff));
     strcpy(sendbuff, "LEAVE");
-    if ((n = sendto(sockfd, sendbuff, sizeof(sendbuff), 0, (struct sockaddr *) &servaddr, sizeof(servaddr))) < 0) {
+    if ((n = sendto(sockfd, sendbuff, sizeof(sendbuff), 0, (struct sockaddr *) &servaddr, servlen)) < 0) {
         perror("send error");
         exit(0);
     }
@@ -39,39 +40,18 @@ get_client_info(char *mesg)
     bzero(&cli, sizeof(cli));
     if (token != NULL) {
         token = strtok(NULL, " "); // the first token is either "JOIN" and "LEAVE" and therefore can be ignored
-        strcpy(cli.ipaddr, token);
+        addr_pton(&cli.addr, token, 0);
         token = strtok(NULL, " ");
-        cli.port = atoi(token);
+        cli.addr.port = atoi(token);
     }
 
     return cli;
 }
 
-// compare if the socket address of a client matches with a struct client
-int
-match(const struct client a, const struct sockaddr_in b)
-{
-    if ((strcmp(a.ipaddr, inet_ntoa(b.sin_addr)) == 0) && a.port == b.sin_port) {
-        return 0;
-    }
-
-    return 1;
-}
-
 // compare the two clients to check if they're the same
 int
 compare(struct client a, struct client b) {
-    int sameip = 0;
-    int sameport = 0;
-    if (strcmp(a.ipaddr, b.ipaddr) == 0) {
-        sameip = 1;
-    }
-
-    if (a.port == b.port) {
-        sameport = 1;
-    }
-
-    return sameip & sameport;
+    return addr_equal(&a.addr, &b.addr);
 }
 
 // parse and store the list of clients and their socket addresses that
@@ -85,9 +65,9 @@ populate_clients(char *mesg, struct client *clilist, int *max) {
         while (token != NULL) {
             token = strtok(mesg, " ");
             if (token != NULL) {
-                strcpy(clilist[index].ipaddr, token);
+                addr_pton(&clilist[index].addr, token, 0);
                 token = strtok(NULL, "\n");
-                clilist[index].port = atoi(token);
+                clilist[index].addr.port = atoi(token);
                 (*max)++;
             }
 
@@ -100,37 +80,42 @@ populate_clients(char *mesg, struct client *clilist, int *max) {
 int
 main(int argc, char **argv)
 {
-    int                maxfd, max, i, nready;
-    socklen_t          clilen, servlen;
-    struct sockaddr_in cliaddr;
-    fd_set             rset, allset;
-    char               recvbuff[MAXLINE];
-    struct client      others[FD_SETSIZE];
-    struct client      empty, tmpcli;
+    int                     maxfd, max, i, nready;
+    socklen_t               clilen;
+    struct sockaddr_storage cliaddr;
+    struct endpoint         server, from;
+    fd_set                  rset, allset;
+    char                    recvbuff[MAXLINE];
+    struct client           others[FD_SETSIZE];
+    struct client           empty, tmpcli;
 
     if (argc != 3) {
         perror("usage: confclient <servhost> <servport>");
         exit(0);
     }
 
-    if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
-        perror("socket error");
+    // argv[1] == IP address, IPv4 or IPv6
+    if (addr_pton(&server, argv[1], 0) == 0) {
+        printf("inet_pton error for %s", argv[1]);
         exit(0);
     }
-
-    bzero(&servaddr, sizeof(servaddr));
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_port = atoi(argv[2]);
-
-    if (inet_pton(AF_INET, argv[1], &servaddr.sin_addr) <= 0) {
-        printf("inet_pton error for %s", argv[1]); // argv[1] == IP address
+    server.port = atoi(argv[2]);
+
+    // an IPv6 socket reaches the clients of either family, the IPv4 ones
+    // through their mapped addresses; a host without IPv6 only has IPv4
+    if ((sockfd = socket(AF_INET6, SOCK_DGRAM, 0)) >= 0)
+        servlen = addr_to(&server, AF_INET6, &servaddr);
+    else if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) >= 0)
+        servlen = addr_to(&server, AF_INET, &servaddr);
+    if (sockfd < 0 || servlen == 0) {
+        perror("socket error");
         exit(0);
     }
 
     // request to join the conference
     bzero(sendbuff, sizeof(sendbuff));
     strcpy(sendbuff, "JOIN");
-    if ((n = sendto(sockfd, sendbuff, sizeof(sendbuff), 0, (struct sockaddr *) &servaddr, sizeof(servaddr))) < 0) {
+    if ((n = sendto(sockfd, sendbuff, sizeof(sendbuff), 0, (struct sockaddr *) &servaddr, servlen)) < 0) {
         perror("send error");
         exit(0);
     }
@@ -206,9 +191,10 @@ main(int argc, char **argv)
             // if a message is not a JOIN or LEAVE message, then it
             // should be a regular message coming from another client
             else {
+                addr_from(&from, (struct sockaddr *) &cliaddr);
                 for (i = 0; i <= max; i++) {
                     if (compare(others[i], empty) != 1) {
-                        if (match(others[i], cliaddr) == 0) {
+                        if (addr_equal(&others[i].addr, &from)) {
                             break;
                         }
                     }
@@ -224,12 +210,9 @@ main(int argc, char **argv)
             bzero(sendbuff, sizeof(sendbuff));
             if (fgets(sendbuff, MAXLINE, stdin) != NULL) {
                 for (i = 0; i <= max; i++) {
-                    if (compare(others[i], empty) != 1) {
-                        bzero(&cliaddr, sizeof(cliaddr));
-                        cliaddr.sin_family = AF_INET;
-                        cliaddr.sin_port = others[i].port;
-                        inet_pton(AF_INET, others[i].ipaddr, &cliaddr.sin_addr);
-                        clilen = sizeof(cliaddr);
+                    // a client the family of the socket cannot reach is skipped
+                    if (compare(others[i], empty) != 1 &&
+                        (clilen = addr_to(&others[i].addr, servaddr.ss_family, &cliaddr)) > 0) {
                         if ((n = sendto(sockfd, sendbuff, sizeof(sendbuff), 0, (struct sockaddr *) &cliaddr, clilen)) < 0) {
                             perror("send error");
                             exit(0);
@@ -240,7 +223,7 @@ main(int argc, char **argv)
             else { // when the user types CTRL-D to indicate EOF
                 bzero(sendbuff, sizeof(sendbuff));
                 strcpy(sendbuff, "LEAVE");
-                if ((n = sendto(sockfd, sendbuff, sizeof(sendbuff), 0, (struct sockaddr *) &servaddr, sizeof(servaddr))) < 0) {
+                if ((n = sendto(sockfd, sendbuff, sizeof(sendbuff), 0, (struct sockaddr *) &servaddr, servlen)) < 0) {
                     perror("send error");
                     exit(0);
                 }
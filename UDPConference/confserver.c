@@ -6,60 +6,50 @@
 // In this way, messages are sent directly between the clients. Similarly,
 // when a client exits, the server informs its existing clients to adjust their
 // contact list accordingly. Communication between the server and its clients
-// is through UDP datagram sockets.
+// is through UDP datagram sockets. A message goes out as a string with its
+// terminating null, not padded to the size of the buffer. With
+// METRICS_ENDPOINT set, the server also answers requests for its metrics
+// there.
 //
 // Author: Tien Ho
 // Date:   11/01/16
 //
 
 #include "utils.h"
-
-// compare if the socket address of a client matches with a struct client
-int
-match(const struct client a, const struct sockaddr_in b)
-{
-    if ((strcmp(a.ipaddr, inet_ntoa(b.sin_addr)) == 0) && a.port == b.sin_port) {
-        return 0;
-    }
-
-    return 1;
-}
+#include "listener.h"
+#include "logger.h"
+#include "metrics.h"
 
 int
 main(int argc, char **argv)
 {
-    int                sockfd, n, max, i;
-    socklen_t          clilen, addrlen;
-    struct sockaddr_in servaddr, localaddr, cliaddr, tmpaddr;
-    struct client      clients[FD_SETSIZE];
-    struct client      empty;
-    char               recvbuff[MAXLINE], sendbuff[MAXLINE], ipaddr[MAXCHAR];
+    int                     sockfd, n, len, max, i, joins, leaves, members;
+    socklen_t               clilen;
+    struct sockaddr_storage cliaddr, tmpaddr;
+    struct endpoint         from;
+    struct client           clients[FD_SETSIZE];
+    struct client           empty;
+    char                    recvbuff[MAXLINE], sendbuff[MAXLINE], ipaddr[ADDR_STRLEN];
 
 
-    if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
-        perror("socket error");
+    // create a datagram socket on any free port
+    if ((sockfd = udp_bind(0, 0)) < 0) {
+        perror("error in binding");
         exit(0);
     }
 
-    bzero(&servaddr, sizeof(servaddr));
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    servaddr.sin_port = 0;
+    // the clients take the port number as it is stored in the socket address
+    printf("Started server at port %u\n", htons(local_port(sockfd)));
+    fflush(stdout);
 
-    if (bind(sockfd, (struct sockaddr *) &servaddr, sizeof(servaddr)) < 0) {
-        perror("error in binding");
+    joins = metric_counter("udpconf_joins_total", "Clients that joined the conference.");
+    leaves = metric_counter("udpconf_leaves_total", "Clients that left the conference.");
+    members = metric_gauge("udpconf_members", "Clients in the conference.");
+    if (metrics_start() < 0) {
+        perror("metrics error");
         exit(0);
     }
 
-    // get the local protocol address
-    bzero(&localaddr, sizeof(localaddr));
-    addrlen = sizeof(localaddr);
-    if (getsockname(sockfd, (struct sockaddr *) &localaddr, &addrlen) < 0)
-        perror("socket name error");
-
-    printf("Started server at port %u\n", localaddr.sin_port);
-    fflush(stdout);
-
     // set all the client entries to 0
     for (i = 0; i < FD_SETSIZE; i++) {
         bzero(&clients[i], sizeof(clients[i]));
@@ -69,47 +59,47 @@ main(int argc, char **argv)
     bzero(&empty, sizeof(empty));
     for ( ; ; ) {
         clilen = sizeof(cliaddr);
-        bzero(recvbuff, sizeof(recvbuff));
-        if ((n = recvfrom(sockfd, recvbuff, MAXLINE, 0, (struct sockaddr *) &cliaddr, &clilen)) < 0) {
+        if ((n = recvfrom(sockfd, recvbuff, MAXLINE - 1, 0, (struct sockaddr *) &cliaddr, &clilen)) < 0) {
             perror("receive error");
             exit(0);
         }
+        recvbuff[n] = '\0';
+        addr_from(&from, (struct sockaddr *) &cliaddr);
 
         // a new client joins the conference
         if (strcmp(recvbuff, "JOIN") == 0) {
-            bzero(sendbuff, sizeof(sendbuff));
-            sprintf(sendbuff, "JOIN %s %u\n", inet_ntoa(cliaddr.sin_addr), cliaddr.sin_port);
-            fputs(sendbuff, stdout);
-            fflush(stdout);
+            len = sprintf(sendbuff, "JOIN %s %u\n", addr_ntop(&from, ipaddr, sizeof(ipaddr)), from.port) + 1;
+            logger_msg(LOGGER_INFO, "%s", sendbuff);
 
             // relay the JOIN message along with the new client's contact
             // to all other clients
             for (i = 0; i <= max; i++) {
                 if ((n = memcmp(&clients[i], &empty, sizeof(empty))) != 0) { // only sends active clients
-                    bzero(&tmpaddr, sizeof(tmpaddr));
-                    tmpaddr.sin_family = AF_INET;
-                    tmpaddr.sin_port = clients[i].port;
-                    inet_pton(AF_INET, clients[i].ipaddr, &tmpaddr.sin_addr);
-                    clilen = sizeof(tmpaddr);
+                    clilen = addr_to(&clients[i].addr, cliaddr.ss_family, &tmpaddr);
 
-                    if ((n = sendto(sockfd, sendbuff, sizeof(sendbuff), 0, (struct sockaddr *) &tmpaddr, clilen)) < 0) {
+                    if ((n = sendto(sockfd, sendbuff, len, 0, (struct sockaddr *) &tmpaddr, clilen)) < 0) {
                         perror("send error");
                         exit(0);
                     }
                 }
             }
 
-            // send a list of existing clients to the new client
-            bzero(sendbuff, sizeof(sendbuff));
-            char line[MAXLINE];
+            // send a list of existing clients to the new client, as many as
+            // fit into one message
+            len = 0;
+            sendbuff[0] = '\0';
             for (i = 0; i <= max; i++) {
                 if ((n = memcmp(&clients[i], &empty, sizeof(empty))) != 0) {
-                    bzero(line, sizeof(line));
-                    sprintf(line, "%s %u\n", clients[i].ipaddr, clients[i].port);
-                    strcat(sendbuff, line);
+                    n = snprintf(sendbuff + len, sizeof(sendbuff) - len, "%s %u\n",
+                                 addr_ntop(&clients[i].addr, ipaddr, sizeof(ipaddr)), clients[i].addr.port);
+                    if (len + n >= (int) sizeof(sendbuff)) {
+                        sendbuff[len] = '\0';
+                        break;
+                    }
+                    len += n;
                 }
             }
-            if ((n = sendto(sockfd, sendbuff, sizeof(sendbuff), 0, (struct sockaddr *) &cliaddr, clilen)) < 0) {
+            if ((n = sendto(sockfd, sendbuff, len + 1, 0, (struct sockaddr *) &cliaddr, clilen)) < 0) {
                 perror("send error");
                 exit(0);
             }
@@ -117,8 +107,7 @@ main(int argc, char **argv)
             // remember the new client
             for (i = 0; i < FD_SETSIZE; i++) {
                 if ((n = memcmp(&clients[i], &empty, sizeof(empty))) == 0) {
-                    strcpy(clients[i].ipaddr, inet_ntoa(cliaddr.sin_addr));
-                    clients[i].port = cliaddr.sin_port;
+                    clients[i].addr = from;
                     break;
                 }
             }
@@ -126,6 +115,8 @@ main(int argc, char **argv)
             if (i > max) {
                 max = i;
             }
+            metric_add(joins, 1);
+            metric_add(members, 1);
 
             if (i == FD_SETSIZE) {
                 perror("too many clients");
@@ -136,29 +127,25 @@ main(int argc, char **argv)
             // remove the client from the list
             for (i = 0; i <= max; i++) {
                 if ((n = memcmp(&clients[i], &empty, sizeof(empty))) != 0) {
-                    if (match(clients[i], cliaddr) == 0) {
+                    if (addr_equal(&clients[i].addr, &from)) {
                         bzero(&clients[i], sizeof(clients[i]));
+                        metric_add(members, -1);
                         break;
                     }
                 }
             }
 
-            bzero(sendbuff, sizeof(sendbuff));
-            sprintf(sendbuff, "LEAVE %s %u\n", inet_ntoa(cliaddr.sin_addr), cliaddr.sin_port);
-            fputs(sendbuff, stdout);
-            fflush(stdout);
+            metric_add(leaves, 1);
+            len = sprintf(sendbuff, "LEAVE %s %u\n", addr_ntop(&from, ipaddr, sizeof(ipaddr)), from.port) + 1;
+            logger_msg(LOGGER_INFO, "%s", sendbuff);
 
             // relay the LEAVE message along with the leaving client's contact
             // to all other clients
             for (i = 0; i <= max; i++) {
                 if ((n = memcmp(&clients[i], &empty, sizeof(empty))) != 0) {
-                    bzero(&tmpaddr, sizeof(tmpaddr));
-                    tmpaddr.sin_family = AF_INET;
-                    tmpaddr.sin_port = clients[i].port;
-                    inet_pton(AF_INET, clients[i].ipaddr, &tmpaddr.sin_addr);
-                    clilen = sizeof(tmpaddr);
+                    clilen = addr_to(&clients[i].addr, cliaddr.ss_family, &tmpaddr);
 
-                    if ((n = sendto(sockfd, sendbuff, sizeof(sendbuff), 0, (struct sockaddr *) &tmpaddr, clilen)) < 0) {
+                    if ((n = sendto(sockfd, sendbuff, len, 0, (struct sockaddr *) &tmpaddr, clilen)) < 0) {
                         perror("send error");
                         exit(0);
                     }
@@ -0,0 +1,192 @@
+//
+// The endpoints: the conversions between the binary form, the socket
+// addresses of either family and the text of the log and the wire.
+//
+// Author: Tien Ho
+// Date:   12/23/16
+//
+
+#include "addr.h"
+#include "net.h"
+
+static const unsigned char v4mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+// Set ep to the address and port of sa; an address of another family leaves
+// it unset.
+void
+addr_from(struct endpoint *ep, const struct sockaddr *sa)
+{
+    const struct sockaddr_in  *in = (const struct sockaddr_in *) sa;
+    const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *) sa;
+
+    bzero(ep, sizeof(*ep));
+    if (sa->sa_family == AF_INET) {
+        memcpy(ep->ip, v4mapped, sizeof(v4mapped));
+        memcpy(ep->ip + 12, &in->sin_addr, 4);
+        ep->port = in->sin_port;
+    }
+    else if (sa->sa_family == AF_INET6) {
+        memcpy(ep->ip, &in6->sin6_addr, 16);
+        ep->port = in6->sin6_port;
+    }
+}
+
+// The family the address belongs to: AF_INET for a mapped IPv4 address.
+int
+addr_family(const struct endpoint *ep)
+{
+    return memcmp(ep->ip, v4mapped, sizeof(v4mapped)) == 0 ? AF_INET : AF_INET6;
+}
+
+// Make the socket address of ep for a socket of family, or of its own family
+// if family is 0. An IPv6 socket reaches an IPv4 address through its mapped
+// form. Returns the length of the address, or 0 if an IPv4 socket cannot
+// reach it.
+socklen_t
+addr_to(const struct endpoint *ep, int family, struct sockaddr_storage *ss)
+{
+    struct sockaddr_in  *in = (struct sockaddr_in *) ss;
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *) ss;
+
+    if (family == 0)
+        family = addr_family(ep);
+
+    bzero(ss, sizeof(*ss));
+    if (family == AF_INET) {
+        if (addr_family(ep) != AF_INET)
+            return 0;
+        in->sin_family = AF_INET;
+        in->sin_port = ep->port;
+        memcpy(&in->sin_addr, ep->ip + 12, 4);
+        return sizeof(*in);
+    }
+
+    in6->sin6_family = AF_INET6;
+    in6->sin6_port = ep->port;
+    memcpy(&in6->sin6_addr, ep->ip, 16);
+    return sizeof(*in6);
+}
+
+// Whether no address was set.
+int
+addr_unset(const struct endpoint *ep)
+{
+    static const unsigned char zero[16];
+
+    return memcmp(ep->ip, zero, sizeof(zero)) == 0;
+}
+
+// Whether the address is one of the local host: 127.0.0.0/8 or ::1.
+int
+addr_loopback(const struct endpoint *ep)
+{
+    if (addr_family(ep) == AF_INET)
+        return ep->ip[12] == 127;
+
+    return IN6_IS_ADDR_LOOPBACK((const struct in6_addr *) ep->ip);
+}
+
+// Set ep to the address written in text, IPv4 or IPv6, and to port (in host
+// byte order). Returns 1, or 0 if text is not an address.
+int
+addr_pton(struct endpoint *ep, const char *text, int port)
+{
+    bzero(ep, sizeof(*ep));
+    if (inet_pton(AF_INET, text, ep->ip + 12) == 1)
+        memcpy(ep->ip, v4mapped, sizeof(v4mapped));
+    else if (inet_pton(AF_INET6, text, ep->ip) != 1)
+        return 0;
+    ep->port = htons(port);
+
+    return 1;
+}
+
+// Write the address of ep as text into buf, which holds ADDR_STRLEN bytes,
+// in the dotted form for IPv4. Returns buf.
+char *
+addr_ntop(const struct endpoint *ep, char *buf, size_t len)
+{
+    if (addr_family(ep) == AF_INET)
+        inet_ntop(AF_INET, ep->ip + 12, buf, len);
+    else
+        inet_ntop(AF_INET6, ep->ip, buf, len);
+
+    return buf;
+}
+
+// Write ep as "address:port", with the IPv6 address in brackets, into buf,
+// which holds ADDR_NAMELEN bytes. Returns the length, as snprintf.
+int
+addr_format(const struct endpoint *ep, char *buf, size_t len)
+{
+    char ip[ADDR_STRLEN];
+
+    addr_ntop(ep, ip, sizeof(ip));
+    if (addr_family(ep) == AF_INET)
+        return snprintf(buf, len, "%s:%u", ip, ntohs(ep->port));
+
+    return snprintf(buf, len, "[%s]:%u", ip, ntohs(ep->port));
+}
+
+// Read an endpoint written by addr_format at the start of text. Returns the
+// first character after the port, or NULL if text does not start with an
+// endpoint.
+const char *
+addr_scan(const char *text, struct endpoint *ep)
+{
+    char       ip[ADDR_STRLEN];
+    const char *end;
+    long       port = 0;
+    size_t     len;
+
+    if (text[0] == '[') {
+        if ((end = strchr(++text, ']')) == NULL || end[1] != ':')
+            return NULL;
+        len = end++ - text;
+    }
+    else {
+        if ((end = strchr(text, ':')) == NULL)
+            return NULL;
+        len = end - text;
+    }
+    if (len == 0 || len >= sizeof(ip) || end[1] < '0' || end[1] > '9')
+        return NULL;
+    memcpy(ip, text, len);
+    ip[len] = '\0';
+
+    for (end++; *end >= '0' && *end <= '9' && port <= 65535; end++)
+        port = port * 10 + *end - '0';
+    if (port > 65535 || !addr_pton(ep, ip, (int) port))
+        return NULL;
+
+    return end;
+}
+
+// Set ep to the local address of the socket fd. Returns -1 on error.
+int
+addr_local(int fd, struct endpoint *ep)
+{
+    struct sockaddr_storage ss;
+    socklen_t               len = sizeof(ss);
+
+    if (getsockname(fd, (struct sockaddr *) &ss, &len) < 0)
+        return -1;
+    addr_from(ep, (struct sockaddr *) &ss);
+
+    return 0;
+}
+
+// Set ep to the address of the other end of the socket fd. Returns -1 on
+// error.
+int
+addr_peer(int fd, struct endpoint *ep)
+{
+    struct sockaddr_storage ss;
+    socklen_t               len = sizeof(ss);
+
+    if (getpeername(fd, (struct sockaddr *) &ss, &len) < 0)
+        return -1;
+    addr_from(ep, (struct sockaddr *) &ss);
+
+    return 0;
+}
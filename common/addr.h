@@ -0,0 +1,43 @@
+//
+// The header file for the addresses of the programs. An endpoint is an
+// address and a port in binary, the same for IPv4 and IPv6: an IPv4 address
+// is kept mapped into IPv6 (::ffff:a.b.c.d), which is also how a dual-stack
+// socket reports its IPv4 clients. Endpoints are compared and hashed as
+// plain bytes, so the programs match the senders of their messages without
+// formatting or comparing any text; text is only made for the log and the
+// wire.
+//
+// Author: Tien Ho
+// Date: 12/23/16.
+//
+
+#ifndef ADDR_H
+#define ADDR_H
+
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define ADDR_STRLEN     INET6_ADDRSTRLEN        /* an address as text */
+#define ADDR_NAMELEN    (ADDR_STRLEN + 8)       /* "[address]:port" */
+
+struct endpoint {
+    unsigned char  ip[16];      /* IPv6, or IPv4 mapped into it; all zero if unset */
+    unsigned short port;        /* in network byte order, as in a socket address */
+};
+
+#define addr_equal(a, b)    (memcmp((a), (b), sizeof(struct endpoint)) == 0)
+
+void       addr_from(struct endpoint *ep, const struct sockaddr *sa);
+socklen_t  addr_to(const struct endpoint *ep, int family, struct sockaddr_storage *ss);
+int        addr_family(const struct endpoint *ep);
+int        addr_unset(const struct endpoint *ep);
+int        addr_loopback(const struct endpoint *ep);
+int        addr_pton(struct endpoint *ep, const char *text, int port);
+char       *addr_ntop(const struct endpoint *ep, char *buf, size_t len);
+int        addr_format(const struct endpoint *ep, char *buf, size_t len);
+const char *addr_scan(const char *text, struct endpoint *ep);
+int        addr_local(int fd, struct endpoint *ep);
+int        addr_peer(int fd, struct endpoint *ep);
+
+#endif //ADDR_H
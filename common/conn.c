@@ -0,0 +1,430 @@
+//
+// The buffered connections. The input buffer is allocated once per
+// connection; the output buffer only when a write does not go out at once,
+// which on a healthy connection is almost never. The connections and their
+// buffers come from the pool, so a connection costs a 4 KB input chunk and
+// no calls to malloc once the server has warmed up. The reactor waits for a
+// connection to be writable only while it has output queued.
+//
+// A handler may close its own connection or another one. A connection
+// closed while its handlers are running is only freed when they return.
+//
+// On io_uring, a connection has a multishot receive running all the time
+// and at most one send. What is written while a send is in flight collects
+// in the output buffer and goes with the next send, so the buffer the kernel
+// sends from never moves. A closed connection is freed once the kernel is
+// done with both.
+//
+// Author: Tien Ho
+// Date:   12/17/16
+//
+
+#include "conn.h"
+#include "listener.h"
+#include "metrics.h"
+#include "pool.h"
+#include <stddef.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+static void conn_io(struct reactor *r, int fd, int events, void *arg);
+static void received(struct reactor *r, struct uring_op *op, int res, unsigned flags);
+static void sent(struct reactor *r, struct uring_op *op, int res, unsigned flags);
+
+// Wrap a connected socket. The socket is made nonblocking and read from as
+// soon as it has data. Returns NULL if the connection cannot be waited on, in
+// which case the socket is left to the caller.
+struct conn *
+conn_new(struct reactor *r, int fd, conn_cb on_read, conn_cb on_close, void *arg)
+{
+    struct conn *c;
+
+    if ((c = pool_zalloc(sizeof(struct conn))) == NULL)
+        return NULL;
+    c->recvop.done = received;
+    c->sendop.done = sent;
+    if ((c->in.data = pool_alloc(CONN_INSIZE)) == NULL || set_nonblock(fd) < 0) {
+        pool_free(c->in.data, CONN_INSIZE);
+        pool_free(c, sizeof(struct conn));
+        return NULL;
+    }
+    // the socket is polled if the ring cannot receive
+    if (r->backend == REACTOR_URING && uring_recv(r, fd, &c->recvop) == 0) {
+        c->uring = 1;
+        c->ops = 1;
+    }
+    else if (reactor_add(r, fd, EV_READ, conn_io, c) < 0) {
+        pool_free(c->in.data, CONN_INSIZE);
+        pool_free(c, sizeof(struct conn));
+        return NULL;
+    }
+
+    c->in.cap = pool_size(CONN_INSIZE);
+    c->fd = fd;
+    c->r = r;
+    c->on_read = on_read;
+    c->on_close = on_close;
+    c->arg = arg;
+    addr_peer(fd, &c->addr);
+    metric_add(NET_CONNECTIONS, 1);
+
+    return c;
+}
+
+static void
+conn_free(struct conn *c)
+{
+    metric_add(NET_QUEUED, -(long long) (c->out.len + c->sending.len));
+    pool_free(c->in.data, c->in.cap);
+    pool_free(c->out.data, c->out.cap);
+    pool_free(c->sending.data, c->sending.cap);
+    pool_free(c, sizeof(struct conn));
+}
+
+// Close the connection now, dropping the output not yet written.
+void
+conn_close(struct conn *c)
+{
+    if (c->closed)
+        return;
+
+    c->closed = 1;
+    metric_add(NET_CONNECTIONS, -1);
+    c->busy++;
+    if (c->on_close != NULL)
+        c->on_close(c);
+    c->busy--;
+
+    // a send in flight finishes on its own; the socket goes when the
+    // kernel lets go of it
+    if (c->uring)
+        uring_cancel(c->r, &c->recvop);
+    reactor_remove(c->r, c->fd);
+    close(c->fd);
+    if (c->busy == 0 && c->ops == 0)
+        conn_free(c);
+}
+
+// Close the connection once its output is written. The connection reads no
+// more in the meantime.
+void
+conn_finish(struct conn *c)
+{
+    if (c->closed)
+        return;
+
+    if (c->out.len == 0 && c->sending.len == 0) {
+        conn_close(c);
+        return;
+    }
+    c->finishing = 1;
+    if (!c->uring)
+        reactor_modify(c->r, c->fd, EV_WRITE);
+}
+
+// write as much of the output buffer as the socket takes
+static int
+flush(struct conn *c)
+{
+    ssize_t n;
+
+    while (c->out.len > 0) {
+        metric_add(NET_SYS_SEND, 1);
+        if ((n = send(c->fd, c->out.data + c->out.off, c->out.len, MSG_NOSIGNAL)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        metric_add(NET_BYTES_OUT, n);
+        metric_add(NET_QUEUED, -n);
+        c->out.off += n;
+        c->out.len -= n;
+    }
+    c->out.off = 0;
+
+    return 0;
+}
+
+// give an empty buffer back to the pool
+static void
+release(struct buffer *b)
+{
+    pool_free(b->data, b->cap);
+    bzero(b, sizeof(*b));
+}
+
+// make room for len more bytes at the end of a buffer
+static int
+reserve(struct buffer *b, size_t len)
+{
+    char   *data;
+    size_t cap;
+
+    if (b->off > 0 && b->off + b->len + len > b->cap) {
+        memmove(b->data, b->data + b->off, b->len);
+        b->off = 0;
+    }
+    if (b->len + len <= b->cap)
+        return 0;
+
+    // the buffer at least doubles, to a 2, 4 or 16 KB chunk while it fits
+    cap = pool_size(max(max(b->len + len, 2 * b->cap), CONN_MINOUT));
+    if ((data = pool_alloc(cap)) == NULL)
+        return -1;
+    if (b->len > 0)
+        memcpy(data, b->data + b->off, b->len);
+    pool_free(b->data, b->cap);
+    b->data = data;
+    b->off = 0;
+    b->cap = cap;
+
+    return 0;
+}
+
+// Start sending the queued output through the ring, unless a send is in
+// flight already. Returns -1 if the send cannot be submitted.
+static int
+send_more(struct conn *c)
+{
+    struct buffer b;
+
+    if (c->sending.len == 0) {
+        if (c->out.len == 0)
+            return 0;
+        b = c->sending;
+        c->sending = c->out;
+        c->out = b;
+    }
+    if (uring_send(c->r, c->fd, c->sending.data + c->sending.off, c->sending.len, &c->sendop) < 0)
+        return -1;
+    c->ops++;
+
+    return 0;
+}
+
+// Send data on the connection, or queue what the socket does not take. A
+// client that lets more than CONN_MAXOUT bytes pile up is too slow to keep
+// and is closed. Returns -1 if the connection is closed.
+int
+conn_write(struct conn *c, const void *data, size_t len)
+{
+    ssize_t n = 0;
+
+    if (c->closed || c->finishing)
+        return -1;
+
+    // the data goes with the next wait of the reactor
+    if (c->uring) {
+        if (c->out.len + c->sending.len + len > CONN_MAXOUT || reserve(&c->out, len) < 0) {
+            metric_add(NET_DROPPED, 1);
+            conn_close(c);
+            return -1;
+        }
+        memcpy(c->out.data + c->out.off + c->out.len, data, len);
+        c->out.len += len;
+        metric_add(NET_QUEUED, len);
+        if (c->sending.len == 0 && send_more(c) < 0) {
+            conn_close(c);
+            return -1;
+        }
+        return 0;
+    }
+
+    // nothing is queued, so the data may go out directly
+    if (c->out.len == 0) {
+        do {
+            metric_add(NET_SYS_SEND, 1);
+        } while ((n = send(c->fd, data, len, MSG_NOSIGNAL)) < 0 && errno == EINTR);
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            conn_close(c);
+            return -1;
+        }
+        n = max(n, 0);
+        metric_add(NET_BYTES_OUT, n);
+        if ((size_t) n == len)
+            return 0;
+    }
+
+    len -= n;
+    if (c->out.len + len > CONN_MAXOUT || reserve(&c->out, len) < 0) {
+        metric_add(NET_DROPPED, 1);
+        conn_close(c);
+        return -1;
+    }
+    memcpy(c->out.data + c->out.off + c->out.len, (const char *) data + n, len);
+    c->out.len += len;
+    metric_add(NET_QUEUED, len);
+    reactor_modify(c->r, c->fd, EV_READ | EV_WRITE);
+
+    return 0;
+}
+
+// Take the next line of the input, with its newline, into line. A line that
+// does not fit into the input buffer is cut. Returns the length of the line,
+// or 0 if no complete line has arrived, in which case the start of the line
+// is moved to the front of the buffer to make room for the rest.
+int
+conn_getline(struct conn *c, char *line, size_t size)
+{
+    char   *start = c->in.data + c->in.off;
+    char   *newline;
+    size_t len;
+
+    if ((newline = memchr(start, '\n', c->in.len)) != NULL)
+        len = newline - start + 1;
+    else if (c->in.len == c->in.cap)
+        len = c->in.len;
+    else {
+        if (c->in.off > 0) {
+            memmove(c->in.data, start, c->in.len);
+            c->in.off = 0;
+        }
+        return 0;
+    }
+
+    len = min(len, size - 1);
+    memcpy(line, start, len);
+    line[len] = '\0';
+    conn_consume(c, len);
+
+    return len;
+}
+
+// drop the first n bytes of the input
+void
+conn_consume(struct conn *c, size_t n)
+{
+    c->in.off += n;
+    c->in.len -= n;
+    if (c->in.len == 0)
+        c->in.off = 0;
+}
+
+static void
+conn_io(struct reactor *r, int fd, int events, void *arg)
+{
+    struct conn *c = arg;
+    ssize_t     n;
+
+    c->busy++;
+    if ((events & EV_WRITE) && !c->closed) {
+        if (flush(c) < 0)
+            conn_close(c);
+        else if (c->out.len == 0 && c->finishing)
+            conn_close(c);
+        else if (c->out.len == 0) {
+            release(&c->out);
+            reactor_modify(r, fd, EV_READ);
+        }
+    }
+
+    if ((events & EV_READ) && !c->closed && !c->finishing) {
+        // the bytes left over are moved to the front to make room
+        if (c->in.off > 0 && c->in.off + c->in.len == c->in.cap) {
+            memmove(c->in.data, c->in.data + c->in.off, c->in.len);
+            c->in.off = 0;
+        }
+        n = read(fd, c->in.data + c->in.off + c->in.len, c->in.cap - c->in.off - c->in.len);
+        metric_add(NET_SYS_READ, 1);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            conn_close(c);
+        }
+        else if (n > 0) {
+            metric_add(NET_BYTES_IN, n);
+            c->in.len += n;
+            c->on_read(c);
+        }
+    }
+    c->busy--;
+
+    if (c->closed && c->busy == 0)
+        conn_free(c);
+}
+
+// Give the bytes a receive brought to the program, as many at a time as the
+// input buffer takes. A program that leaves the buffer full is not reading
+// and loses the connection, as with the other backends.
+static void
+deliver(struct conn *c, const char *data, size_t n)
+{
+    size_t room;
+
+    while (n > 0 && !c->closed && !c->finishing) {
+        if (c->in.off > 0 && c->in.off + c->in.len == c->in.cap) {
+            memmove(c->in.data, c->in.data + c->in.off, c->in.len);
+            c->in.off = 0;
+        }
+        if ((room = c->in.cap - c->in.off - c->in.len) == 0) {
+            conn_close(c);
+            return;
+        }
+        room = min(room, n);
+        memcpy(c->in.data + c->in.off + c->in.len, data, room);
+        c->in.len += room;
+        data += room;
+        n -= room;
+        c->on_read(c);
+    }
+}
+
+static void
+received(struct reactor *r, struct uring_op *op, int res, unsigned flags)
+{
+    struct conn *c = (struct conn *) ((char *) op - offsetof(struct conn, recvop));
+
+    c->busy++;
+    if (!(flags & URING_MORE))
+        c->ops--;
+    if (res > 0) {
+        metric_add(NET_BYTES_IN, res);
+        deliver(c, uring_buffer(r, flags), res);
+        uring_recycle(r, flags);
+    }
+
+    // the receive ends with the input, on an error, or when the reactor ran
+    // out of buffers for a moment
+    if (!(flags & URING_MORE) && !c->closed) {
+        if (res == 0 || (res < 0 && res != -ENOBUFS) || uring_recv(r, c->fd, op) < 0)
+            conn_close(c);
+        else
+            c->ops++;
+    }
+    c->busy--;
+
+    if (c->closed && c->busy == 0 && c->ops == 0)
+        conn_free(c);
+}
+
+static void
+sent(struct reactor *r, struct uring_op *op, int res, unsigned flags)
+{
+    struct conn *c = (struct conn *) ((char *) op - offsetof(struct conn, sendop));
+
+    c->busy++;
+    c->ops--;
+    if (!c->closed) {
+        if (res < 0) {
+            conn_close(c);
+        }
+        else {
+            metric_add(NET_BYTES_OUT, res);
+            metric_add(NET_QUEUED, -res);
+            c->sending.off += res;
+            c->sending.len -= res;
+            if (c->sending.len == 0)
+                c->sending.off = 0;
+            if (send_more(c) < 0 || (c->finishing && c->sending.len == 0))
+                conn_close(c);
+            else if (c->sending.len == 0) {
+                release(&c->sending);
+                release(&c->out);
+            }
+        }
+    }
+    c->busy--;
+
+    if (c->closed && c->busy == 0 && c->ops == 0)
+        conn_free(c);
+}
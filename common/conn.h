@@ -0,0 +1,62 @@
+//
+// The header file for the buffered connections of the servers. A connection
+// reads whatever its descriptor has into its input buffer and tells its
+// program, which takes the bytes or lines it can use. What the program writes
+// goes out at once as far as the socket takes it, and the rest is kept in the
+// output buffer and written as the socket drains, so that a slow client never
+// blocks the loop serving the others. On the io_uring backend the kernel
+// receives into the buffers of the reactor and sends from the output buffer
+// without being asked each time.
+//
+// Author: Tien Ho
+// Date: 12/17/16.
+//
+
+#ifndef CONN_H
+#define CONN_H
+
+#include "addr.h"
+#include "reactor.h"
+#include "uring.h"
+
+#define CONN_INSIZE   MAXLINE         /* bytes read but not yet taken */
+#define CONN_MINOUT   2048            /* the first output buffer */
+#define CONN_MAXOUT   (1 << 20)       /* bytes queued for a slow client */
+
+struct buffer {
+    char   *data;
+    size_t off;                 /* the bytes are data[off .. off + len) */
+    size_t len;
+    size_t cap;
+};
+
+struct conn;
+
+typedef void (*conn_cb)(struct conn *c);
+
+struct conn {
+    int                fd;
+    struct reactor     *r;
+    struct buffer      in, out;
+    struct endpoint    addr;        /* the address of the other end */
+    conn_cb            on_read;     /* new bytes are in the input buffer */
+    conn_cb            on_close;    /* the connection is about to go */
+    void               *arg;
+    int                busy;        /* its handlers are running */
+    int                closed;
+    int                finishing;   /* close once the output is written */
+    int                uring;       /* it runs on io_uring operations */
+    int                ops;         /* io_uring: operations not finished */
+    struct uring_op    recvop;      /* io_uring: the multishot receive */
+    struct uring_op    sendop;
+    struct buffer      sending;     /* io_uring: the output being sent */
+};
+
+struct conn *conn_new(struct reactor *r, int fd, conn_cb on_read, conn_cb on_close, void *arg);
+int         conn_write(struct conn *c, const void *data, size_t len);
+int         conn_getline(struct conn *c, char *line, size_t size);
+void        conn_consume(struct conn *c, size_t n);
+void        conn_finish(struct conn *c);
+void        conn_close(struct conn *c);
+
+#endif //CONN_H
@@ -0,0 +1,297 @@
+//
+// The handoff of the listen sockets. The old process sends the descriptors
+// with SCM_RIGHTS, HANDOFF_BATCH at a time, each message carrying one byte
+// that tells whether more follow. The endpoint of the metrics, if the old
+// process has one, goes first in a message of its own, so that the new
+// process serves the metrics on the same socket instead of sharing the port.
+// The new process answers with one byte once it accepts on them; until then
+// the old one keeps serving, metrics included, waiting for the answer in its
+// reactor, so a new process that fails to start costs nothing.
+//
+// Author: Tien Ho
+// Date:   12/22/16
+//
+
+#include "handoff.h"
+#include "metrics.h"
+#include "net.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define MORE    'M'
+#define LAST    'L'
+#define READY   'R'
+#define METRICS 'P'
+
+union control {
+    struct cmsghdr hdr;
+    char           buf[CMSG_SPACE(sizeof(int) * HANDOFF_BATCH)];
+};
+
+static int
+unix_addr(const char *path, struct sockaddr_un *un)
+{
+    if (strlen(path) >= sizeof(un->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    bzero(un, sizeof(*un));
+    un->sun_family = AF_UNIX;
+    strcpy(un->sun_path, path);
+
+    return 0;
+}
+
+// a blocking socket of the new process that gives up on the old one after
+// HANDOFF_TIMEOUT
+static void
+set_timeout(int fd)
+{
+    struct timeval tv;
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+    tv.tv_sec = HANDOFF_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+// Receive one message of descriptors into fds, closing the ones beyond
+// maxfds; the one of a METRICS message goes to the metrics instead. Returns
+// its tag, or -1 on error.
+static int
+recv_batch(int conn, int *fds, int *nfds, int maxfds)
+{
+    union control  control;
+    struct msghdr  msg;
+    struct iovec   iov;
+    struct cmsghdr *cmsg;
+    int            *in, i, n, mfd = -1, nm = 0;
+    char           tag;
+
+    bzero(&msg, sizeof(msg));
+    iov.iov_base = &tag;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    if ((n = recvmsg(conn, &msg, 0)) <= 0) {
+        if (n == 0)
+            errno = ECONNRESET;
+        return -1;
+    }
+    if (tag == METRICS) {
+        fds = &mfd;
+        nfds = &nm;
+        maxfds = 1;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        in = (int *) CMSG_DATA(cmsg);
+        n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (i = 0; i < n; i++) {
+            if (*nfds < maxfds)
+                fds[(*nfds)++] = in[i];
+            else
+                close(in[i]);
+        }
+    }
+    if (mfd >= 0)
+        metrics_adopt(mfd);
+
+    return tag;
+}
+
+// Take the listen sockets of the process serving at path, the one this
+// process replaces, into fds. Returns their number, 0 if no process serves
+// there, or -1 on error. A process that got sockets calls handoff_ready with
+// *conn once it accepts on them.
+int
+handoff_take(const char *path, int *fds, int maxfds, int *conn)
+{
+    struct sockaddr_un un;
+    int                fd, nfds = 0, tag;
+
+    *conn = -1;
+    if (unix_addr(path, &un) < 0 || (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *) &un, sizeof(un)) < 0) {
+        close(fd);
+        return errno == ENOENT || errno == ECONNREFUSED ? 0 : -1;
+    }
+
+    set_timeout(fd);
+    do {
+        if ((tag = recv_batch(fd, fds, &nfds, maxfds)) < 0) {
+            while (nfds > 0)
+                close(fds[--nfds]);
+            close(fd);
+            return -1;
+        }
+    } while (tag == MORE || tag == METRICS);
+
+    *conn = fd;
+    return nfds;
+}
+
+// Tell the old process that this one serves, so that it lets its clients go.
+void
+handoff_ready(int conn)
+{
+    char c = READY;
+
+    if (conn < 0)
+        return;
+    if (send(conn, &c, 1, MSG_NOSIGNAL) != 1)
+        perror("handoff error");
+    close(conn);
+}
+
+// Listen at path for the process that will replace this one. The socket is
+// only for the user of the server, since whoever connects gets the listen
+// sockets. Returns the nonblocking socket, or -1 on error.
+int
+handoff_listen(const char *path)
+{
+    struct sockaddr_un un;
+    int                fd;
+
+    if (unix_addr(path, &un) < 0 || (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &un, sizeof(un)) < 0 || chmod(path, S_IRUSR | S_IWUSR) < 0 ||
+        listen(fd, 1) < 0 || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) < 0) {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    return fd;
+}
+
+// the handoff in progress: the new process has the sockets and the old one
+// waits for it to serve on them
+static struct {
+    int        conn;            /* -1 if no handoff is in progress */
+    int        timer;
+    handoff_cb cb;
+    void       *arg;
+} giving = { -1 };
+
+// end the handoff in progress, and call back if the new process took over
+static void
+give_end(struct reactor *r, int ready)
+{
+    handoff_cb cb = giving.cb;
+
+    reactor_remove(r, giving.conn);
+    close(giving.conn);
+    giving.conn = -1;
+    if (ready) {
+        metrics_release();
+        cb(r, giving.arg);
+    }
+}
+
+// the new process answered, or went away
+static void
+give_answer(struct reactor *r, int fd, int events, void *arg)
+{
+    ssize_t n;
+    char    tag;
+
+    if ((n = read(fd, &tag, 1)) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+    reactor_cancel(r, giving.timer);
+    give_end(r, n == 1 && tag == READY);
+}
+
+// the new process took too long to serve
+static void
+give_timeout(struct reactor *r, void *arg)
+{
+    give_end(r, 0);
+}
+
+// Send one message of n descriptors with its tag. Returns -1 on error.
+static int
+send_batch(int conn, const int *fds, int n, char tag)
+{
+    union control  control;
+    struct msghdr  msg;
+    struct iovec   iov;
+    struct cmsghdr *cmsg;
+
+    bzero(&msg, sizeof(msg));
+    iov.iov_base = &tag;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (n > 0) {
+        bzero(&control, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n);
+    }
+
+    return sendmsg(conn, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+// Hand the sockets fds to the process that connected to the handoff socket
+// listenfd. The sockets are sent without blocking, and the answer of the new
+// process is waited for in the reactor, so that this process goes on serving
+// meanwhile; cb is called once the new process serves on them, when this one
+// should stop accepting. Returns -1 if the sockets could not be sent.
+int
+handoff_give(struct reactor *r, int listenfd, const int *fds, int nfds, handoff_cb cb, void *arg)
+{
+    int  conn, n, mfd, sent = 0;
+    char tag;
+
+    if ((conn = accept(listenfd, NULL, NULL)) < 0)
+        return -1;
+    // one new process at a time
+    if (giving.conn >= 0 || fcntl(conn, F_SETFL, fcntl(conn, F_GETFL, 0) | O_NONBLOCK) < 0)
+        goto error;
+
+    // the few bytes of the messages fit into the empty socket buffer
+    if ((mfd = metrics_socket()) >= 0 && send_batch(conn, &mfd, 1, METRICS) < 0)
+        goto error;
+    do {
+        n = min(nfds - sent, HANDOFF_BATCH);
+        tag = sent + n < nfds ? MORE : LAST;
+        if (send_batch(conn, fds + sent, n, tag) < 0)
+            goto error;
+        sent += n;
+    } while (tag == MORE);
+
+    if (reactor_add(r, conn, EV_READ, give_answer, NULL) < 0)
+        goto error;
+    if ((giving.timer = reactor_timer(r, HANDOFF_TIMEOUT * 1000LL, give_timeout, NULL)) < 0) {
+        reactor_remove(r, conn);
+        goto error;
+    }
+    giving.conn = conn;
+    giving.cb = cb;
+    giving.arg = arg;
+    return 0;
+
+error:
+    close(conn);
+    return -1;
+}
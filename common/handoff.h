@@ -0,0 +1,30 @@
+//
+// The header file for the handoff of the listen sockets of a server to the
+// process that replaces it. A server that is given a handoff path listens on
+// it as a Unix socket; a new copy of the server started with the same path
+// connects to it first, receives the listen sockets of the old one and tells
+// it when it serves on them, at which point the old one stops accepting and
+// lets its clients go. The clients waiting in the backlog are not lost, and
+// the port is never closed, so a restart causes no refused connections.
+//
+// Author: Tien Ho
+// Date: 12/22/16.
+//
+
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include "reactor.h"
+
+#define HANDOFF_BATCH     64    /* descriptors sent in one message */
+#define HANDOFF_TIMEOUT   5     /* seconds either side waits for the other */
+
+// called once the new process serves on the sockets it was given
+typedef void (*handoff_cb)(struct reactor *r, void *arg);
+
+int  handoff_take(const char *path, int *fds, int maxfds, int *conn);
+void handoff_ready(int conn);
+int  handoff_listen(const char *path);
+int  handoff_give(struct reactor *r, int listenfd, const int *fds, int nfds, handoff_cb cb, void *arg);
+
+#endif //HANDOFF_H
@@ -0,0 +1,277 @@
+//
+// The listener helpers. A listen socket handed to the reactor is made
+// nonblocking and, whenever it is readable, accepted from until it has no
+// client left, so that a burst of clients costs one wakeup. With io_uring,
+// a multishot accept hands over the clients without any wakeup at all.
+//
+// Author: Tien Ho
+// Date:   12/17/16
+//
+
+#define _GNU_SOURCE     /* accept4 */
+#include "listener.h"
+#include "metrics.h"
+#include "uring.h"
+#include <fcntl.h>
+#include <netinet/tcp.h>
+
+struct listener {
+    struct uring_op op;         /* the multishot accept, with io_uring */
+    accept_cb       cb;
+    void            *arg;
+    int             fd;
+    int             nonblock;
+    int             accepted;   /* the accept has worked once */
+    int             uring;      /* the multishot accept is pending */
+    int             removed;    /* freed by the last completion of the accept */
+};
+
+int
+set_nonblock(int fd)
+{
+    int flags;
+
+    if ((flags = fcntl(fd, F_GETFL, 0)) < 0)
+        return -1;
+
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Open a socket of type for every local address and set ss to the address
+// of port (in host byte order) of all of them. The socket is IPv6 and takes
+// the IPv4 clients as well, as mapped addresses, unless the host has no IPv6.
+static int
+any_socket(int type, int port, struct sockaddr_storage *ss, socklen_t *len)
+{
+    struct sockaddr_in  *in = (struct sockaddr_in *) ss;
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *) ss;
+    int                 fd, off = 0;
+
+    bzero(ss, sizeof(*ss));
+    if ((fd = socket(AF_INET6, type, 0)) >= 0) {
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+        in6->sin6_family = AF_INET6;
+        in6->sin6_addr = in6addr_any;
+        in6->sin6_port = htons(port);
+        *len = sizeof(*in6);
+        return fd;
+    }
+    if (errno != EAFNOSUPPORT || (fd = socket(AF_INET, type, 0)) < 0)
+        return -1;
+
+    in->sin_family = AF_INET;
+    in->sin_addr.s_addr = htonl(INADDR_ANY);
+    in->sin_port = htons(port);
+    *len = sizeof(*in);
+    return fd;
+}
+
+// Create a TCP socket listening on port (in host byte order; 0 for any port)
+// of every local address, IPv4 and IPv6. Returns -1 on error.
+int
+tcp_listen(int port, const struct listenopts *opts)
+{
+    struct listenopts       none;
+    struct sockaddr_storage servaddr;
+    socklen_t               len;
+    int                     listenfd, on = 1;
+
+    if (opts == NULL) {
+        bzero(&none, sizeof(none));
+        opts = &none;
+    }
+
+    if ((listenfd = any_socket(SOCK_STREAM, port, &servaddr, &len)) < 0)
+        return -1;
+
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+#ifdef SO_REUSEPORT
+    if (opts->reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+        goto error;
+#endif
+#ifdef TCP_DEFER_ACCEPT
+    if (opts->deferaccept > 0 &&
+        setsockopt(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &opts->deferaccept, sizeof(opts->deferaccept)) < 0)
+        goto error;
+#endif
+#ifdef TCP_FASTOPEN
+    if (opts->fastopen > 0 &&
+        setsockopt(listenfd, IPPROTO_TCP, TCP_FASTOPEN, &opts->fastopen, sizeof(opts->fastopen)) < 0)
+        goto error;
+#endif
+
+    if (bind(listenfd, (struct sockaddr *) &servaddr, len) < 0 ||
+        listen(listenfd, opts->backlog > 0 ? opts->backlog : LISTENQ) < 0)
+        goto error;
+
+    return listenfd;
+
+error:
+    close(listenfd);
+    return -1;
+}
+
+// Create a UDP socket bound to port of every local address, IPv4 and IPv6.
+// Returns -1 on error.
+int
+udp_bind(int port, int reuseport)
+{
+    struct sockaddr_storage servaddr;
+    socklen_t               len;
+    int                     fd, on = 1;
+
+    if ((fd = any_socket(SOCK_DGRAM, port, &servaddr, &len)) < 0)
+        return -1;
+
+#ifdef SO_REUSEPORT
+    if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+        close(fd);
+        return -1;
+    }
+#endif
+
+    if (bind(fd, (struct sockaddr *) &servaddr, len) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// Returns the port a socket is bound to, in host byte order, or -1.
+int
+local_port(int fd)
+{
+    struct endpoint ep;
+
+    if (addr_local(fd, &ep) < 0)
+        return -1;
+
+    return ntohs(ep.port);
+}
+
+static void
+accept_clients(struct reactor *r, int listenfd, int events, void *arg)
+{
+    struct listener         *l = arg;
+    struct sockaddr_storage cliaddr;
+    struct endpoint         ep;
+    socklen_t               len;
+    int                     connfd;
+
+    for ( ; ; ) {
+        len = sizeof(cliaddr);
+        metric_add(NET_SYS_ACCEPT, 1);
+#ifdef SOCK_NONBLOCK
+        connfd = accept4(listenfd, (struct sockaddr *) &cliaddr, &len, l->nonblock ? SOCK_NONBLOCK : 0);
+#else
+        if ((connfd = accept(listenfd, (struct sockaddr *) &cliaddr, &len)) >= 0 && l->nonblock)
+            set_nonblock(connfd);
+#endif
+        if (connfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            // out of descriptors: the clients wait in the backlog
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept error");
+            return;
+        }
+
+        metric_add(NET_ACCEPTED, 1);
+        addr_from(&ep, (struct sockaddr *) &cliaddr);
+        l->cb(r, connfd, &ep, l->arg);
+    }
+}
+
+static void
+accept_done(struct reactor *r, struct uring_op *op, int res, unsigned flags)
+{
+    struct listener *l = (struct listener *) op;
+    struct endpoint ep;
+
+    if (res >= 0) {
+        l->accepted = 1;
+        metric_add(NET_ACCEPTED, 1);
+        if (addr_peer(res, &ep) < 0)
+            bzero(&ep, sizeof(ep));
+        l->cb(r, res, &ep, l->arg);
+    }
+    if (flags & URING_MORE)
+        return;
+    if (l->removed) {
+        free(l);
+        return;
+    }
+
+    // A kernel without the multishot accept refuses the first one; then the
+    // listen socket is polled instead. Otherwise the accept stopped on an
+    // error, running out of descriptors for one, and is started again, or
+    // the socket is polled if it cannot be.
+    if ((res == -EINVAL && !l->accepted) || uring_accept(r, l->fd, l->nonblock, &l->op) < 0) {
+        l->uring = 0;
+        if (reactor_modify(r, l->fd, EV_READ) < 0)
+            perror("reactor error");
+    }
+}
+
+// Accept the clients of a listen socket from the reactor and hand each of
+// them to cb, as a nonblocking socket if nonblock is set. Several processes
+// may share the listen socket; the ones that lose the race get nothing.
+int
+listener_add(struct reactor *r, int listenfd, int nonblock, accept_cb cb, void *arg)
+{
+    struct listener *l;
+
+    if ((l = malloc(sizeof(struct listener))) == NULL)
+        return -1;
+    bzero(l, sizeof(*l));
+    l->op.done = accept_done;
+    l->cb = cb;
+    l->arg = arg;
+    l->fd = listenfd;
+    l->nonblock = nonblock;
+
+    // The handler is registered with io_uring too, waiting for nothing, so
+    // that listener_remove finds the listener.
+    if (set_nonblock(listenfd) < 0 || reactor_add(r, listenfd, 0, accept_clients, l) < 0) {
+        free(l);
+        return -1;
+    }
+    if (r->backend == REACTOR_URING && uring_accept(r, listenfd, nonblock, &l->op) == 0) {
+        l->uring = 1;
+        return 0;
+    }
+    if (reactor_modify(r, listenfd, EV_READ) < 0) {
+        reactor_remove(r, listenfd);
+        free(l);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Stop accepting the clients of a listen socket given to listener_add. The
+// socket stays open, for the caller to close or to hand to another process.
+// A client the kernel accepted just before still goes to the callback.
+int
+listener_remove(struct reactor *r, int listenfd)
+{
+    struct listener *l;
+
+    if (listenfd < 0 || listenfd >= r->nhandlers || r->handlers[listenfd].cb != accept_clients) {
+        errno = EBADF;
+        return -1;
+    }
+    l = r->handlers[listenfd].arg;
+    reactor_remove(r, listenfd);
+
+    if (l->uring) {
+        l->removed = 1;
+        uring_cancel(r, &l->op);
+    }
+    else {
+        free(l);
+    }
+
+    return 0;
+}
@@ -0,0 +1,34 @@
+//
+// The header file for the listener helpers: creating the listen and datagram
+// sockets the way every server needs them, and accepting the clients of a
+// listen socket from the reactor.
+//
+// Author: Tien Ho
+// Date: 12/17/16.
+//
+
+#ifndef LISTENER_H
+#define LISTENER_H
+
+#include "addr.h"
+#include "reactor.h"
+
+// the options of a listen socket; NULL or all zero for the defaults
+struct listenopts {
+    int backlog;                /* 0 for LISTENQ */
+    int reuseport;              /* several sockets may bind the port */
+    int fastopen;               /* TCP_FASTOPEN queue length, 0 if off */
+    int deferaccept;            /* TCP_DEFER_ACCEPT seconds, 0 if off */
+};
+
+// called with each accepted client; the socket is nonblocking if asked for
+typedef void (*accept_cb)(struct reactor *r, int connfd, const struct endpoint *addr, void *arg);
+
+int tcp_listen(int port, const struct listenopts *opts);
+int udp_bind(int port, int reuseport);
+int local_port(int fd);
+int set_nonblock(int fd);
+int listener_add(struct reactor *r, int listenfd, int nonblock, accept_cb cb, void *arg);
+int listener_remove(struct reactor *r, int listenfd);
+
+#endif //LISTENER_H
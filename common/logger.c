@@ -0,0 +1,393 @@
+//
+// The log. Each thread that logs has a ring of records: the thread is the
+// only one to add to it and the writer the only one to take from it, so the
+// two only share the positions in the ring, published with release stores. A
+// record is its length followed by its text, and one that does not fit before
+// the end of the ring starts over at its beginning, after a marker telling
+// the writer to skip the rest.
+//
+// The writer runs in every process that logs, started by the first record,
+// and sleeps while the rings are empty, for LOGGER_PERIOD at most or until a
+// thread finds its ring half full. The records still waiting when the
+// program exits are written by logger_flush, which runs at exit.
+//
+// Author: Tien Ho
+// Date:   12/21/16
+//
+
+#include "logger.h"
+#include "metrics.h"
+#include "net.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifdef CLOCK_MONOTONIC_COARSE
+#define LOGGER_CLOCK    CLOCK_MONOTONIC_COARSE
+#else
+#define LOGGER_CLOCK    CLOCK_MONOTONIC
+#endif
+
+#define HEADER      sizeof(uint32_t)
+#define SKIP        0xffffffffU         /* the rest of the ring is unused */
+#define ALIGN(n)    (((n) + 7) & ~(size_t) 7)
+#define OUTSIZE     (64 * 1024)         /* bytes written at once */
+
+struct ring {
+    char               *data;
+    unsigned long long head;        /* written by the thread of the ring */
+    unsigned long long tail;        /* written by the writer */
+    unsigned long long dropped;     /* the records that did not fit */
+    unsigned long long events;      /* the events seen, for the sampling */
+    long long          second;      /* the second the rate is counted in */
+    int                left;        /* the events the rate still lets through in it */
+    int                dead;        /* its thread has exited */
+    struct ring        *next;
+};
+
+static struct ring          *rings;
+static pthread_mutex_t      lock = PTHREAD_MUTEX_INITIALIZER;  /* the list and the output */
+static pthread_once_t       once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t      idle = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t       wake = PTHREAD_COND_INITIALIZER;
+static int                  sleeping;   /* the writer waits on wake */
+static pthread_key_t        key;
+static int                  started;    /* the writer runs in this process */
+static int                  direct;     /* there is no writer: write at once */
+static int                  threshold = LOGGER_INFO;
+static int                  sample, rate;
+static unsigned long long   gone;       /* the drops of the rings freed */
+static unsigned long long   reported;   /* the drops told so far */
+static char                 out[OUTSIZE];
+static __thread struct ring *mine;
+
+static void
+write_all(const char *data, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = write(STDOUT_FILENO, data, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+// Take the records of the rings into out, as many as fit, and free the rings
+// of the threads that are gone once they are empty. Returns the bytes taken.
+static size_t
+collect(void)
+{
+    struct ring        **pp, *r;
+    unsigned long long head, tail, dropped = gone;
+    uint32_t           len;
+    size_t             n = 0, pos;
+    int                dead;
+
+    for (pp = &rings; (r = *pp) != NULL; ) {
+        dead = __atomic_load_n(&r->dead, __ATOMIC_ACQUIRE);
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        tail = r->tail;
+        while (tail != head) {
+            pos = tail & (LOGGER_RING - 1);
+            if ((len = *(uint32_t *) (r->data + pos)) == SKIP) {
+                tail += LOGGER_RING - pos;
+                continue;
+            }
+            if (n + len > sizeof(out) - 128)
+                break;
+            memcpy(out + n, r->data + pos + HEADER, len);
+            n += len;
+            tail += ALIGN(HEADER + len);
+        }
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+        dropped += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+
+        if (dead && tail == head) {
+            gone += r->dropped;
+            *pp = r->next;
+            free(r->data);
+            free(r);
+        }
+        else {
+            pp = &r->next;
+        }
+    }
+
+    // the room left at the end of out is for this
+    if (dropped > reported) {
+        n += snprintf(out + n, 128, "logger: %llu records dropped\n", dropped - reported);
+        reported = dropped;
+    }
+
+    return n;
+}
+
+// write one batch of records; the lock is let go between the batches
+static size_t
+drain(void)
+{
+    size_t n;
+
+    pthread_mutex_lock(&lock);
+    if ((n = collect()) > 0)
+        write_all(out, n);
+    pthread_mutex_unlock(&lock);
+
+    return n;
+}
+
+static void *
+writer(void *arg)
+{
+    struct timespec ts;
+
+    for ( ; ; ) {
+        if (drain() > 0)
+            continue;
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += LOGGER_PERIOD * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_lock(&idle);
+        __atomic_store_n(&sleeping, 1, __ATOMIC_RELAXED);
+        pthread_cond_timedwait(&wake, &idle, &ts);
+        __atomic_store_n(&sleeping, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&idle);
+    }
+
+    return NULL;
+}
+
+// Write the records waiting in the rings.
+void
+logger_flush(void)
+{
+    while (drain() > 0)
+        ;
+}
+
+// start the writer, with the signals of the program left to its own threads
+static void
+start(void)
+{
+    pthread_t tid;
+    sigset_t  all, old;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    if (pthread_create(&tid, NULL, writer, NULL) == 0)
+        pthread_detach(tid);
+    else
+        direct = 1;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    started = 1;
+}
+
+static void
+detach(void *arg)
+{
+    struct ring *r = arg;
+
+    __atomic_store_n(&r->dead, 1, __ATOMIC_RELEASE);
+}
+
+static void
+before_fork(void)
+{
+    pthread_mutex_lock(&lock);
+}
+
+static void
+after_fork(void)
+{
+    pthread_mutex_unlock(&lock);
+}
+
+// The child has none of the threads of its parent, nor its writer. The
+// records copied from the parent are the parent's to write.
+static void
+in_child(void)
+{
+    struct ring *r;
+
+    while ((r = rings) != NULL) {
+        rings = r->next;
+        free(r->data);
+        free(r);
+    }
+    mine = NULL;
+    pthread_setspecific(key, NULL);
+    pthread_mutex_init(&idle, NULL);
+    sleeping = 0;
+    started = 0;
+    direct = 0;
+    gone = reported = 0;
+    pthread_mutex_unlock(&lock);
+}
+
+static void
+setup(void)
+{
+    const char *s;
+
+    if ((s = getenv("LOGGER_LEVEL")) != NULL) {
+        if (strcmp(s, "debug") == 0)
+            threshold = LOGGER_DEBUG;
+        else if (strcmp(s, "warn") == 0)
+            threshold = LOGGER_WARN;
+        else if (strcmp(s, "error") == 0)
+            threshold = LOGGER_ERROR;
+    }
+    if ((s = getenv("LOGGER_SAMPLE")) != NULL)
+        sample = atoi(s);
+    if ((s = getenv("LOGGER_RATE")) != NULL)
+        rate = atoi(s);
+
+    pthread_key_create(&key, detach);
+    pthread_atfork(before_fork, after_fork, in_child);
+    atexit(logger_flush);
+}
+
+// Read the settings of the log from the environment. The first record does
+// it otherwise.
+void
+logger_init(void)
+{
+    pthread_once(&once, setup);
+}
+
+// the ring of the thread, or NULL if it cannot have one
+static struct ring *
+attach(void)
+{
+    struct ring *r;
+
+    logger_init();
+    if ((r = calloc(1, sizeof(struct ring))) == NULL || (r->data = malloc(LOGGER_RING)) == NULL) {
+        free(r);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&lock);
+    r->next = rings;
+    rings = r;
+    if (!started)
+        start();
+    pthread_mutex_unlock(&lock);
+    pthread_setspecific(key, r);
+    mine = r;
+
+    return r;
+}
+
+// add a record to the ring, unless it is too full for it
+static void
+put(struct ring *r, const char *text, uint32_t len)
+{
+    unsigned long long head = r->head;
+    size_t             need = ALIGN(HEADER + len);
+    size_t             pos = head & (LOGGER_RING - 1);
+    size_t             end = LOGGER_RING - pos;
+
+    if (head + need + (need > end ? end : 0) - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) > LOGGER_RING) {
+        __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+        metric_add(NET_LOG_DROPPED, 1);
+        return;
+    }
+    if (need > end) {
+        *(uint32_t *) (r->data + pos) = SKIP;
+        head += end;
+        pos = 0;
+    }
+    *(uint32_t *) (r->data + pos) = len;
+    memcpy(r->data + pos + HEADER, text, len);
+    __atomic_store_n(&r->head, head + need, __ATOMIC_RELEASE);
+
+    // A wakeup lost to a race only costs the period. The first thread to
+    // see the writer asleep wakes it, the others need not.
+    if (head + need - r->tail > LOGGER_RING / 2 && __atomic_exchange_n(&sleeping, 0, __ATOMIC_RELAXED))
+        pthread_cond_signal(&wake);
+}
+
+static void
+vlog(struct ring *r, const char *fmt, va_list ap)
+{
+    char line[LOGGER_MAXLINE];
+    int  n;
+
+    if ((n = vsnprintf(line, sizeof(line), fmt, ap)) <= 0)
+        return;
+    n = min(n, (int) sizeof(line) - 1);
+
+    if (r == NULL || direct)
+        write_all(line, n);
+    else
+        put(r, line, n);
+}
+
+// Log a record, formatted as by printf.
+void
+logger_msg(int level, const char *fmt, ...)
+{
+    struct ring *r = mine != NULL ? mine : attach();
+    va_list     ap;
+
+    if (level < threshold)
+        return;
+
+    va_start(ap, fmt);
+    vlog(r, fmt, ap);
+    va_end(ap);
+}
+
+// whether the sampling and the rate let another event of the thread through
+static int
+admit(struct ring *r)
+{
+    struct timespec ts;
+
+    if (sample > 1 && r->events++ % sample != 0)
+        return 0;
+    if (rate > 0) {
+        clock_gettime(LOGGER_CLOCK, &ts);
+        if (ts.tv_sec != r->second) {
+            r->second = ts.tv_sec;
+            r->left = rate;
+        }
+        if (r->left == 0)
+            return 0;
+        r->left--;
+    }
+
+    return 1;
+}
+
+// Log a record of an event that comes with every message, if the sampling
+// and the rate limit let it through.
+void
+logger_event(int level, const char *fmt, ...)
+{
+    struct ring *r = mine != NULL ? mine : attach();
+    va_list     ap;
+
+    if (level < threshold)
+        return;
+    if (r != NULL && !admit(r)) {
+        metric_add(NET_LOG_SUPPRESSED, 1);
+        return;
+    }
+
+    va_start(ap, fmt);
+    vlog(r, fmt, ap);
+    va_end(ap);
+}
@@ -0,0 +1,36 @@
+//
+// The header file for the log of the servers. A thread that logs formats the
+// record and puts it into a ring buffer of its own; a background thread takes
+// the records of all the rings and writes them to standard output in large
+// writes. Logging therefore never waits for the output: when standard output
+// is a slow pipe or file and a ring fills up, the records that do not fit are
+// dropped and counted.
+//
+// A record below the level set by LOGGER_LEVEL (debug, info, warn or error;
+// info by default) is not even formatted. The records of the events a server
+// has per message go through logger_event, which also keeps only one in
+// LOGGER_SAMPLE of them and at most LOGGER_RATE of them a second per thread,
+// if these are set. The records left out are counted as well.
+//
+// Author: Tien Ho
+// Date: 12/21/16.
+//
+
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#define LOGGER_DEBUG    0
+#define LOGGER_INFO     1
+#define LOGGER_WARN     2
+#define LOGGER_ERROR    3
+
+#define LOGGER_RING     (256 * 1024)    /* bytes of records a thread may have waiting */
+#define LOGGER_MAXLINE  8192            /* a longer record is cut */
+#define LOGGER_PERIOD   10              /* milliseconds the writer sleeps when idle */
+
+void logger_init(void);
+void logger_msg(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void logger_event(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void logger_flush(void);
+
+#endif //LOGGER_H
@@ -0,0 +1,509 @@
+//
+// The metrics. The counters live in an area mapped shared before the program
+// forks: a block of METRIC_SLOTS counters for each thread that counts, taken
+// the first time it does. A thread is the only writer of its block, so it adds
+// with a plain load and store; the threads that come after the blocks ran out
+// share the last block and add atomically. Reading sums the blocks, which may
+// be a count behind the threads but is never torn.
+//
+// The endpoint is a thread of its own, accepting one request at a time on a
+// TCP port of the local host or on a Unix socket. A server that is replaced
+// hands its endpoint to the new process with its listen sockets; both wait
+// for the socket with poll() and accept without blocking, so that the old
+// one, told to stop, never sits in accept() on a socket it no longer serves.
+//
+// Author: Tien Ho
+// Date:   12/20/16
+//
+
+#include "addr.h"
+#include "metrics.h"
+#include "net.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define SHARED      (METRIC_BLOCKS - 1)     /* the block of the crowded threads */
+
+struct metric {
+    const char *name;           /* with its labels, if any */
+    const char *help;
+    int        type;
+    double     unit;            /* histogram: what a value of 1 is worth */
+};
+
+struct arena {
+    unsigned long long v[METRIC_BLOCKS][METRIC_SLOTS];
+    int                nblocks;
+};
+
+static struct metric                 metrics[METRIC_SLOTS];    /* by id */
+static int                           nslots;
+static struct arena                  *arena;
+static struct arena                  private;   /* if the area cannot be mapped */
+static pthread_once_t                once = PTHREAD_ONCE_INIT;
+static __thread unsigned long long   *mine;
+static __thread int                  crowded;
+static int                           endpointfd = -1;   /* the listen socket of the endpoint */
+static int                           adopted = -1;      /* the endpoint of the process replaced */
+static int                           stopfds[2] = { -1, -1 };
+
+static int
+define(const char *name, const char *help, int type, double unit)
+{
+    int n = type == METRIC_HISTOGRAM ? METRIC_BUCKETS + 1 : 1;
+
+    if (nslots + n > METRIC_SLOTS)
+        return -1;
+    metrics[nslots].name = name;
+    metrics[nslots].help = help;
+    metrics[nslots].type = type;
+    metrics[nslots].unit = unit;
+    nslots += n;
+
+    return nslots - n;
+}
+
+// a child counts into a block of its own
+static void
+forget(void)
+{
+    mine = NULL;
+    crowded = 0;
+}
+
+static void
+setup(void)
+{
+    void *p;
+
+    p = mmap(NULL, sizeof(struct arena), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    arena = p == MAP_FAILED ? &private : p;
+    pthread_atfork(NULL, NULL, forget);
+
+    // in the order of the ids in metrics.h
+    define("net_accepted_total", "Connections accepted.", METRIC_COUNTER, 1);
+    define("net_connections", "Connections open.", METRIC_GAUGE, 1);
+    define("net_received_bytes_total", "Bytes received on the connections.", METRIC_COUNTER, 1);
+    define("net_sent_bytes_total", "Bytes sent on the connections.", METRIC_COUNTER, 1);
+    define("net_queued_bytes", "Bytes written but not yet sent.", METRIC_GAUGE, 1);
+    define("net_dropped_total", "Clients closed for falling too far behind.", METRIC_COUNTER, 1);
+    define("net_events_total", "Events handled by the reactors.", METRIC_COUNTER, 1);
+    define("net_syscalls_total{call=\"accept\"}", "System calls made by the library.", METRIC_COUNTER, 1);
+    define("net_syscalls_total{call=\"read\"}", NULL, METRIC_COUNTER, 1);
+    define("net_syscalls_total{call=\"send\"}", NULL, METRIC_COUNTER, 1);
+    define("net_syscalls_total{call=\"epoll_wait\"}", NULL, METRIC_COUNTER, 1);
+    define("net_syscalls_total{call=\"epoll_ctl\"}", NULL, METRIC_COUNTER, 1);
+    define("net_syscalls_total{call=\"select\"}", NULL, METRIC_COUNTER, 1);
+    define("net_syscalls_total{call=\"io_uring_enter\"}", NULL, METRIC_COUNTER, 1);
+    define("net_log_dropped_total", "Log records dropped for want of room.", METRIC_COUNTER, 1);
+    define("net_log_suppressed_total", "Log records left out by the sampling and the rate limit.",
+           METRIC_COUNTER, 1);
+    define("net_round_seconds", "Time the reactors spend handling the events of a wait.",
+           METRIC_HISTOGRAM, 1e-6);
+}
+
+void
+metrics_init(void)
+{
+    pthread_once(&once, setup);
+}
+
+// Register a metric. A name may carry labels, as in name{label="value"};
+// the metrics of one name are registered one after the other and only the
+// first needs a help text. Returns the id of the metric, or -1 if there is
+// no room for it.
+int
+metric_counter(const char *name, const char *help)
+{
+    metrics_init();
+    return define(name, help, METRIC_COUNTER, 1);
+}
+
+int
+metric_gauge(const char *name, const char *help)
+{
+    metrics_init();
+    return define(name, help, METRIC_GAUGE, 1);
+}
+
+// a histogram of values counted in unit seconds, bytes, ...
+int
+metric_histogram(const char *name, const char *help, double unit)
+{
+    metrics_init();
+    return define(name, help, METRIC_HISTOGRAM, unit);
+}
+
+// the block the thread counts into
+static unsigned long long *
+claim(void)
+{
+    int b;
+
+    metrics_init();
+    b = __atomic_fetch_add(&arena->nblocks, 1, __ATOMIC_RELAXED);
+    crowded = b >= SHARED;
+    mine = arena->v[crowded ? SHARED : b];
+
+    return mine;
+}
+
+static inline void
+add(unsigned long long *v, unsigned long long n)
+{
+    if (crowded)
+        __atomic_fetch_add(v, n, __ATOMIC_RELAXED);
+    else
+        __atomic_store_n(v, __atomic_load_n(v, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+// add n to a counter, or to a gauge, which n may lower
+void
+metric_add(int id, long long n)
+{
+    unsigned long long *v = mine != NULL ? mine : claim();
+
+    if (id >= 0)
+        add(v + id, (unsigned long long) n);
+}
+
+void
+metric_observe(int id, unsigned long long value)
+{
+    unsigned long long *v = mine != NULL ? mine : claim();
+    int                b;
+
+    if (id < 0)
+        return;
+    b = value <= 1 ? 0 : 64 - __builtin_clzll(value - 1);
+    add(v + id + min(b, METRIC_BUCKETS - 1), 1);
+    add(v + id + METRIC_BUCKETS, value);
+}
+
+// the sum of slot over the blocks
+static unsigned long long
+total(int slot)
+{
+    unsigned long long sum = 0;
+    int                b;
+
+    for (b = 0; b < METRIC_BLOCKS; b++)
+        sum += __atomic_load_n(&arena->v[b][slot], __ATOMIC_RELAXED);
+
+    return sum;
+}
+
+// Split the name of a metric into its base name and its labels, which are
+// given with a comma after them if there are any.
+static void
+split(const char *name, char *base, char *labels, size_t size)
+{
+    const char *brace = strchr(name, '{');
+    size_t     n = brace != NULL ? (size_t) (brace - name) : strlen(name);
+
+    snprintf(base, size, "%.*s", (int) n, name);
+    if (brace != NULL)
+        snprintf(labels, size, "%.*s,", (int) strcspn(brace + 1, "}"), brace + 1);
+    else
+        labels[0] = '\0';
+}
+
+static void
+write_histogram(FILE *fp, const struct metric *m, int id, const char *base, const char *labels)
+{
+    unsigned long long count = 0;
+    char               tail[160] = "";
+    int                b;
+
+    for (b = 0; b < METRIC_BUCKETS; b++) {
+        count += total(id + b);
+        if (b < METRIC_BUCKETS - 1)
+            fprintf(fp, "%s_bucket{%sle=\"%.9g\"} %llu\n", base, labels, (double) (1ULL << b) * m->unit, count);
+        else
+            fprintf(fp, "%s_bucket{%sle=\"+Inf\"} %llu\n", base, labels, count);
+    }
+
+    // the sum and the count have the labels without the comma
+    if (labels[0] != '\0')
+        snprintf(tail, sizeof(tail), "{%.*s}", (int) strlen(labels) - 1, labels);
+    fprintf(fp, "%s_sum%s %.9g\n", base, tail, (double) total(id + METRIC_BUCKETS) * m->unit);
+    fprintf(fp, "%s_count%s %llu\n", base, tail, count);
+}
+
+// Write the metrics in the Prometheus text format.
+void
+metrics_write(FILE *fp)
+{
+    static const char *types[] = { "counter", "gauge", "histogram" };
+    struct metric     *m;
+    char              base[128], labels[128], last[128] = "";
+    int               id;
+
+    metrics_init();
+    for (id = 0; id < nslots; id += m->type == METRIC_HISTOGRAM ? METRIC_BUCKETS + 1 : 1) {
+        m = &metrics[id];
+        split(m->name, base, labels, sizeof(base));
+        if (strcmp(base, last) != 0) {
+            if (m->help != NULL)
+                fprintf(fp, "# HELP %s %s\n", base, m->help);
+            fprintf(fp, "# TYPE %s %s\n", base, types[m->type]);
+            strcpy(last, base);
+        }
+
+        if (m->type == METRIC_HISTOGRAM)
+            write_histogram(fp, m, id, base, labels);
+        else if (m->type == METRIC_GAUGE)
+            fprintf(fp, "%s %lld\n", m->name, (long long) total(id));
+        else
+            fprintf(fp, "%s %llu\n", m->name, total(id));
+    }
+}
+
+static int
+send_all(int fd, const char *data, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = send(fd, data, len, MSG_NOSIGNAL)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+// Answer one request. The whole request is read, since closing a socket
+// with unread data resets the connection before the client has the answer.
+static void
+answer(int fd)
+{
+    struct timeval tv;
+    FILE           *fp;
+    char           req[1024], head[128], *body = NULL;
+    size_t         n = 0, len = 0;
+    ssize_t        k;
+    int            hlen;
+
+    // a client that stalls gives up its turn
+    tv.tv_sec = 1;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    req[0] = '\0';
+    while (n < sizeof(req) - 1 && strstr(req, "\r\n\r\n") == NULL && strstr(req, "\n\n") == NULL) {
+        if ((k = recv(fd, req + n, sizeof(req) - 1 - n, 0)) <= 0)
+            break;
+        n += k;
+        req[n] = '\0';
+    }
+
+    if (strncmp(req, "GET /metrics ", 13) != 0 && strncmp(req, "GET / ", 6) != 0) {
+        hlen = snprintf(head, sizeof(head), "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+        send_all(fd, head, hlen);
+        return;
+    }
+
+    if ((fp = open_memstream(&body, &len)) == NULL)
+        return;
+    metrics_write(fp);
+    fclose(fp);
+
+    hlen = snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                    "Content-Length: %zu\r\n\r\n", len);
+    if (send_all(fd, head, hlen) == 0)
+        send_all(fd, body, len);
+    free(body);
+}
+
+static void *
+serve(void *arg)
+{
+    struct pollfd fds[2];
+    int           listenfd = (int) (long) arg;
+    int           connfd;
+
+    fds[0].fd = listenfd;
+    fds[0].events = POLLIN;
+    fds[1].fd = stopfds[0];
+    fds[1].events = POLLIN;
+    for ( ; ; ) {
+        if (poll(fds, 2, -1) < 0)
+            continue;
+        if (fds[1].revents != 0)
+            break;
+        // the other process of a handoff may have taken the request
+        if ((connfd = accept(listenfd, NULL, NULL)) < 0) {
+            // out of descriptors: wait for some to be closed
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+                sleep(1);
+            continue;
+        }
+        fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL, 0) & ~O_NONBLOCK);
+        answer(connfd);
+        close(connfd);
+    }
+
+    close(listenfd);
+    close(stopfds[0]);
+    return NULL;
+}
+
+// whether the listen socket fd is bound to the address sa
+static int
+bound_to(int fd, const struct sockaddr *sa)
+{
+    struct sockaddr_storage ss;
+    struct endpoint         a, b;
+    socklen_t               len = sizeof(ss);
+
+    if (getsockname(fd, (struct sockaddr *) &ss, &len) < 0 || ss.ss_family != sa->sa_family)
+        return 0;
+    if (sa->sa_family == AF_UNIX)
+        return strcmp(((struct sockaddr_un *) &ss)->sun_path, ((const struct sockaddr_un *) sa)->sun_path) == 0;
+
+    addr_from(&a, (struct sockaddr *) &ss);
+    addr_from(&b, sa);
+    return addr_equal(&a, &b);
+}
+
+// Open the endpoint: a Unix socket if endpoint is a path, and otherwise a TCP
+// port, given as "port" for the local host or as "address:port", with an
+// IPv6 address in brackets. Returns -1 on error.
+int
+metrics_serve(const char *endpoint)
+{
+    struct sockaddr_un      un;
+    struct sockaddr_storage in;
+    struct sockaddr         *sa;
+    struct endpoint         ep;
+    socklen_t               salen;
+    pthread_t               tid;
+    sigset_t                all, old;
+    const char              *end;
+    int                     fd, on = 1, err;
+
+    metrics_init();
+    if (endpoint[0] == '/') {
+        if (strlen(endpoint) >= sizeof(un.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        bzero(&un, sizeof(un));
+        un.sun_family = AF_UNIX;
+        strcpy(un.sun_path, endpoint);
+        sa = (struct sockaddr *) &un;
+        salen = sizeof(un);
+    }
+    else {
+        if (strchr(endpoint, ':') == NULL)
+            addr_pton(&ep, "127.0.0.1", atoi(endpoint));
+        else if ((end = addr_scan(endpoint, &ep)) == NULL || *end != '\0') {
+            errno = EINVAL;
+            return -1;
+        }
+        salen = addr_to(&ep, 0, &in);
+        sa = (struct sockaddr *) &in;
+    }
+
+    // serve on the endpoint handed over by the process this one replaces,
+    // if it is the same one
+    if (adopted >= 0 && bound_to(adopted, sa)) {
+        fd = adopted;
+    }
+    else {
+        if (adopted >= 0)
+            close(adopted);
+        if (sa->sa_family == AF_UNIX)
+            unlink(endpoint);
+        if ((fd = socket(sa->sa_family, SOCK_STREAM, 0)) < 0)
+            return -1;
+        if (sa->sa_family != AF_UNIX)
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (bind(fd, sa, salen) < 0 || listen(fd, LISTENQ) < 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    adopted = -1;
+    if (pipe(stopfds) < 0 || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) < 0) {
+        close(fd);
+        return -1;
+    }
+    fcntl(stopfds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(stopfds[1], F_SETFD, FD_CLOEXEC);
+
+    // the signals of the program go to its own threads
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    err = pthread_create(&tid, NULL, serve, (void *) (long) fd);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0) {
+        close(fd);
+        close(stopfds[0]);
+        close(stopfds[1]);
+        errno = err;
+        return -1;
+    }
+    pthread_detach(tid);
+    endpointfd = fd;
+
+    return 0;
+}
+
+// The listen socket of the endpoint, to hand to the process that replaces
+// this one, or -1 if there is none.
+int
+metrics_socket(void)
+{
+    return endpointfd;
+}
+
+// Keep the endpoint handed over by the process this one replaces, to serve
+// on it instead of opening the port again.
+void
+metrics_adopt(int fd)
+{
+    if (adopted >= 0)
+        close(adopted);
+    adopted = fd;
+}
+
+// Stop serving the endpoint, which the process that replaces this one serves.
+void
+metrics_release(void)
+{
+    if (endpointfd < 0)
+        return;
+
+    if (write(stopfds[1], "", 1) < 0)
+        perror("metrics error");
+    close(stopfds[1]);
+    endpointfd = -1;
+}
+
+// Open the endpoint named by METRICS_ENDPOINT, if it is set.
+int
+metrics_start(void)
+{
+    const char *endpoint = getenv("METRICS_ENDPOINT");
+
+    if (endpoint == NULL || endpoint[0] == '\0')
+        return 0;
+
+    return metrics_serve(endpoint);
+}
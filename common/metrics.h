@@ -0,0 +1,66 @@
+//
+// The header file for the metrics of the servers. A metric is a counter, a
+// gauge or a histogram of values on a log2 scale. Each thread adds to a block
+// of counters of its own in a memory area shared with the processes the
+// program forks, so that counting is a plain add without locks or atomic
+// instructions. The blocks are only summed when the metrics are read, by
+// metrics_write or by the endpoint metrics_start opens, which answers HTTP
+// requests with the metrics in the Prometheus text format.
+//
+// The metrics are registered before the program forks or starts threads.
+// A program that forks calls metrics_init first, so that its children count
+// into the same area. A server replaced through a handoff passes its endpoint
+// on to the new process, which serves it from then on.
+//
+// Author: Tien Ho
+// Date: 12/20/16.
+//
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+
+#define METRIC_COUNTER    0
+#define METRIC_GAUGE      1
+#define METRIC_HISTOGRAM  2
+
+#define METRIC_SLOTS    512     /* counters of a thread; a histogram takes METRIC_BUCKETS + 1 */
+#define METRIC_BLOCKS   64      /* threads with a block of their own; the others share one */
+#define METRIC_BUCKETS  24      /* bucket i holds the values up to 2^i, the last one the rest */
+
+// the metrics of the library, registered by metrics_init
+enum {
+    NET_ACCEPTED,
+    NET_CONNECTIONS,
+    NET_BYTES_IN,
+    NET_BYTES_OUT,
+    NET_QUEUED,
+    NET_DROPPED,
+    NET_EVENTS,
+    NET_SYS_ACCEPT,
+    NET_SYS_READ,
+    NET_SYS_SEND,
+    NET_SYS_EPOLL_WAIT,
+    NET_SYS_EPOLL_CTL,
+    NET_SYS_SELECT,
+    NET_SYS_URING_ENTER,
+    NET_LOG_DROPPED,
+    NET_LOG_SUPPRESSED,
+    NET_ROUND                   /* a histogram, so the last one */
+};
+
+void metrics_init(void);
+int  metric_counter(const char *name, const char *help);
+int  metric_gauge(const char *name, const char *help);
+int  metric_histogram(const char *name, const char *help, double unit);
+void metric_add(int id, long long n);
+void metric_observe(int id, unsigned long long value);
+void metrics_write(FILE *fp);
+int  metrics_serve(const char *endpoint);
+int  metrics_start(void);
+int  metrics_socket(void);
+void metrics_adopt(int fd);
+void metrics_release(void);
+
+#endif //METRICS_H
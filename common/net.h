@@ -0,0 +1,28 @@
+//
+// The header file shared by all the programs: the system headers and the
+// limits that every utils.h used to repeat. A program includes its own
+// utils.h, which includes this one and adds what only that program needs.
+//
+// Author: Tien Ho
+// Date: 12/17/16.
+//
+
+#ifndef NET_H
+#define NET_H
+
+#include	<sys/socket.h>	/* basic socket definitions */
+#include	<arpa/inet.h>	/* inet(3) functions */
+#include	<errno.h>
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<string.h>
+#include	<unistd.h>
+
+#define	MAXLINE	    4096	/* max text line length */
+#define	BUFFSIZE    8192	/* buffer size for reads and writes */
+#define LISTENQ       10
+
+#define	min(a,b)	((a) < (b) ? (a) : (b))
+#define	max(a,b)	((a) > (b) ? (a) : (b))
+
+#endif //NET_H
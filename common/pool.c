@@ -0,0 +1,188 @@
+//
+// The memory pool. A chunk on a free list holds the link to the next one, so
+// the lists cost no memory of their own, and the size a chunk is freed with
+// tells its list, so the chunks have no header either. The chunks a thread
+// holds when it exits go to the shared lists.
+//
+// Author: Tien Ho
+// Date:   12/19/16
+//
+
+#include "pool.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NCLASSES    (sizeof(classes) / sizeof(classes[0]))
+
+struct chunk {
+    struct chunk *next;
+};
+
+struct freelist {
+    struct chunk *head;
+    int          n;
+};
+
+static const size_t             classes[] = { 64, 128, 256, 512, 1024, 2048, 4096, 16384 };
+
+static __thread struct freelist cache[NCLASSES];
+static __thread int             registered;
+static struct freelist          shared[NCLASSES];
+static pthread_mutex_t          lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t            key;
+static pthread_once_t           once = PTHREAD_ONCE_INIT;
+
+// the class of the chunks for size, or -1 if size is too large
+static int
+class_of(size_t size)
+{
+    int c;
+
+    for (c = 0; c < (int) NCLASSES; c++) {
+        if (size <= classes[c])
+            return c;
+    }
+
+    return -1;
+}
+
+// The usable size of the memory pool_alloc(size) returns. A buffer that
+// grows can take all of it.
+size_t
+pool_size(size_t size)
+{
+    int c = class_of(size);
+
+    return c < 0 ? size : classes[c];
+}
+
+// move n chunks of the class c from the cache of the thread to the shared list
+static void
+drain(int c, int n)
+{
+    struct chunk *ch;
+
+    pthread_mutex_lock(&lock);
+    while (n-- > 0 && (ch = cache[c].head) != NULL) {
+        cache[c].head = ch->next;
+        cache[c].n--;
+        ch->next = shared[c].head;
+        shared[c].head = ch;
+        shared[c].n++;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+static void
+thread_exit(void *arg)
+{
+    int c;
+
+    for (c = 0; c < (int) NCLASSES; c++)
+        drain(c, cache[c].n);
+}
+
+static void
+make_key(void)
+{
+    pthread_key_create(&key, thread_exit);
+}
+
+// have the chunks of the thread given back when it exits
+static void
+register_thread(void)
+{
+    pthread_once(&once, make_key);
+    pthread_setspecific(key, &registered);
+    registered = 1;
+}
+
+// Fill the cache of the thread with chunks of the class c, from the shared
+// list if it has some and from a new slab otherwise.
+static int
+refill(int c)
+{
+    struct chunk *ch;
+    char         *slab;
+    int          i, n;
+
+    pthread_mutex_lock(&lock);
+    for (n = 0; n < POOL_BATCH && (ch = shared[c].head) != NULL; n++) {
+        shared[c].head = ch->next;
+        shared[c].n--;
+        ch->next = cache[c].head;
+        cache[c].head = ch;
+        cache[c].n++;
+    }
+    pthread_mutex_unlock(&lock);
+    if (n > 0)
+        return 0;
+
+    n = POOL_SLAB / classes[c];
+    if ((slab = malloc(n * classes[c])) == NULL)
+        return -1;
+    for (i = n - 1; i >= 0; i--) {
+        ch = (struct chunk *) (slab + i * classes[c]);
+        ch->next = cache[c].head;
+        cache[c].head = ch;
+    }
+    cache[c].n += n;
+
+    return 0;
+}
+
+void *
+pool_alloc(size_t size)
+{
+    struct chunk *ch;
+    int          c;
+
+    if ((c = class_of(size)) < 0)
+        return malloc(size);
+
+    if (!registered)
+        register_thread();
+    if (cache[c].head == NULL && refill(c) < 0)
+        return NULL;
+
+    ch = cache[c].head;
+    cache[c].head = ch->next;
+    cache[c].n--;
+
+    return ch;
+}
+
+void *
+pool_zalloc(size_t size)
+{
+    void *p;
+
+    if ((p = pool_alloc(size)) != NULL)
+        memset(p, 0, size);
+
+    return p;
+}
+
+// Give back memory from pool_alloc, with the size it was asked for or the
+// size pool_size told.
+void
+pool_free(void *p, size_t size)
+{
+    struct chunk *ch = p;
+    int          c;
+
+    if (p == NULL)
+        return;
+    if ((c = class_of(size)) < 0) {
+        free(p);
+        return;
+    }
+
+    if (!registered)
+        register_thread();
+    ch->next = cache[c].head;
+    cache[c].head = ch;
+    if (++cache[c].n > POOL_CACHE)
+        drain(c, POOL_BATCH);
+}
@@ -0,0 +1,29 @@
+//
+// The header file for the memory pool of the servers. The pool hands out
+// chunks of a few fixed sizes: small ones for the objects a server keeps per
+// connection and 2, 4 and 16 KB ones for the buffers. The chunks are cut
+// from larger slabs and kept on free lists, first in a cache of the thread
+// that freed them and then in lists shared by the threads, so that a server
+// taking and dropping connections does not go to malloc for each of them.
+// Memory from the pool is not cleared; pool_zalloc clears it.
+//
+// Author: Tien Ho
+// Date: 12/19/16.
+//
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+#define POOL_MAXSIZE  16384         /* larger sizes come from malloc */
+#define POOL_CACHE    64            /* chunks of a size a thread keeps */
+#define POOL_BATCH    16            /* chunks moved to or from the shared lists */
+#define POOL_SLAB     (64 * 1024)   /* memory cut into chunks at once */
+
+void   *pool_alloc(size_t size);
+void   *pool_zalloc(size_t size);
+void   pool_free(void *p, size_t size);
+size_t pool_size(size_t size);
+
+#endif //POOL_H
@@ -0,0 +1,526 @@
+//
+// The reactor shared by the servers. Each descriptor has one handler, found
+// by indexing the handlers with the descriptor, and the timers are kept in a
+// min-heap so that the wait ends in time for the earliest one. With epoll,
+// a descriptor waited on for nothing is taken out of the epoll set, since a
+// hung up peer would otherwise keep waking the loop. The io_uring backend is
+// in uring.c.
+//
+// Author: Tien Ho
+// Date:   12/17/16
+//
+
+#include "reactor.h"
+#include "metrics.h"
+#include "uring.h"
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+long long
+reactor_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// the time in microseconds, for measuring
+long long
+reactor_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// the backend named by REACTOR_BACKEND, if any
+static int
+backend_env(void)
+{
+    const char *name = getenv("REACTOR_BACKEND");
+
+    if (name == NULL)
+        return REACTOR_DEFAULT;
+    if (strcmp(name, "io_uring") == 0 || strcmp(name, "uring") == 0)
+        return REACTOR_URING;
+    if (strcmp(name, "epoll") == 0)
+        return REACTOR_EPOLL;
+    if (strcmp(name, "select") == 0)
+        return REACTOR_SELECT;
+
+    return REACTOR_DEFAULT;
+}
+
+int
+reactor_init(struct reactor *r, int backend)
+{
+    bzero(r, sizeof(*r));
+    r->epfd = -1;
+    r->maxfd = -1;
+    FD_ZERO(&r->rset);
+    FD_ZERO(&r->wset);
+
+    if (backend == REACTOR_DEFAULT)
+        backend = backend_env();
+    if (backend == REACTOR_DEFAULT || backend == REACTOR_URING) {
+        if (uring_init(r) == 0) {
+            r->backend = REACTOR_URING;
+            return 0;
+        }
+        backend = REACTOR_DEFAULT;
+    }
+
+#ifdef __linux__
+    if (backend == REACTOR_DEFAULT || backend == REACTOR_EPOLL) {
+        if ((r->epfd = epoll_create1(EPOLL_CLOEXEC)) >= 0) {
+            r->backend = REACTOR_EPOLL;
+            return 0;
+        }
+        if (backend == REACTOR_EPOLL)
+            return -1;
+    }
+#else
+    if (backend == REACTOR_EPOLL) {
+        errno = ENOSYS;
+        return -1;
+    }
+#endif
+
+    r->backend = REACTOR_SELECT;
+    return 0;
+}
+
+const char *
+reactor_name(const struct reactor *r)
+{
+    return r->backend == REACTOR_URING ? "io_uring" : r->backend == REACTOR_EPOLL ? "epoll" : "select";
+}
+
+// make room for the handler of fd
+static int
+grow_handlers(struct reactor *r, int fd)
+{
+    struct handler *h;
+    int            n = r->nhandlers > 0 ? r->nhandlers : 64;
+
+    while (n <= fd)
+        n *= 2;
+    if ((h = realloc(r->handlers, n * sizeof(struct handler))) == NULL)
+        return -1;
+    bzero(h + r->nhandlers, (n - r->nhandlers) * sizeof(struct handler));
+    r->handlers = h;
+    r->nhandlers = n;
+
+    return 0;
+}
+
+// Wait for other events on a registered descriptor.
+static int
+set_events(struct reactor *r, int fd, int old, int events)
+{
+    struct handler     *h;
+#ifdef __linux__
+    struct epoll_event ev;
+    int                op;
+#endif
+
+    // a pending poll is taken back and one for the new events sent; the
+    // poll a handler leaves pending may still complete, but with the old
+    // generation, which is ignored
+    if (r->backend == REACTOR_URING) {
+        h = &r->handlers[fd];
+        if (old == events)
+            return 0;
+        if (h->armed)
+            uring_unpoll(r, fd, h->gen);
+        h->armed = 0;
+        h->gen++;
+        if (events != 0) {
+            if (uring_poll(r, fd, events, h->gen) < 0)
+                return -1;
+            h->armed = 1;
+        }
+        return 0;
+    }
+
+#ifdef __linux__
+    if (r->backend == REACTOR_EPOLL) {
+        if (old == events)
+            return 0;
+        bzero(&ev, sizeof(ev));
+        ev.data.fd = fd;
+        ev.events = (events & EV_READ ? EPOLLIN : 0) | (events & EV_WRITE ? EPOLLOUT : 0);
+        op = old == 0 ? EPOLL_CTL_ADD : events == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+        metric_add(NET_SYS_EPOLL_CTL, 1);
+        return epoll_ctl(r->epfd, op, fd, &ev);
+    }
+#endif
+
+    if (events & EV_READ)
+        FD_SET(fd, &r->rset);
+    else
+        FD_CLR(fd, &r->rset);
+    if (events & EV_WRITE)
+        FD_SET(fd, &r->wset);
+    else
+        FD_CLR(fd, &r->wset);
+    if (events != 0)
+        r->maxfd = max(r->maxfd, fd);
+
+    return 0;
+}
+
+// Register a descriptor to wait on for events, EV_READ and/or EV_WRITE, or
+// for nothing yet. Returns -1 if it cannot be waited on.
+int
+reactor_add(struct reactor *r, int fd, int events, reactor_cb cb, void *arg)
+{
+    if (fd < 0 || (r->backend == REACTOR_SELECT && fd >= FD_SETSIZE)) {
+        errno = EMFILE;
+        return -1;
+    }
+    if (fd >= r->nhandlers && grow_handlers(r, fd) < 0)
+        return -1;
+    if (r->handlers[fd].cb != NULL)
+        reactor_remove(r, fd);
+
+    if (set_events(r, fd, 0, events) < 0)
+        return -1;
+    r->handlers[fd].cb = cb;
+    r->handlers[fd].arg = arg;
+    r->handlers[fd].events = events;
+
+    return 0;
+}
+
+int
+reactor_modify(struct reactor *r, int fd, int events)
+{
+    struct handler *h;
+
+    if (fd < 0 || fd >= r->nhandlers || (h = &r->handlers[fd])->cb == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+    if (set_events(r, fd, h->events, events) < 0)
+        return -1;
+    h->events = events;
+
+    return 0;
+}
+
+// Stop waiting on a descriptor. Call it before closing the descriptor.
+void
+reactor_remove(struct reactor *r, int fd)
+{
+    unsigned gen;
+
+    if (fd < 0 || fd >= r->nhandlers || r->handlers[fd].cb == NULL)
+        return;
+
+    set_events(r, fd, r->handlers[fd].events, 0);
+    gen = r->handlers[fd].gen;
+    bzero(&r->handlers[fd], sizeof(struct handler));
+    r->handlers[fd].gen = gen;
+}
+
+static void
+timer_swap(struct reactor *r, int a, int b)
+{
+    struct rtimer t = r->timers[a];
+
+    r->timers[a] = r->timers[b];
+    r->timers[b] = t;
+}
+
+static void
+timer_up(struct reactor *r, int i)
+{
+    while (i > 0 && r->timers[(i - 1) / 2].when > r->timers[i].when) {
+        timer_swap(r, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void
+timer_down(struct reactor *r, int i)
+{
+    int least, child;
+
+    for ( ; ; ) {
+        least = i;
+        for (child = 2 * i + 1; child <= 2 * i + 2 && child < r->ntimers; child++) {
+            if (r->timers[child].when < r->timers[least].when)
+                least = child;
+        }
+        if (least == i)
+            return;
+        timer_swap(r, i, least);
+        i = least;
+    }
+}
+
+static void
+timer_remove(struct reactor *r, int i)
+{
+    r->timers[i] = r->timers[--r->ntimers];
+    if (i < r->ntimers) {
+        timer_up(r, i);
+        timer_down(r, i);
+    }
+}
+
+// Call cb once in ms milliseconds. Returns the id of the timer, or -1.
+int
+reactor_timer(struct reactor *r, long long ms, timer_cb cb, void *arg)
+{
+    struct rtimer *t;
+    int          n;
+
+    if (r->ntimers == r->maxtimers) {
+        n = r->maxtimers > 0 ? 2 * r->maxtimers : 16;
+        if ((t = realloc(r->timers, n * sizeof(struct rtimer))) == NULL)
+            return -1;
+        r->timers = t;
+        r->maxtimers = n;
+    }
+
+    t = &r->timers[r->ntimers++];
+    t->when = reactor_now() + ms;
+    t->id = ++r->nextid;
+    t->cb = cb;
+    t->arg = arg;
+    timer_up(r, r->ntimers - 1);
+
+    return t->id;
+}
+
+void
+reactor_cancel(struct reactor *r, int id)
+{
+    int i;
+
+    for (i = 0; i < r->ntimers; i++) {
+        if (r->timers[i].id == id) {
+            timer_remove(r, i);
+            return;
+        }
+    }
+}
+
+// call the handler of fd for the events it is still waiting for
+void
+reactor_dispatch(struct reactor *r, int fd, int events)
+{
+    struct handler *h;
+
+    if (fd >= r->nhandlers)
+        return;
+    h = &r->handlers[fd];
+    if (h->cb != NULL && (events &= h->events) != 0)
+        h->cb(r, fd, events, h->arg);
+}
+
+// Wait for events for at most timeout milliseconds (-1 for no limit, or
+// until the earliest timer) and call their handlers, then the handlers of the
+// expired timers. Returns the number of descriptors that were ready, 0 if
+// the wait timed out or was interrupted by a signal, or -1 on error.
+int
+reactor_poll(struct reactor *r, long long timeout)
+{
+    struct timeval     tv;
+    struct rtimer      t;
+    fd_set             rs, ws;
+    long long          now, start;
+    int                n, fd, events;
+#ifdef __linux__
+    struct epoll_event ev[REACTOR_BATCH];
+    int                i;
+#endif
+
+    if (r->ntimers > 0) {
+        now = reactor_now();
+        if (timeout < 0 || r->timers[0].when - now < timeout)
+            timeout = max(r->timers[0].when - now, 0);
+    }
+
+    if (r->backend == REACTOR_URING) {
+        if ((n = uring_wait(r, timeout)) < 0)
+            return -1;
+    }
+#ifdef __linux__
+    else if (r->backend == REACTOR_EPOLL) {
+        n = epoll_wait(r->epfd, ev, REACTOR_BATCH, timeout < 0 ? -1 : (int) min(timeout, 1 << 30));
+        metric_add(NET_SYS_EPOLL_WAIT, 1);
+        if (n < 0 && errno != EINTR)
+            return -1;
+        start = reactor_usec();
+        for (i = 0; i < n; i++) {
+            // an error or a hang up is reported as whatever the handler
+            // waits for, so that its next read or write finds it
+            events = (ev[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP) ? EV_READ : 0) |
+                     (ev[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP) ? EV_WRITE : 0);
+            reactor_dispatch(r, ev[i].data.fd, events);
+        }
+        if (n > 0)
+            metric_observe(NET_ROUND, reactor_usec() - start);
+    }
+    else
+#endif
+    {
+        rs = r->rset;
+        ws = r->wset;
+        if (timeout >= 0) {
+            tv.tv_sec = timeout / 1000;
+            tv.tv_usec = (timeout % 1000) * 1000;
+        }
+        n = select(r->maxfd + 1, &rs, &ws, NULL, timeout < 0 ? NULL : &tv);
+        metric_add(NET_SYS_SELECT, 1);
+        if (n < 0 && errno != EINTR)
+            return -1;
+        start = reactor_usec();
+        for (fd = 0; n > 0 && fd <= r->maxfd; fd++) {
+            events = (FD_ISSET(fd, &rs) ? EV_READ : 0) | (FD_ISSET(fd, &ws) ? EV_WRITE : 0);
+            if (events != 0)
+                reactor_dispatch(r, fd, events);
+        }
+        if (n > 0)
+            metric_observe(NET_ROUND, reactor_usec() - start);
+    }
+
+    // a timer may set another one, which waits for the next round
+    now = reactor_now();
+    while (r->ntimers > 0 && r->timers[0].when <= now) {
+        t = r->timers[0];
+        timer_remove(r, 0);
+        t.cb(r, t.arg);
+    }
+
+    if (n > 0)
+        metric_add(NET_EVENTS, n);
+
+    return max(n, 0);
+}
+
+// The signals a program waits on with reactor_signal. The handler of the
+// signal only writes its number into a pipe, which the reactor reads.
+struct sigwatch {
+    struct reactor *r;
+    signal_cb      cb;
+    void           *arg;
+};
+
+static struct sigwatch sigwatch[NSIG];
+static int             sigfds[2] = { -1, -1 };
+
+static void
+caught(int signo)
+{
+    unsigned char c = signo;
+    int           saved = errno;
+
+    write(sigfds[1], &c, 1);
+    errno = saved;
+}
+
+static void
+signals_ready(struct reactor *r, int fd, int events, void *arg)
+{
+    unsigned char   sigs[64];
+    struct sigwatch *w;
+    ssize_t         i, n;
+
+    while ((n = read(fd, sigs, sizeof(sigs))) > 0) {
+        for (i = 0; i < n; i++) {
+            w = &sigwatch[sigs[i]];
+            if (w->cb != NULL)
+                w->cb(w->r, sigs[i], w->arg);
+        }
+    }
+}
+
+static int
+open_sigfds(struct reactor *r)
+{
+    int i;
+
+    if (pipe(sigfds) < 0)
+        return -1;
+    for (i = 0; i < 2; i++) {
+        fcntl(sigfds[i], F_SETFL, fcntl(sigfds[i], F_GETFL, 0) | O_NONBLOCK);
+        fcntl(sigfds[i], F_SETFD, FD_CLOEXEC);
+    }
+    if (reactor_add(r, sigfds[0], EV_READ, signals_ready, NULL) < 0) {
+        close(sigfds[0]);
+        close(sigfds[1]);
+        sigfds[0] = sigfds[1] = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+// Have cb called from the loop of r when the signal signo arrives, where it
+// may do anything, unlike a signal handler. All the signals of a program are
+// handled by the reactor the first of them was registered with. Returns -1 on
+// error.
+int
+reactor_signal(struct reactor *r, int signo, signal_cb cb, void *arg)
+{
+    struct sigaction sa;
+
+    if (signo <= 0 || signo >= NSIG) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (sigfds[0] < 0 && open_sigfds(r) < 0)
+        return -1;
+
+    sigwatch[signo].r = r;
+    sigwatch[signo].cb = cb;
+    sigwatch[signo].arg = arg;
+
+    bzero(&sa, sizeof(sa));
+    sa.sa_handler = caught;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+
+    return sigaction(signo, &sa, NULL);
+}
+
+// Run the handlers until one of them calls reactor_stop.
+void
+reactor_run(struct reactor *r)
+{
+    r->stop = 0;
+    while (!r->stop) {
+        if (reactor_poll(r, -1) < 0) {
+            perror("reactor error");
+            exit(0);
+        }
+    }
+}
+
+void
+reactor_stop(struct reactor *r)
+{
+    r->stop = 1;
+}
+
+void
+reactor_free(struct reactor *r)
+{
+    if (r->epfd >= 0)
+        close(r->epfd);
+    uring_free(r);
+    free(r->handlers);
+    free(r->timers);
+    bzero(r, sizeof(*r));
+    r->epfd = -1;
+}
@@ -0,0 +1,83 @@
+//
+// The header file for the reactor, the event loop shared by the servers. A
+// program registers a callback for each descriptor it waits on and for each
+// timer, and the reactor calls them as the descriptors become ready and the
+// timers expire. The readiness is found with io_uring or epoll where the
+// system has them and with select() elsewhere, so that the programs do not
+// depend on any of them. The environment variable REACTOR_BACKEND (io_uring,
+// epoll or select) picks another one than the default.
+//
+// Author: Tien Ho
+// Date: 12/17/16.
+//
+
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "net.h"
+#include <sys/select.h>
+
+#define EV_READ          1
+#define EV_WRITE         2
+
+// the ways of waiting for the descriptors
+#define REACTOR_DEFAULT  0      /* io_uring if available, else epoll, else select */
+#define REACTOR_EPOLL    1
+#define REACTOR_SELECT   2
+#define REACTOR_URING    3      /* epoll if io_uring is not available */
+
+#define REACTOR_BATCH   64      /* events taken from epoll at once */
+
+struct reactor;
+
+typedef void (*reactor_cb)(struct reactor *r, int fd, int events, void *arg);
+typedef void (*timer_cb)(struct reactor *r, void *arg);
+typedef void (*signal_cb)(struct reactor *r, int signo, void *arg);
+
+struct handler {
+    reactor_cb cb;              /* NULL if the descriptor is not registered */
+    void       *arg;
+    int        events;
+    unsigned   gen;             /* io_uring: tells the polls of the handler */
+    int        armed;           /* io_uring: a poll is pending */
+};
+
+struct rtimer {
+    long long when;             /* milliseconds, see reactor_now */
+    int       id;
+    timer_cb  cb;
+    void      *arg;
+};
+
+struct uring;
+
+struct reactor {
+    int            backend;
+    int            epfd;
+    struct uring   *ring;       /* io_uring: the queues */
+    fd_set         rset, wset;  /* select: the descriptors waited on */
+    int            maxfd;
+    struct handler *handlers;   /* indexed by descriptor */
+    int            nhandlers;
+    struct rtimer  *timers;     /* a min-heap on when */
+    int            ntimers, maxtimers;
+    int            nextid;
+    int            stop;
+};
+
+int       reactor_init(struct reactor *r, int backend);
+int       reactor_add(struct reactor *r, int fd, int events, reactor_cb cb, void *arg);
+int       reactor_modify(struct reactor *r, int fd, int events);
+void      reactor_remove(struct reactor *r, int fd);
+int       reactor_timer(struct reactor *r, long long ms, timer_cb cb, void *arg);
+void      reactor_cancel(struct reactor *r, int id);
+int       reactor_signal(struct reactor *r, int signo, signal_cb cb, void *arg);
+int       reactor_poll(struct reactor *r, long long timeout);
+void      reactor_run(struct reactor *r);
+void      reactor_stop(struct reactor *r);
+void      reactor_free(struct reactor *r);
+long long reactor_now(void);
+long long reactor_usec(void);
+const char *reactor_name(const struct reactor *r);
+
+#endif //REACTOR_H
@@ -0,0 +1,517 @@
+//
+// The io_uring backend of the reactor. The submission queue entries are
+// filled as the program asks for operations and only handed to the kernel by
+// the next wait, together with the request for completions. A completion
+// carries either the address of the operation it belongs to or, for the
+// polls of the plain handlers, the descriptor and the generation of its
+// handler: a handler that changed what it waits for since gets no stale
+// events.
+//
+// The multishot receives need Linux 6.0; on older kernels, or where
+// io_uring is not allowed, uring_init fails and the reactor uses epoll.
+//
+// Author: Tien Ho
+// Date:   12/18/16
+//
+
+#include "uring.h"
+#include "metrics.h"
+
+#ifdef __linux__
+
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define POLL_TAG    1ULL        /* the user data of a poll has its low bit set */
+#define GEN_MASK    0x7fffffffU
+
+struct uring {
+    int                     fd;
+    unsigned                *sqhead, *sqtail, sqmask, sqentries;
+    unsigned                tail;       /* the entries filled, not yet published */
+    unsigned                pending;    /* the entries not yet submitted */
+    struct io_uring_sqe     *sqes;
+    unsigned                *cqhead, *cqtail, cqmask;
+    struct io_uring_cqe     *cqes;
+    void                    *rings;
+    size_t                  ringsize;
+    size_t                  sqesize;
+    struct io_uring_buf_ring *bufring;  /* the buffers provided to the receives */
+    unsigned short          buftail;
+    char                    *bufs;
+};
+
+static int
+ring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+ring_enter(int fd, unsigned submit, unsigned wait, unsigned flags, void *arg, size_t argsize)
+{
+    metric_add(NET_SYS_URING_ENTER, 1);
+    return (int) syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, argsize);
+}
+
+static int
+ring_register(int fd, unsigned opcode, void *arg, unsigned nargs)
+{
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nargs);
+}
+
+// Returns 1 if the kernel has all the operations the backend uses.
+static int
+probe(int fd)
+{
+    static const int    needed[] = { IORING_OP_POLL_ADD, IORING_OP_POLL_REMOVE, IORING_OP_ACCEPT,
+                                     IORING_OP_RECV, IORING_OP_SEND, IORING_OP_ASYNC_CANCEL,
+                                     IORING_OP_SEND_ZC /* came with the multishot receive */ };
+    struct io_uring_probe *p;
+    size_t                size = sizeof(*p) + 256 * sizeof(struct io_uring_probe_op);
+    int                   i, ok = 1;
+
+    if ((p = calloc(1, size)) == NULL)
+        return 0;
+    if (ring_register(fd, IORING_REGISTER_PROBE, p, 256) < 0) {
+        free(p);
+        return 0;
+    }
+    for (i = 0; i < (int) (sizeof(needed) / sizeof(needed[0])); i++) {
+        if (needed[i] > p->last_op || !(p->ops[needed[i]].flags & IO_URING_OP_SUPPORTED))
+            ok = 0;
+    }
+    free(p);
+
+    return ok;
+}
+
+int
+uring_init(struct reactor *r)
+{
+    struct io_uring_params p;
+    struct uring           *u;
+    unsigned               i;
+
+    if ((u = calloc(1, sizeof(struct uring))) == NULL)
+        return -1;
+
+    // only the thread of the reactor submits, and the completions are
+    // only needed when it waits
+    bzero(&p, sizeof(p));
+    p.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    if ((u->fd = ring_setup(URING_ENTRIES, &p)) < 0) {
+        bzero(&p, sizeof(p));
+        u->fd = ring_setup(URING_ENTRIES, &p);
+    }
+    if (u->fd < 0)
+        goto error;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP) ||
+        !(p.features & IORING_FEAT_EXT_ARG) || !probe(u->fd)) {
+        errno = ENOSYS;
+        goto error;
+    }
+
+    u->ringsize = max(p.sq_off.array + p.sq_entries * sizeof(unsigned),
+                      p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe));
+    u->rings = mmap(NULL, u->ringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->rings == MAP_FAILED)
+        goto error;
+    u->sqesize = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqesize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        munmap(u->rings, u->ringsize);
+        goto error;
+    }
+
+    u->sqhead = (unsigned *) ((char *) u->rings + p.sq_off.head);
+    u->sqtail = (unsigned *) ((char *) u->rings + p.sq_off.tail);
+    u->sqmask = *(unsigned *) ((char *) u->rings + p.sq_off.ring_mask);
+    u->sqentries = p.sq_entries;
+    u->tail = *u->sqtail;
+    u->cqhead = (unsigned *) ((char *) u->rings + p.cq_off.head);
+    u->cqtail = (unsigned *) ((char *) u->rings + p.cq_off.tail);
+    u->cqmask = *(unsigned *) ((char *) u->rings + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *) ((char *) u->rings + p.cq_off.cqes);
+    // the entries are always used in order
+    for (i = 0; i < p.sq_entries; i++)
+        ((unsigned *) ((char *) u->rings + p.sq_off.array))[i] = i;
+
+    r->ring = u;
+    return 0;
+
+error:
+    if (u->fd >= 0)
+        close(u->fd);
+    free(u);
+    return -1;
+}
+
+void
+uring_free(struct reactor *r)
+{
+    struct uring *u = r->ring;
+
+    if (u == NULL)
+        return;
+    if (u->bufring != NULL)
+        munmap(u->bufring, URING_BUFS * sizeof(struct io_uring_buf));
+    free(u->bufs);
+    munmap(u->sqes, u->sqesize);
+    munmap(u->rings, u->ringsize);
+    close(u->fd);
+    free(u);
+    r->ring = NULL;
+}
+
+// hand the filled entries to the kernel, waiting for a completion if wait
+// is set, for at most timeout milliseconds unless it is negative
+static int
+submit(struct uring *u, int wait, long long timeout)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec      ts;
+    int                           n;
+
+    __atomic_store_n(u->sqtail, u->tail, __ATOMIC_RELEASE);
+
+    bzero(&arg, sizeof(arg));
+    if (wait && timeout >= 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000;
+        arg.ts = (unsigned long long) &ts;
+    }
+    n = ring_enter(u->fd, u->pending, wait ? 1 : 0, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                   &arg, sizeof(arg));
+    if (n < 0)
+        return errno == ETIME || errno == EINTR || errno == EBUSY || errno == EAGAIN ? 0 : -1;
+    u->pending -= min((unsigned) n, u->pending);
+
+    return 0;
+}
+
+// the next free submission queue entry, cleared
+static struct io_uring_sqe *
+get_sqe(struct uring *u)
+{
+    struct io_uring_sqe *sqe;
+
+    // the queue is full: make room
+    if (u->tail - __atomic_load_n(u->sqhead, __ATOMIC_ACQUIRE) >= u->sqentries &&
+        (submit(u, 0, 0) < 0 || u->tail - __atomic_load_n(u->sqhead, __ATOMIC_ACQUIRE) >= u->sqentries)) {
+        errno = EBUSY;
+        return NULL;
+    }
+
+    sqe = &u->sqes[u->tail & u->sqmask];
+    bzero(sqe, sizeof(*sqe));
+    u->tail++;
+    u->pending++;
+
+    return sqe;
+}
+
+static unsigned long long
+poll_data(int fd, unsigned gen)
+{
+    return (unsigned long long) fd << 32 | (unsigned long long) (gen & GEN_MASK) << 1 | POLL_TAG;
+}
+
+int
+uring_poll(struct reactor *r, int fd, int events, unsigned gen)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = get_sqe(r->ring)) == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = (events & EV_READ ? POLLIN : 0) | (events & EV_WRITE ? POLLOUT : 0);
+    sqe->user_data = poll_data(fd, gen);
+
+    return 0;
+}
+
+int
+uring_unpoll(struct reactor *r, int fd, unsigned gen)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = get_sqe(r->ring)) == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->addr = poll_data(fd, gen);
+
+    return 0;
+}
+
+int
+uring_accept(struct reactor *r, int fd, int nonblock, struct uring_op *op)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = get_sqe(r->ring)) == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = nonblock ? SOCK_NONBLOCK : 0;
+    sqe->user_data = (unsigned long long) op;
+
+    return 0;
+}
+
+// provide the receive buffer bid to the kernel again
+static void
+provide(struct uring *u, unsigned bid)
+{
+    struct io_uring_buf *b = &u->bufring->bufs[u->buftail & (URING_BUFS - 1)];
+
+    b->addr = (unsigned long long) (u->bufs + bid * URING_BUFSIZE);
+    b->len = URING_BUFSIZE;
+    b->bid = bid;
+    u->buftail++;
+    __atomic_store_n(&u->bufring->tail, u->buftail, __ATOMIC_RELEASE);
+}
+
+// The receive buffers are set up on the first receive, since most of the
+// programs never receive through the ring.
+static int
+setup_buffers(struct uring *u)
+{
+    struct io_uring_buf_reg reg;
+    size_t                  size = URING_BUFS * sizeof(struct io_uring_buf);
+    unsigned                i;
+
+    u->bufring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (u->bufring == MAP_FAILED) {
+        u->bufring = NULL;
+        return -1;
+    }
+    bzero(&reg, sizeof(reg));
+    reg.ring_addr = (unsigned long long) u->bufring;
+    reg.ring_entries = URING_BUFS;
+    reg.bgid = 0;
+    if ((u->bufs = malloc(URING_BUFS * URING_BUFSIZE)) == NULL ||
+        ring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        free(u->bufs);
+        u->bufs = NULL;
+        munmap(u->bufring, size);
+        u->bufring = NULL;
+        return -1;
+    }
+
+    u->buftail = 0;
+    for (i = 0; i < URING_BUFS; i++)
+        provide(u, i);
+
+    return 0;
+}
+
+int
+uring_recv(struct reactor *r, int fd, struct uring_op *op)
+{
+    struct uring        *u = r->ring;
+    struct io_uring_sqe *sqe;
+
+    if ((u->bufs == NULL && setup_buffers(u) < 0) || (sqe = get_sqe(u)) == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = (unsigned long long) op;
+
+    return 0;
+}
+
+int
+uring_send(struct reactor *r, int fd, const void *data, size_t len, struct uring_op *op)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = get_sqe(r->ring)) == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long long) data;
+    sqe->len = len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (unsigned long long) op;
+
+    return 0;
+}
+
+// Stop an operation. Its last completion still comes, with -ECANCELED unless
+// it was finishing anyway.
+int
+uring_cancel(struct reactor *r, struct uring_op *op)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = get_sqe(r->ring)) == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (unsigned long long) op;
+
+    return 0;
+}
+
+// the buffer a receive completion filled
+const char *
+uring_buffer(struct reactor *r, unsigned flags)
+{
+    return r->ring->bufs + (flags >> IORING_CQE_BUFFER_SHIFT) * URING_BUFSIZE;
+}
+
+void
+uring_recycle(struct reactor *r, unsigned flags)
+{
+    if (flags & IORING_CQE_F_BUFFER)
+        provide(r->ring, flags >> IORING_CQE_BUFFER_SHIFT);
+}
+
+// the poll of a plain handler completed
+static void
+polled(struct reactor *r, int fd, unsigned gen, int res)
+{
+    struct handler *h;
+    int            events;
+
+    if (fd >= r->nhandlers)
+        return;
+    h = &r->handlers[fd];
+    if (h->cb == NULL || !h->armed || (h->gen & GEN_MASK) != gen)
+        return;
+
+    // an error is reported as whatever the handler waits for, so that its
+    // next read or write finds it
+    h->armed = 0;
+    if (res < 0)
+        events = h->events;
+    else
+        events = (res & (POLLIN | POLLERR | POLLHUP) ? EV_READ : 0) |
+                 (res & (POLLOUT | POLLERR | POLLHUP) ? EV_WRITE : 0);
+    reactor_dispatch(r, fd, events);
+
+    // the handler may have grown the table, or changed or removed itself
+    h = &r->handlers[fd];
+    if (h->cb != NULL && !h->armed && (h->gen & GEN_MASK) == gen && h->events != 0 &&
+        uring_poll(r, fd, h->events, h->gen) == 0)
+        h->armed = 1;
+}
+
+// Submit the operations asked for and wait for at most timeout milliseconds
+// (-1 for no limit) for completions, then handle them. Returns the number of
+// completions, or -1 on error.
+int
+uring_wait(struct reactor *r, long long timeout)
+{
+    struct uring       *u = r->ring;
+    struct io_uring_cqe cqe;
+    unsigned           head;
+    long long          start;
+    int                n = 0;
+
+    head = *u->cqhead;
+    if (submit(u, timeout != 0 && head == __atomic_load_n(u->cqtail, __ATOMIC_ACQUIRE), timeout) < 0)
+        return -1;
+    start = reactor_usec();
+
+    // each completion is taken off the queue before it is handled, since
+    // the handler may submit and wait again
+    while ((head = *u->cqhead) != __atomic_load_n(u->cqtail, __ATOMIC_ACQUIRE)) {
+        cqe = u->cqes[head & u->cqmask];
+        __atomic_store_n(u->cqhead, head + 1, __ATOMIC_RELEASE);
+
+        if (cqe.user_data == 0)
+            continue;
+        n++;
+        if (cqe.user_data & POLL_TAG)
+            polled(r, (int) (cqe.user_data >> 32), (unsigned) (cqe.user_data >> 1) & GEN_MASK, cqe.res);
+        else
+            ((struct uring_op *) cqe.user_data)->done(r, (struct uring_op *) cqe.user_data, cqe.res, cqe.flags);
+    }
+    if (n > 0)
+        metric_observe(NET_ROUND, reactor_usec() - start);
+
+    return n;
+}
+
+#else
+
+int
+uring_init(struct reactor *r)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+void
+uring_free(struct reactor *r)
+{
+}
+
+int
+uring_wait(struct reactor *r, long long timeout)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int
+uring_poll(struct reactor *r, int fd, int events, unsigned gen)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int
+uring_unpoll(struct reactor *r, int fd, unsigned gen)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int
+uring_accept(struct reactor *r, int fd, int nonblock, struct uring_op *op)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int
+uring_recv(struct reactor *r, int fd, struct uring_op *op)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int
+uring_send(struct reactor *r, int fd, const void *data, size_t len, struct uring_op *op)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int
+uring_cancel(struct reactor *r, struct uring_op *op)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+const char *
+uring_buffer(struct reactor *r, unsigned flags)
+{
+    return NULL;
+}
+
+void
+uring_recycle(struct reactor *r, unsigned flags)
+{
+}
+
+#endif
@@ -0,0 +1,56 @@
+//
+// The header file for the io_uring backend of the reactor. The reactor talks
+// to the kernel through the raw system calls, so nothing beyond the kernel
+// headers is needed. Readiness is waited for with one-shot polls that are
+// armed again after each event, which keeps the meaning of the other
+// backends. The listener and the connections go further and hand the kernel
+// whole operations: a multishot accept, a multishot receive into the buffers
+// the reactor provides, and sends. All of them go to the kernel with the
+// wait, so that a round of the loop costs one system call.
+//
+// Author: Tien Ho
+// Date: 12/18/16.
+//
+
+#ifndef URING_H
+#define URING_H
+
+#include "reactor.h"
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#define URING_MORE      IORING_CQE_F_MORE
+#else
+#define URING_MORE      (1U << 1)
+#endif
+
+#define URING_ENTRIES   256     /* submission queue size */
+#define URING_BUFS      64      /* buffers provided to the receives, a power of 2 */
+#define URING_BUFSIZE   4096
+
+struct uring_op;
+
+// called with the result of each completion of an operation; URING_MORE is
+// set in flags if the operation goes on
+typedef void (*uring_cb)(struct reactor *r, struct uring_op *op, int res, unsigned flags);
+
+struct uring_op {
+    uring_cb done;
+};
+
+int         uring_init(struct reactor *r);
+void        uring_free(struct reactor *r);
+int         uring_wait(struct reactor *r, long long timeout);
+int         uring_poll(struct reactor *r, int fd, int events, unsigned gen);
+int         uring_unpoll(struct reactor *r, int fd, unsigned gen);
+int         uring_accept(struct reactor *r, int fd, int nonblock, struct uring_op *op);
+int         uring_recv(struct reactor *r, int fd, struct uring_op *op);
+int         uring_send(struct reactor *r, int fd, const void *data, size_t len, struct uring_op *op);
+int         uring_cancel(struct reactor *r, struct uring_op *op);
+const char *uring_buffer(struct reactor *r, unsigned flags);
+void        uring_recycle(struct reactor *r, unsigned flags);
+
+// for the backend: call the handler of fd as the other backends do
+void        reactor_dispatch(struct reactor *r, int fd, int events);
+
+#endif //URING_H